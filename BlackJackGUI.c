@@ -1,3 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 /**
  * @file
  * 
@@ -12,6 +15,30 @@
 #include <time.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+#include "policy_plugin.h"
 
 
 #define STRING_SIZE 100       // max size for some strings
@@ -23,16 +50,21 @@
 #define WINDOW_POSY 100       // initial position of the window: y
 #define EXTRASPACE 150
 #define MARGIN 5
+#define FONT_SIZE 16          // font size for the window size above
 
 #define DECK_SIZE 52      // number of max cards in the deck
 #define MAX_NUM_DECKS 6       // max number of decks
 #define MAX_CARD_HAND 11      // 11 cards max. that each player can hold
-#define MAX_PLAYERS 4         // number of maximum players
+#define MAX_PLAYERS 64        // number of maximum players (bits of a seatmask_t)
+#define WINDOW_SEATS 4        // players drawn in the window and sent by the server
+#define PLAYER_NAME_SIZE 16   // "Player N", named by GameInit
+#define CARD_ALIGN 64         // alignment of the state of a table (cache line)
+#define SHOE_POOL_SIZE 4      // shoes shuffled in advance by the shoe pool
 #define MIN_START_MONEY 10    // minimum amount for starting player money
 #define MAX_BET 0.2f           // maximum starting player money fraction that can
                               // be used as bet
 
-// playerState macros
+// player state macros, returned by SeatState
 #define STATES 4
 #define NORMAL 0
 #define BLACKJACK 1
@@ -46,51 +78,1160 @@
 #define LOSSES 2
 #define BALANCE 3
 
+// player policy macros
+#define POLICY_HUMAN 0        // decisions are read from the keyboard
+#define POLICY_DEALER 1       // hits below 17, like the house
+#define POLICY_CAUTIOUS 2     // hits below 12, never risks a bust
+#define POLICY_PLUGIN 3       // decisions are made in batches by a --plugin library
+
+// policy plugin macros, the ABI ones are in policy_plugin.h
+#define PLUGIN_BATCH_TABLES 1024  // tables a simulation worker plays in lockstep
+
+// render mode macros
+#define RENDER_GUI 0          // game is shown in a window
+#define RENDER_NONE 1         // game runs in the console only, no window
+#define RENDER_BENCH 2        // renders offscreen as fast as possible, timing it
+#define DEFAULT_BENCH_FRAMES 2000
+
+// window image macros
+#define NUM_IMAGES (DECK_SIZE + 3)    // cards, card back, table and logo
+#define IMAGE_BACK DECK_SIZE          // card drawn face down
+#define IMAGE_TABLE (DECK_SIZE + 1)   // table background
+#define IMAGE_LOGO (DECK_SIZE + 2)
+#define FONT_FILE "FreeSerif.ttf"
+
+// input recording macros
+#define INPUT_OFF 0
+#define INPUT_RECORD 1        // writes the keys pressed in the GUI to a file
+#define INPUT_REPLAY 2        // plays the keys of a file at full speed
+#define MIN_INPUT_LINE 6      // bytes of the shortest line, "0 0 0\n"
+
+// game engine thread macros
+#define ENGINE_QUEUE_SIZE 256 // commands waiting for the engine thread
+#define ENGINE_STEP -1        // command: a move of the automatic policy or the house
+#define ENGINE_QUIT -2        // command: stops the engine thread
+#define ENGINE_FRAME_FRESH 4  // the latest frame wasn't taken by the renderer yet
+#define FRAME_DELAY 16        // ms between two frames drawn in the window
+
+// render profile entries
+#define PROFILE_FRAME 0
+#define PROFILE_RENDER_TABLE 1
+#define PROFILE_RENDER_CARD 2
+#define PROFILE_RENDER_TEXT 3
+#define NUM_PROFILED 4
+
+// trace macros, only used in builds with -DTRACE
+#define TRACE_CARDS_DRAWN 0
+#define TRACE_RESHUFFLES 1
+#define TRACE_TEXTURES 2      // textures created
+#define TRACE_TEXT_SURFACES 3 // text surfaces rasterized
+#define NUM_TRACE_COUNTERS 4
+#define TRACE_BUFFER_EVENTS 65536 // events kept by each thread (power of 2)
+
+// hardware counter macros, read with --perf 1
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_BRANCH_MISSES 2
+#define PERF_L1D_MISSES 3     // level 1 data cache read misses
+#define PERF_LLC_MISSES 4     // last level cache misses
+#define NUM_PERF_COUNTERS 5
+
+#define DEFAULT_SEED 456      // seed used when none is given
+
+// house rules
+#define DEALER_S17 0          // house stands on every 17
+#define DEALER_H17 1          // house hits a soft 17
+#define MAX_PAYOUT 10         // a blackjack pays at most MAX_PAYOUT times the bet
+
+// expected value macros
+#define EV_VALUES PLUGIN_CARD_VALUES  // distinct card values: 2 to 10 and the ace
+#define EV_OUTCOMES 6         // house final scores: 17, 18, 19, 20, 21 and bust
+#define EV_MEMO_SIZE 4096     // entries of each house outcome memo (power of 2)
+
+// statistics macros
+#define CONFIDENCE_Z 1.96     // normal quantile of a 95% confidence interval
+#define MIN_PRECISION_ROUNDS 1000 // rounds before --precision can stop a run
+#define PRECISION_CHECK_CHUNKS 8  // chunks a worker plays between two checks
+
+// risk of ruin macros
+#define RUIN_OUTCOMES 8       // distinct money results of a hand
+#define RUIN_SAMPLE_ROUNDS 250000 // rounds played to measure the outcomes
+#define RUIN_MAX_STATES (1 << 22) // money states followed at most
+#define RUIN_EPSILON 1e-15    // probability of a state below which it is dropped
+
+// card counting macros
+#define COUNT_NONE -1         // no card counting
+#define NUM_COUNT_SYSTEMS 4   // number of counting systems available
+#define MAX_TRUE_COUNT 10     // true counts are bucketed from -10 to +10
+#define COUNT_BUCKETS (2 * MAX_TRUE_COUNT + 1)
+
+// server macros
+#define SERVER_OFF 0          // plays the game locally
+#define SERVER_RUN 1          // hosts tables for clients on a UNIX socket
+#define SERVER_LOADGEN 2      // load generator client for a running server
+#define DEFAULT_NUM_TABLES 1024
+#define MAX_SERVER_TABLES 65536
+#define SERVER_EVENTS 256     // events handled per epoll_wait call
+#define SERVER_BUFFER 512     // bytes buffered per connection and direction
+
+// results file macros
+#define RESULTS_OFF 0         // no results file
+#define RESULTS_WRITE 1       // writes every hand of a headless run
+#define RESULTS_READ 2        // summarizes a results file
+#define RESULTS_VERSION 1
+#define RESULTS_BLOCK_ROWS 4096   // hands in each block of the results file
+
+// checkpoint macros
+#define CHECKPOINT_VERSION 4
+#define DEFAULT_CHECKPOINT_SECONDS 5
+
+// simulation scheduler macros
+#define MAX_THREADS 256       // maximum number of simulation threads
+#define DEFAULT_CHUNK 64      // rounds of a table played by each task
+
+// shard macros
+#define MAX_SHARDS 256        // maximum number of shard processes
+#define MAX_CPUS 1024         // CPUs the shards can be pinned to
+#define MAX_NODES 64          // NUMA nodes looked for
+#define CPU_WORD_BITS (8 * sizeof(unsigned long))
+#define CPU_MASK_WORDS (MAX_CPUS / CPU_WORD_BITS)
+
+// server request operations
+#define OP_NEW_GAME 1
+#define OP_HIT 2
+#define OP_STAND 3
+#define OP_STATE 4
+#define OP_DOUBLE 5
+
+// server reply status
+#define REPLY_OK 0
+#define REPLY_INVALID 1       // move not allowed now, table unchanged
+
+/**
+ * A card is its number in the deck, 0 to DECK_SIZE - 1 (rank is card % 13,
+ * suit is card / 13), so a byte is enough. Building with -DWIDE_CARDS keeps
+ * the old int cards, to compare the memory footprint and the speed of both.
+ */
+#ifdef WIDE_CARDS
+typedef int card_t;
+#else
+typedef uint8_t card_t;
+#endif
+
+/**
+ * Set of seats of a table: bit i is seat i
+ */
+typedef uint64_t seatmask_t;
+
+/**
+ * States of the players of a table, as sets of seats. Every seat of the table
+ * is in exactly one set, so the next player is the lowest seat of active
+ * after the current one, and a round only goes through the seats that play it.
+ */
+typedef struct {
+    seatmask_t active;        // NORMAL: playing, or standing on the hand
+    seatmask_t blackjack;     // BLACKJACK: has 21
+    seatmask_t busted;        // BUSTED: went over 21
+    seatmask_t broke;         // BROKE: doesn't have enough money to bet
+} SeatStates;
+
+/**
+ * Game options. They can be given in the command line, in a config file or
+ * asked to the user. A zero in numOfDecks, startPlayerMoney or betMoney means
+ * the parameter was not given and has to be asked.
+ */
+typedef struct {
+    int numOfDecks;
+    int startPlayerMoney;
+    int betMoney;
+    unsigned int seed;
+    int policy;
+    int renderMode;
+    int rounds;               // rounds to play, 0 means no limit
+    int showEv;               // 1 shows the expected value panel
+    int countSystem;          // counting system index or COUNT_NONE
+    int dealerRule;           // DEALER_S17 or DEALER_H17
+    int payoutNum;            // a blackjack pays payoutNum to payoutDen
+    int payoutDen;
+    int allowDouble;          // 1 lets players double down
+    int shoePool;             // 1 shuffles shoes in advance on another thread
+    int serverMode;           // SERVER_OFF, SERVER_RUN or SERVER_LOADGEN
+    char socketPath[STRING_SIZE];
+    int numTables;            // tables simulated or hosted at once
+    int threads;              // simulation threads, 0 plays a single table
+    int chunk;                // rounds of a table played by each task
+    int connections;          // load generator connections
+    int requests;             // load generator requests
+    int resultsMode;          // RESULTS_OFF, RESULTS_WRITE or RESULTS_READ
+    char resultsPath[STRING_SIZE];
+    int frames;               // frames rendered by the render benchmark
+    int inputMode;            // INPUT_OFF, INPUT_RECORD or INPUT_REPLAY
+    char inputPath[STRING_SIZE];
+    int replays;              // times the recording is replayed
+    char tracePath[STRING_SIZE];      // Chrome trace file, empty if not tracing
+    int exact;                // 1 computes the exact expected value instead of playing
+    char checkpointPath[STRING_SIZE]; // checkpoint file, empty if not checkpointing
+    int checkpointSeconds;    // time between two checkpoints
+    char resumePath[STRING_SIZE];     // checkpoint to resume from, empty if none
+    int comparePolicy;        // policy compared with policy, POLICY_HUMAN if none
+    double precision;         // house edge interval (% of the bet) that stops
+                              // the run, 0 plays every round
+    int ruinRounds;           // rounds followed by the risk of ruin solver, 0 if off
+    int perf;                 // 1 reads the hardware counters of the benchmarks
+    char pluginPath[STRING_SIZE];     // policy plugin, empty if none
+    int shards;               // simulation processes, 0 simulates in this one
+    int seats;                // players at each table
+    int memoryReport;         // 1 prints the memory held by the window and the game
+    int lowMemory;            // 1 frees the pixels of the images once uploaded
+} GameOptions;
+
+/**
+ * Time spent in the render functions, only measured by the render benchmark.
+ * Times are inclusive: RenderTable also counts the RenderText calls it makes.
+ */
+typedef struct {
+    bool enabled;
+    long long calls[NUM_PROFILED];
+    double seconds[NUM_PROFILED];
+} RenderProfile;
+
+/**
+ * Hardware counters of a thread and of the threads it starts afterwards,
+ * read with perf_event_open. Counters the kernel doesn't allow or the
+ * processor doesn't have are left closed, so the timings are still printed.
+ */
+typedef struct {
+    int fds[NUM_PERF_COUNTERS];       // -1 if the counter couldn't be opened
+    double values[NUM_PERF_COUNTERS]; // counts of the last run, -1 if unknown
+    bool enabled;             // at least one counter is open
+} PerfCounters;
+
+#ifdef TRACE
+/**
+ * Trace event: a scope that ended or, without a name, the counters of a
+ * thread. Times are in nanoseconds since the trace started.
+ */
+typedef struct {
+    const char * name;                // NULL for a counters event
+    uint64_t start;
+    uint64_t duration;
+    uint32_t counters[NUM_TRACE_COUNTERS];    // counted since the last event
+} TraceEvent;
+
+/**
+ * Trace events of one thread. Only its thread writes to the ring, so no lock
+ * is needed; once it is full the oldest events are overwritten.
+ */
+typedef struct TraceBuffer {
+    struct TraceBuffer * next;        // list of the buffers of every thread
+    int tid;
+    uint64_t written;                 // events written so far
+    uint32_t counters[NUM_TRACE_COUNTERS];
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+/**
+ * Scope being timed, ended by TraceEnd when the variable goes out of scope
+ */
+typedef struct {
+    const char * name;                // NULL if not tracing
+    uint64_t start;
+} TraceScope;
+
+#define TRACE_JOIN(a, b) a ## b
+#define TRACE_NAME(line) TRACE_JOIN(traceScope, line)
+#define TRACE_SCOPE(name) TraceScope TRACE_NAME(__LINE__) \
+    __attribute__((cleanup(TraceEnd))) = TraceBegin(name)
+#define TRACE_COUNT(counter, n) TraceCount(counter, n)
+#define TRACE_COUNTERS() TraceCounters()
+#else
+// without -DTRACE the trace scopes and counters compile to nothing
+#define TRACE_SCOPE(name)
+#define TRACE_COUNT(counter, n) ((void) 0)
+#define TRACE_COUNTERS() ((void) 0)
+#endif
+
+/**
+ * Layout table: where everything is drawn in the window, in pixels. It is
+ * computed by ComputeLayout when the window is created or resized, so the
+ * render functions only read it.
+ */
+typedef struct {
+    int width;                        // size of the renderer output in pixels
+    int height;
+    int fontSize;
+    int textX;                        // left of the text in the right panel
+    int evPanelY;                     // top of the expected value panel
+    SDL_Rect table;                   // table background, left of the panel
+    SDL_Rect logo;
+    SDL_Rect seats[WINDOW_SEATS];             // area of each player
+    SDL_Point seatLabels[WINDOW_SEATS];       // name and money of each player
+    SDL_Rect banners[WINDOW_SEATS];           // bust or blackjack banner
+    SDL_Point bustText[WINDOW_SEATS];
+    SDL_Point blackjackText[WINDOW_SEATS];
+    SDL_Rect playerCards[WINDOW_SEATS][MAX_CARD_HAND];
+    SDL_Rect houseCards[MAX_CARD_HAND + 1][MAX_CARD_HAND];  // by cards in the hand
+} Layout;
+
+/**
+ * Images drawn in the window, indexed by card number, IMAGE_BACK, IMAGE_TABLE
+ * and IMAGE_LOGO. Each one is uploaded once as a texture of the renderer; the
+ * pixels loaded from its file are only kept to upload it again if the
+ * renderer loses its textures, and --low-memory gives them back.
+ */
+typedef struct {
+    SDL_Surface * surfaces[NUM_IMAGES];   // NULL once released
+    SDL_Texture * textures[NUM_IMAGES];
+} Images;
+
+/**
+ * Key pressed in the GUI: the step of the game it was handled in, its time
+ * since the start and its SDL key code
+ */
+typedef struct {
+    int frame;
+    uint32_t ticks;
+    int key;
+} InputEvent;
+
+/**
+ * Recording of the keys pressed in the GUI, being written or replayed
+ */
+typedef struct {
+    int mode;                         // INPUT_RECORD or INPUT_REPLAY
+    FILE * file;                      // file being recorded
+    uint32_t startTicks;
+    InputEvent * events;              // events being replayed
+    int numEvents;
+    int next;                         // next event to replay
+    int replays;                      // times the events are replayed
+    int replay;                       // current replay
+    int frameOffset;                  // first frame of the current replay
+    double frameStart;                // frame time statistics of the replay
+    double frameSeconds;
+    double maxFrameSeconds;
+    long long frames;
+} InputLog;
+
+/**
+ * Fixed size memory arena: memory is handed out in order from one block
+ * allocated at the start and given back all at once
+ */
+typedef struct {
+    unsigned char * base;
+    size_t size;
+    size_t used;
+} Arena;
+
+/**
+ * Shoes of one table shuffled in advance by a background thread
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;             // a shoe was shuffled
+    pthread_cond_t taken;             // a shoe was taken by the table
+    pthread_t thread;
+    bool quit;
+    int head;                         // next shoe to take
+    int count;                        // shoes ready to take
+    int numOfDecks;
+    uint64_t key;                     // random stream of the table
+    uint64_t nextShoe;                // number of the next shoe to shuffle
+    card_t shoes[SHOE_POOL_SIZE][DECK_SIZE * MAX_NUM_DECKS];
+} ShoePool;
+
+/**
+ * Where a table gets its shoes from. Shoe n of a table is always shuffled
+ * with the random numbers of (key, n), so the cards are the same whether the
+ * shoe comes from the pool or is shuffled when needed.
+ */
+typedef struct {
+    uint64_t key;                     // random stream of the table
+    uint64_t shoesDealt;              // number of the next shoe
+    ShoePool * pool;                  // NULL shuffles when needed
+} ShoeSource;
+
+/**
+ * Streaming mean and variance of a series of samples (Welford). Two of them
+ * are merged into the statistics of both series, so tables and threads keep
+ * their own and add them up at the end.
+ */
+typedef struct {
+    long long count;
+    double mean;
+    double m2;                        // sum of squared distances to the mean
+} RunningStats;
+
+/**
+ * House loop of a rule set: takes cards for the house and returns its score
+ */
+typedef int (*DealerPlay)(card_t [], int *, int, ShoeSource *, card_t [], int *);
+
+/**
+ * House rules of a table, fixed when the table is created. The dealer rule is
+ * a choice of house loop, so the loop itself doesn't test any rule.
+ */
+typedef struct {
+    DealerPlay dealerPlay;    // HouseStandsSoft17 or HouseHitsSoft17
+    int payoutNum;            // a blackjack pays bet * payoutNum / payoutDen
+    int payoutDen;
+    bool allowDouble;
+} RuleSet;
+
+/**
+ * State of one game table: card stack, hands and money of every player and
+ * the house
+ */
+typedef struct {
+    card_t cardStack[DECK_SIZE * MAX_NUM_DECKS];
+    int stackTopCard;
+    int numOfDecks;
+    int currentPlayer;
+    int id;                   // number of the table
+    int roundsPlayed;
+    ShoeSource shoe;          // shuffled shoes of the table
+    /** 
+     * Player States, as sets of seats (SeatState gives the state of one seat):
+     * 
+     * NORMAL - Player is playing,
+     * BLACKJACK - Player has a blackjack,
+     * BUSTED - Player is busted,
+     * BROKE - Player doesn't have enough money to bet
+     *
+     * Only the first options->seats seats are in a set, the others are empty.
+     */
+    SeatStates seats;
+    int playerMoney[MAX_PLAYERS];
+    int playerBet[MAX_PLAYERS];       // bet of the round, doubled on a double down
+    int playerScore[MAX_PLAYERS];
+    /**
+     * Player Stats:
+     * 
+     * WINS - Number of player wins,
+     * DRAWS - Number of player draws
+     * LOSSES - Number of player losses
+     * BALANCE - Money house won with this player
+     */
+    int playerStats[MAX_PLAYERS][STATS];
+    RunningStats seatProfit[MAX_PLAYERS];    // money won per round by each seat, in bets
+    RunningStats roundProfit;         // money won per hand in each round, in bets
+    card_t playerCards[MAX_PLAYERS][MAX_CARD_HAND];
+    int posPlayerHand[MAX_PLAYERS];
+    card_t houseCards[MAX_CARD_HAND];
+    int posHouseHand;
+    int houseScore;
+    RuleSet rules;
+} __attribute__((aligned(CARD_ALIGN))) Table;
+
+/**
+ * Tag based card counting system: every card rank adds its tag to the count
+ */
+typedef struct {
+    const char * name;
+    int tags[13];             // tag of each rank, from 2 to ace
+} CountSystem;
+
+/**
+ * Running count of the cards dealt from the card stack since the last shuffle
+ */
+typedef struct {
+    const CountSystem * system;
+    int runningCount;
+    int initialCount;         // running count of a new stack
+    bool balanced;            // the tags of a deck add up to 0
+    int countedTo;            // cards of the stack already counted
+    uint64_t countedShoe;     // shoesDealt when the stack was counted
+} CardCounter;
+
+/**
+ * Player results for each true count at the start of a round
+ */
+typedef struct {
+    CardCounter counter;
+    long long hands[COUNT_BUCKETS];   // hands played
+    long long profit[COUNT_BUCKETS];  // money won by the players
+    long long wins[COUNT_BUCKETS];
+    long long losses[COUNT_BUCKETS];
+} CountReport;
+
+/**
+ * Header at the start of a results file
+ */
+typedef struct {
+    char magic[8];                    // "BJRESULT"
+    uint32_t version;                 // RESULTS_VERSION
+    uint32_t blockRows;               // RESULTS_BLOCK_ROWS
+    uint32_t numOfDecks;
+    uint32_t betMoney;
+    uint64_t seed;
+} ResultsHeader;
+
+/**
+ * Block of a results file: the hands are stored by column, every column has
+ * RESULTS_BLOCK_ROWS entries and only the first rows are used. The file is
+ * the header followed by whole blocks, so a block is read in place from the
+ * mapped file.
+ */
+typedef struct {
+    uint32_t rows;                    // hands stored in the block
+    uint32_t padding;
+    uint64_t round[RESULTS_BLOCK_ROWS];       // table << 32 | round of the table
+    int32_t payout[RESULTS_BLOCK_ROWS];       // money won (or lost) by the seat
+    uint8_t seat[RESULTS_BLOCK_ROWS];
+    uint8_t firstCard[RESULTS_BLOCK_ROWS];    // card numbers, like card_t
+    uint8_t secondCard[RESULTS_BLOCK_ROWS];
+    uint8_t numCards[RESULTS_BLOCK_ROWS];
+    uint8_t score[RESULTS_BLOCK_ROWS];        // final score of the seat
+    uint8_t houseScore[RESULTS_BLOCK_ROWS];
+    uint8_t state[RESULTS_BLOCK_ROWS];        // player state after the round
+} ResultsBlock;
+
+/**
+ * Header at the start of a checkpoint file, followed by a TableSnapshot per
+ * table. It holds the options that make the game, which a resumed game takes
+ * from the checkpoint. Its size is a multiple of the table alignment, so the
+ * snapshots are read in place from the mapped file.
+ */
+typedef struct {
+    char magic[8];                    // "BJCHKPNT"
+    uint32_t version;                 // CHECKPOINT_VERSION
+    uint32_t snapshotSize;            // sizeof(TableSnapshot), changes with -DWIDE_CARDS
+    uint32_t numTables;
+    int32_t numOfDecks;
+    int32_t startPlayerMoney;
+    int32_t betMoney;
+    uint64_t seed;
+    int32_t policy;
+    int32_t countSystem;
+    int32_t dealerRule;
+    int32_t payoutNum;
+    int32_t payoutDen;
+    int32_t allowDouble;
+    int32_t seats;
+} __attribute__((aligned(CARD_ALIGN))) CheckpointHeader;
+
+/**
+ * Copy of a table, with its count report, published between two chunks of
+ * rounds. It is written with a sequence lock, so the checkpoint thread copies
+ * it without ever stopping the thread playing the table.
+ */
+typedef struct {
+    uint32_t sequence;                // odd while the copy is being written
+    Table table;
+    CountReport countReport;          // unused if the cards aren't counted
+} TableSnapshot;
+
+/**
+ * Checkpoint thread: writes the last published snapshot of every table to
+ * the checkpoint file every few seconds
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool quit;
+    GameOptions * options;
+    TableSnapshot * snapshots;        // published by the game, one per table
+    int numTables;
+    Arena arena;                      // memory of the blob
+    unsigned char * blob;             // header and snapshots, written at once
+    size_t blobSize;
+    long long checkpoints;            // checkpoints written
+    double writeSeconds;              // time spent writing them
+} Checkpointer;
+
+/**
+ * State of the table drawn by the renderer: a copy made by the engine thread
+ * after each command, never changed while it is drawn
+ */
+typedef struct {
+    Table table;
+    bool gameHasEnded;
+    bool finished;                    // the rounds to play are over
+} EngineFrame;
+
+/**
+ * Game engine thread: plays the table in the window, following the commands
+ * of the main thread, and hands its frames to the renderer through a triple
+ * buffer
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;             // a command was queued
+    pthread_cond_t taken;             // a command was taken out of a full queue
+    pthread_t thread;
+    int head;                         // next command to take
+    int count;                        // commands queued
+    int commands[ENGINE_QUEUE_SIZE];  // SDL key codes, ENGINE_STEP or ENGINE_QUIT
+    GameOptions * options;
+    Table * table;                    // only used by the engine thread once started
+    TableSnapshot * snapshot;         // checkpoint of the table, NULL if none
+    bool gameHasEnded;
+    bool houseHasPlayed;
+    bool finished;
+    EngineFrame frames[3];
+    int back;                         // frame written by the engine
+    int middle;                       // latest frame, ENGINE_FRAME_FRESH if new
+    int front;                        // frame drawn by the renderer
+} Engine;
+
+/**
+ * Money results of one hand and their probabilities, measured on the engine
+ */
+typedef struct {
+    int numOutcomes;
+    int money[RUIN_OUTCOMES];         // money won, negative if lost
+    long long hands[RUIN_OUTCOMES];   // hands that ended with it
+    double prob[RUIN_OUTCOMES];
+} OutcomeDistribution;
+
+/**
+ * Policy plugin loaded by LoadPlugin
+ */
+typedef struct {
+    void * handle;
+    void (*decideBatch)(const PolicyBatch *, uint8_t []);
+} PolicyPlugin;
+
+/**
+ * Table of a batch played in lockstep for a policy plugin
+ */
+typedef struct {
+    Table * table;
+    CountReport * countReport;        // NULL if the cards aren't counted
+    int number;                       // number of the table in the simulation
+    int rounds;                       // rounds to play
+    int played;                       // rounds played
+    bool inRound;                     // dealt in the current round
+    int trueCount;                    // at the start of the round
+    int startMoney[MAX_PLAYERS];
+    seatmask_t seated;                // seats that play the round
+    RunningStats total;               // roundProfit before the batch, with --precision
+    int32_t unseen[EV_VALUES];        // cards past stackTopCard of each value
+    int countedTo;                    // stackTopCard when unseen was counted
+    uint64_t countedShoe;             // shoesDealt when unseen was counted
+} BatchTable;
+
+/**
+ * Batch of tables played by a simulation worker with a policy plugin, and
+ * the decisions of the current move of each one
+ */
+typedef struct {
+    int numTables;
+    BatchTable tables[PLUGIN_BATCH_TABLES];
+    int pending[PLUGIN_BATCH_TABLES];         // tables still deciding, and the
+                                              // table of each decision
+    int32_t total[PLUGIN_BATCH_TABLES];
+    uint8_t soft[PLUGIN_BATCH_TABLES];
+    uint8_t numCards[PLUGIN_BATCH_TABLES];
+    uint8_t canDouble[PLUGIN_BATCH_TABLES];
+    int32_t upCard[PLUGIN_BATCH_TABLES];
+    int32_t shoe[EV_VALUES][PLUGIN_BATCH_TABLES];
+    uint8_t actions[PLUGIN_BATCH_TABLES];
+} DecisionBatch;
+
+/**
+ * Results file open for writing, shared by every thread
+ */
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;             // a block is written at a time
+    long long blocks;                 // blocks written
+} ResultsWriter;
+
+/**
+ * Block being filled by one thread before it is appended to the file
+ */
+typedef struct {
+    ResultsWriter * writer;
+    ResultsBlock block;
+} ResultsBuffer;
+
+/**
+ * Memoized result of the expected value calculator: house outcome
+ * probabilities, or the expected value of hitting in outcome[0]
+ */
+typedef struct {
+    uint64_t key;                     // packed cards, 0 if the entry is free
+    int generation;                   // entries of other generations are free
+    double outcome[EV_OUTCOMES];      // probability of each house final score
+} EvMemoEntry;
+
+/**
+ * Hand to be evaluated by the expected value calculator
+ */
+typedef struct {
+    int counts[EV_VALUES];            // unseen cards of each value
+    int cardsLeft;                    // number of unseen cards
+    int total;                        // player score counting soft aces as 11
+    int softAces;                     // player aces still counted as 11
+    int upCard;                       // value of the house face up card
+    int fullShoe[EV_VALUES];          // composition after a reshuffle
+} EvRequest;
+
+/**
+ * Expected values of hitting and standing for the current player. They are
+ * computed by a worker thread, only when the cards on the table change, so
+ * rendering never waits for them.
+ */
+typedef struct {
+    // shared with the worker thread, protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t worker;
+    bool hasRequest;                  // request not taken by the worker yet
+    bool isValid;                     // evHit and evStand match the table
+    bool quit;
+    int stackTopCard;                 // table state of the last request
+    int player;
+    int numCardsInHand;
+    int upCard;
+    EvRequest request;
+    double evHit;
+    double evStand;
+
+    // only used by the worker thread
+    int fullShoe[EV_VALUES];
+    bool hitSoft17;                   // house rule, fixed at the start
+    int generation;                   // current generation of drawMemo
+    EvMemoEntry memo[EV_MEMO_SIZE];     // by composition of unseen cards
+    EvMemoEntry drawMemo[EV_MEMO_SIZE]; // by cards drawn by the house
+    EvMemoEntry hitMemo[EV_MEMO_SIZE];  // hit values by unseen cards
+    EvMemoEntry scratch;                // used when a memo is full
+} EvCache;
+
+/**
+ * Exact expected value of a hand off the top of the shoe, computed by
+ * enumeration with one up card at a time on several threads
+ */
+typedef struct {
+    GameOptions * options;
+    int fullShoe[EV_VALUES];          // cards of each value in the shoe
+    int cardsInShoe;
+    double blackjackPays;             // per unit bet, rounded down like HouseTurn
+    int nextUpCard;                   // next up card to enumerate (atomic)
+    double policyEv[EV_VALUES];       // expected value of the policy by up card
+    double bestEv[EV_VALUES];         // expected value of the best play by up card
+} ExactJob;
+
+/**
+ * Server request: one operation on the table of the connection
+ */
+typedef struct {
+    uint8_t op;                       // OP_NEW_GAME, OP_HIT, OP_STAND or OP_STATE
+    uint8_t padding[3];
+    uint32_t seq;                     // returned in the reply
+} ServerRequest;
+
+/**
+ * Server reply: whole visible state of the table after the request. The
+ * house face down card is sent as DECK_SIZE (card back) until the house plays.
+ */
+typedef struct {
+    uint32_t seq;
+    uint8_t status;                   // REPLY_OK or REPLY_INVALID
+    int8_t currentPlayer;             // -1 when no player is playing
+    uint8_t gameHasEnded;
+    uint8_t houseScore;               // only valid once the house played
+    int32_t playerMoney[WINDOW_SEATS];
+    uint8_t playerState[WINDOW_SEATS];
+    uint8_t playerScore[WINDOW_SEATS];
+    uint8_t posPlayerHand[WINDOW_SEATS];
+    uint8_t posHouseHand;
+    uint8_t houseCards[MAX_CARD_HAND];
+    uint8_t playerCards[WINDOW_SEATS][MAX_CARD_HAND];
+} ServerReply;
+
+/**
+ * Connection to the server with the table it plays
+ */
+typedef struct {
+    int fd;                           // -1 if the session is free
+    Table * table;
+    bool gameHasEnded;
+    bool houseHasPlayed;
+    int inUsed;
+    int outUsed;
+    unsigned char in[SERVER_BUFFER];
+    unsigned char out[SERVER_BUFFER];
+} Session;
+
+/**
+ * Server state: the sessions are preallocated and reused
+ */
+typedef struct {
+    Session * sessions;
+    int * freeSessions;               // indices of the free sessions (stack)
+    int numFree;
+    int maxSessions;
+    int epollFd;
+    long long servedTables;           // connections accepted so far
+    long long servedRequests;
+} Server;
+
+/**
+ * Simulation worker thread with its deque of tasks. A task is the number of
+ * a table that has rounds left to play.
+ */
+typedef struct {
+    pthread_mutex_t lock;             // protects the deque
+    int * tasks;                      // ring buffer of table numbers
+    int head;                         // oldest task, taken by thieves
+    int count;                        // tasks in the deque
+    pthread_t thread;
+    int id;
+    uint64_t rngState;                // picks the workers to steal from
+    struct Scheduler * scheduler;
+    long long tasksRun;               // statistics of the worker
+    long long steals;
+    long long roundsPlayed;
+    double busySeconds;
+    double idleSeconds;               // parked in WaitForTasks
+    ResultsBuffer * results;          // NULL if not writing results
+    RunningStats roundProfit;         // rounds played, with --precision
+    int uncheckedChunks;              // chunks added since the last check
+    uint32_t sequence;                // odd while publishedProfit is written
+    RunningStats publishedProfit;     // roundProfit at the last check
+    DecisionBatch * batch;            // tables played together, NULL without a plugin
+} Worker;
+
+/**
+ * Work-stealing scheduler of a simulation
+ */
+typedef struct Scheduler {
+    GameOptions * options;
+    Table * tables;
+    CountReport * countReports;       // one per table, NULL if not counting
+    ResultsWriter * results;          // NULL if not writing results
+    TableSnapshot * snapshots;        // one per table, NULL if not checkpointing
+    Worker * workers;
+    int numWorkers;
+    int unfinished;                   // tables with rounds left (atomic)
+    int stop;                         // the precision was reached (atomic)
+    pthread_mutex_t idleLock;         // parks the workers with nothing to steal
+    pthread_cond_t idle;
+    int idleWorkers;                  // workers parked or parking (atomic)
+    int wakeUps;                      // tasks pushed and other changes (atomic)
+} Scheduler;
+
+/**
+ * Results of a shard process, written by the shard to the shared memory of
+ * the simulation and added up by the coordinator. Each one fills its own
+ * cache lines.
+ */
+typedef struct {
+    int firstTable;                   // plays tables firstTable to
+    int numTables;                    // firstTable + numTables - 1
+    int firstCpu;                     // CPUs it was pinned to, -1 if it wasn't
+    int numCpus;
+    int node;                         // NUMA node of its first CPU
+    int done;                         // the results are complete (atomic)
+    long long roundsPlayed;
+    double seconds;
+    int playerStats[MAX_PLAYERS][STATS];
+    RunningStats seatProfit[MAX_PLAYERS];
+    RunningStats roundProfit;
+    CountReport countReport;          // true count histograms, if counting
+} __attribute__((aligned(CARD_ALIGN))) ShardResult;
+
+// arena macros
+#define ARENA_ALIGN 64        // every block starts on its own cache line
+// memory for everything the game allocates: table, count report, the
+// expected value calculator, the shoe pool, the results buffer, the
+// snapshot of the table and the engine thread; the keys of a replay are
+// added to it
+#define GAME_ARENA_SIZE (sizeof(Table) + sizeof(CountReport) + sizeof(EvCache) \
+    + sizeof(ShoePool) + sizeof(ResultsBuffer) + sizeof(TableSnapshot) \
+    + sizeof(Engine) + 8 * ARENA_ALIGN)
+
+#ifdef TRACE
+// function declaration for the tracer
+void StartTrace(const char *);
+void WriteTrace(void);
+TraceBuffer * TraceThread(void);
+uint64_t TraceNow(void);
+TraceScope TraceBegin(const char *);
+void TraceEnd(TraceScope *);
+void TraceCount(int, uint32_t);
+void TraceCounters(void);
+void AddTraceEvent(TraceBuffer *, const char *, uint64_t, uint64_t);
+#endif
+
+// function declaration for the input recorder
+int MaxInputEvents(GameOptions *);
+void OpenInputLog(InputLog *, GameOptions *, Arena *);
+void RecordInput(InputLog *, int, SDL_Event *);
+bool ReplayInput(InputLog *, int);
+void FinishReplayFrame(InputLog *);
+void CloseInputLog(InputLog *);
+
 // declaration of the functions related to graphical interface
-void RenderBustBlackjack(TTF_Font *, SDL_Renderer* , int []);
+double ProfileStart(void);
+void ProfileStop(int, double);
+void PrintRenderProfile(int, double);
+void RenderBustBlackjack(TTF_Font *, SDL_Renderer* , const SeatStates *, const Layout *);
+void RenderEvPanel(EvCache *, TTF_Font *, SDL_Renderer *, const Layout *);
 void InitEverything(int , int , TTF_Font **, SDL_Surface **, SDL_Window ** , SDL_Renderer ** );
 void InitSDL();
 void InitFont();
+TTF_Font * LoadFont(int);
 SDL_Window* CreateWindow(int , int );
 SDL_Renderer* CreateRenderer(int , int , SDL_Window *);
+void UpdateLayout(Layout *, SDL_Renderer *, SDL_Texture *, SDL_Texture *, TTF_Font **);
+void ComputeLayout(Layout *, int, int, SDL_Texture *);
+void ScaleRect(SDL_Rect *, double, double, double, double, double, double);
+int ScaleLength(double, double);
 int RenderText(int , int , const char* , TTF_Font *, SDL_Color *, SDL_Renderer * );
-int RenderLogo(int , int , SDL_Surface *, SDL_Renderer * );
-void RenderTable(int [], TTF_Font *, SDL_Surface **, SDL_Renderer * , int);
-void RenderCard(int , int , int , SDL_Surface **, SDL_Renderer * );
-void RenderHouseCards(int [], int , SDL_Surface **, SDL_Renderer *, bool);
-void RenderPlayerCards(int [][MAX_CARD_HAND], int [], SDL_Surface **, SDL_Renderer * );
+int RenderLogo(const SDL_Rect *, SDL_Texture *, SDL_Renderer * );
+void RenderTable(int [], TTF_Font *, SDL_Texture **, SDL_Renderer * , int, const Layout *);
+void RenderCard(const SDL_Rect *, int , SDL_Texture **, SDL_Renderer * );
+void RenderHouseCards(card_t [], int , SDL_Texture **, SDL_Renderer *, bool, const Layout *);
+void RenderPlayerCards(card_t [][MAX_CARD_HAND], int [], SDL_Texture **, SDL_Renderer *, 
+    const Layout *);
 void LoadCards(SDL_Surface **);
 void UnLoadCards(SDL_Surface **);
+void LoadImages(SDL_Surface **);
+void UploadImages(Images *, SDL_Renderer *, bool);
+void ReloadImages(Images *, SDL_Renderer *, bool);
+void UnLoadImages(Images *);
 
 //function declaration for game mechanics
 
-void GenerateDecks(int *, int);
-void Shuffle(int *, int *, int);
-int CountScore(int * , int);
+void GenerateDecks(card_t *, int);
+void Shuffle(card_t *, int *, int, ShoeSource *);
+void ShuffleShoe(card_t [], int, uint64_t, uint64_t);
+uint64_t NextRandom(uint64_t *);
+uint64_t MixBits(uint64_t);
+int CountScore(card_t * , int);
 int CardPoints(int);
-void DrawCard(int [], int *, int, int [], int *);
-int WhosNext(int [], int);
-void BlackJack(int *);
-void Bust(int *, int *, int);
-bool NewGame(int [], int *, int, int [][MAX_CARD_HAND], int [], int *, int [], int [], int [], int *);
-bool Stand(int [], int *);
-bool Hit(int [], int *, int, int [][MAX_CARD_HAND], int [], int [], 
-    int *, int [], int [], int);
-void HouseTurn(int [], int *, int, int [], int *, int *, int [], int [], int [], 
-    int [], int [MAX_PLAYERS][4], int, int);
+void DrawCard(card_t [], int *, int, ShoeSource *, card_t [], int *);
+int WhosNext(const SeatStates *, int);
+void BlackJack(SeatStates *, int);
+void Bust(SeatStates *, int, int *, int);
+seatmask_t AllSeats(int);
+seatmask_t SeatsPlaying(const SeatStates *);
+void SeatPlayers(SeatStates *, int);
+int SeatState(const SeatStates *, int);
+bool NewGame(card_t [], int *, int, ShoeSource *, card_t [][MAX_CARD_HAND], int [], int *, 
+    int [], SeatStates *, card_t [], int *);
+bool Stand(SeatStates *, int *);
+bool Hit(card_t [], int *, int, ShoeSource *, card_t [][MAX_CARD_HAND], int [], int [], 
+    int *, SeatStates *, int [], int);
+bool Double(card_t [], int *, int, ShoeSource *, card_t [][MAX_CARD_HAND], int [], int [], 
+    int *, SeatStates *, int [], int [], int);
+bool CanDouble(const RuleSet *, int, int, int);
+void HouseTurn(card_t [], int *, int, ShoeSource *, card_t [], int *, int *, int [], int [], int [], 
+    int [], SeatStates *, int [MAX_PLAYERS][4], int, int, const RuleSet *);
+int HouseStandsSoft17(card_t [], int *, int, ShoeSource *, card_t [], int *);
+int HouseHitsSoft17(card_t [], int *, int, ShoeSource *, card_t [], int *);
+void SetRules(RuleSet *, GameOptions *);
+bool PlayerDecision(int, int);
+bool PlayerDoubles(int, int);
+bool PolicyMove(Table *, int, int);
+bool PlayAction(Table *, int, int);
+bool AllPlayersBroke(const SeatStates *);
+void AddRoundProfit(Table *, seatmask_t, int [], int);
+
+//function declaration for the expected value calculator
+EvCache * StartEvWorker(Arena *, bool);
+void StopEvWorker(EvCache *);
+void * EvWorker(void *);
+void UpdateEv(EvCache *, card_t [], int, int, card_t [][MAX_CARD_HAND], int [], int, 
+    card_t []);
+void ComputeEv(EvCache *, EvRequest *, double *, double *);
+const double * HouseOutcomes(EvCache *, int [], int, int);
+void HouseFinalScores(EvCache *, int [], int, int, int, uint64_t, double []);
+void HouseDraws(int [], int, int [], int, int, bool, double, double []);
+bool HouseStands(int, int, bool);
+EvMemoEntry * FindMemoEntry(EvMemoEntry [], uint64_t, int);
+double StandEv(const double [], int);
+double HitEv(EvCache *, int [], int, int, int, int);
+void AddCardValue(int, int *, int *);
+uint64_t PackComposition(int []);
+int RunExact(GameOptions *);
+void * ExactWorker(void *);
+void ExactUpCard(EvCache *, ExactJob *, int);
+double PolicyEv(EvCache *, ExactJob *, int [], int, int, int, int, int);
+double BestEv(EvCache *, ExactJob *, int [], int, int, int, int);
+double DoubleEv(EvCache *, int [], int, int, int, int);
+int PlayGames(GameOptions *, Table *, CountReport *, ResultsBuffer *, int);
+
+//function declaration for policy plugins
+void LoadPlugin(GameOptions *);
+bool PluginMove(Table *, int);
+void PlayBatch(GameOptions *, DecisionBatch *, ResultsBuffer *);
+void AskDecisions(DecisionBatch *, int);
+void DescribeHand(Table *, int, int32_t *, uint8_t *, uint8_t *, uint8_t *, int32_t *);
+void CountUnseen(Table *, int32_t [], int *, uint64_t *);
+
+//function declaration for card counting
+void ResetCount(CardCounter *, const CountSystem *, int);
+void UpdateCount(CardCounter *, card_t [], int, uint64_t);
+int TrueCount(CardCounter *, int, int);
+void RecordRound(CountReport *, int, seatmask_t, int [], int [], int);
+void LogCountReport(CountReport *, int);
+
+//function declaration for policy comparison
+int RunComparison(GameOptions *);
+long long CardsDealt(Table *);
+void CatchUpShoe(Table *, Table *);
+
+//function declaration for the risk of ruin solver
+int RunRuin(GameOptions *);
+void SampleOutcomes(GameOptions *, bool, OutcomeDistribution *);
+void RuinStep(const double * restrict, double * restrict, int, int, 
+    const OutcomeDistribution *, int, double *, double *);
+int GreatestDivisor(int, int);
+
+//function declaration for the results file
+void OpenResults(ResultsWriter *, GameOptions *);
+void CloseResults(ResultsWriter *);
+void AddResults(ResultsBuffer *, Table *, seatmask_t, int []);
+void FlushResults(ResultsBuffer *);
+void WriteAll(int, const void *, size_t);
+int ReadResults(GameOptions *);
+
+//function declaration for the shoe pool
+void StartShoePool(Arena *, ShoeSource *, int);
+void StopShoePool(ShoeSource *);
+void * ShoePoolWorker(void *);
+void TakeShoe(ShoePool *, card_t []);
+
+//function declaration for checkpoints
+void StartCheckpointer(Checkpointer *, GameOptions *, TableSnapshot *, int);
+void StopCheckpointer(Checkpointer *);
+void * CheckpointWorker(void *);
+void WriteCheckpoint(Checkpointer *);
+void PublishSnapshot(TableSnapshot *, Table *, CountReport *);
+void ReadSnapshot(TableSnapshot *, TableSnapshot *);
+const CheckpointHeader * LoadCheckpoint(GameOptions *);
+void UnloadCheckpoint(const CheckpointHeader *);
+const TableSnapshot * CheckpointTables(const CheckpointHeader *);
+void RestoreTable(Table *, const TableSnapshot *, GameOptions *);
+void RestoreCountReport(CountReport *, const TableSnapshot *, GameOptions *);
+bool TableFinished(Table *, GameOptions *);
+
+//function declaration for the game engine thread
+void StartEngine(Engine *, GameOptions *, Table *, TableSnapshot *);
+void StopEngine(Engine *);
+void PushCommand(Engine *, int);
+int TakeCommand(Engine *);
+void * EngineWorker(void *);
+void RunCommand(Engine *, int);
+void PublishFrame(Engine *);
+EngineFrame * LatestFrame(Engine *);
+
+//function declaration for the simulation scheduler
+int RunSimulation(GameOptions *, const CheckpointHeader *, ShardResult *);
+void * SimulationWorker(void *);
+bool SchedulerPrecision(Worker *, RunningStats *);
+void PublishProfit(Worker *);
+void ReadProfit(Worker *, RunningStats *);
+void PlayBatchTask(Worker *, int);
+void EndTask(Worker *, int, int, int);
+void PushTask(Worker *, int);
+void WaitForTasks(Scheduler *, int);
+void WakeWorkers(Scheduler *, bool);
+bool PopTask(Worker *, int *);
+bool StealTask(Worker *, int *);
+double Now(void);
+
+//function declaration for hardware counters
+void PerfOpen(PerfCounters *);
+void PerfStart(PerfCounters *);
+void PerfStop(PerfCounters *);
+void PerfClose(PerfCounters *);
+void PrintPerfCounters(PerfCounters *, const char *, double);
+
+//function declaration for memory accounting
+void PrintMemoryReport(const char *, Images *, const Arena *);
+size_t ResidentBytes(void);
+
+//function declaration for shard processes
+int RunShards(GameOptions *);
+void PinShard(ShardResult *, int, int);
+int ReadNodeCpus(int, const unsigned long [], int []);
+
+//function declaration for the server and its load generator
+int RunServer(GameOptions *);
+void StopServer(int);
+int OpenServerSocket(const char *);
+void SetNonBlocking(int);
+void AcceptClients(Server *, int, GameOptions *);
+void CloseSession(Server *, Session *);
+bool ServeSession(Server *, Session *, GameOptions *);
+bool AnswerRequests(Server *, Session *, GameOptions *);
+bool FlushSession(Server *, Session *);
+void ServerPlay(Session *, ServerRequest *, GameOptions *, ServerReply *);
+void FillReply(Session *, uint32_t, uint8_t, ServerReply *);
+int RunLoadGenerator(GameOptions *);
+uint8_t LoadGeneratorMove(ServerReply *);
+int CompareLatency(const void *, const void *);
+double ElapsedSeconds(struct timespec *, struct timespec *);
 
 
 //utility function declarations
-void GameInit(int [], int *, int *, int *, int *, int [], int []);
-void GetGameParameters(int *, int *, int *);
+void GameInit(GameOptions *);
+void GetGameParameters(GameOptions *);
 int ReadParameter(int , int);
-void LogStats (int [MAX_PLAYERS][STATS], const char * []);
+void ParseOptions(int, char * [], GameOptions *);
+void LoadConfigFile(const char *, GameOptions *);
+void SetOption(const char *, const char *, GameOptions *);
+int ParseInt(const char *, const char *, int, int);
+double ParseDouble(const char *, const char *, double, double);
+void PrintUsage(const char *);
+void LogStats (int [MAX_PLAYERS][STATS], char [][PLAYER_NAME_SIZE], int);
+void AddSample(RunningStats *, double);
+void MergeStats(RunningStats *, const RunningStats *);
+double StatsInterval(const RunningStats *);
+bool PrecisionReached(const RunningStats *, GameOptions *);
+void PrintProfitStats(RunningStats [], RunningStats *, int);
+
+//function declaration for state allocation
+void ArenaInit(Arena *, size_t);
+void * ArenaAlloc(Arena *, size_t);
+void ArenaFree(Arena *);
+Table * NewTable(Arena *, GameOptions *, int);
+void ResetTable(Table *, GameOptions *, int);
 
 
 // definition of some strings: they cannot be changed when the program is executed !
 const char myName[] = "Andre Agostinho";
 const char myNumber[] = "IST425301";
-const char * playerNames[] = {"Player 1", "Player 2", "Player 3", "Player 4"};
+const char * policyNames[] = {"human", "dealer", "cautious", "plugin"};
+const char * profileNames[NUM_PROFILED] = {"Frame", "RenderTable", "RenderCard", 
+    "RenderText"};
+const char * perfNames[NUM_PERF_COUNTERS] = {"cycles", "instructions", "branch-misses", 
+    "L1d-misses", "LLC-misses"};
+
+// names of the players, set once by GameInit
+char playerNames[MAX_PLAYERS][PLAYER_NAME_SIZE];
+
+// render function timings, filled by the render benchmark
+RenderProfile renderProfile;
+
+// policy plugin, loaded once by LoadPlugin
+PolicyPlugin policyPlugin;
+
+#ifdef TRACE
+// trace state, set once by StartTrace
+bool traceEnabled = false;
+char tracePath[STRING_SIZE];
+struct timespec traceStart;
+TraceBuffer * traceBuffers = NULL;    // buffers of every thread (atomic)
+int traceThreads = 0;                 // threads that traced something (atomic)
+__thread TraceBuffer * traceBuffer = NULL;    // buffer of the calling thread
+const char * traceCounterNames[NUM_TRACE_COUNTERS] = {"cards drawn", 
+    "reshuffles", "textures created", "text surfaces"};
+#endif
+
+// card counting systems: tags from 2 to ace
+const CountSystem countSystems[NUM_COUNT_SYSTEMS] = {
+    {"hilo",   { 1,  1,  1,  1,  1,  0,  0,  0, -1, -1, -1, -1, -1}},
+    {"ko",     { 1,  1,  1,  1,  1,  1,  0,  0, -1, -1, -1, -1, -1}},
+    {"omega2", { 1,  1,  2,  2,  2,  1,  0, -1, -2, -2, -2, -2,  0}},
+    {"zen",    { 1,  1,  2,  2,  2,  1,  0,  0, -2, -2, -2, -2, -1}}
+};
 
 
 /**
@@ -103,64 +1244,231 @@ int main( int argc, char* args[] )
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
     TTF_Font *serif = NULL;
-    SDL_Surface *cards[DECK_SIZE+1], *imgs[2];
+    Images images = {{NULL}, {NULL}};
     SDL_Event event;
-    int delay = 300;
+    SDL_Texture *benchTarget = NULL;
+    double benchStart = 0, frameStart;
+    int delay = 300;          // ms between two steps of the game
     int quit = 0;
-
-    //game variables
-    bool gameHasEnded = false;
-    bool houseHasPlayed = false;
-
-    int currentPlayer = 0;
-    /** 
-     * Player States:
-     * 
-     * NORMAL - Player is playing,
-     * BLACKJACK - Player has a blackjack,
-     * BUSTED - Player is busted,
-     * BROKE - Player doesn't have enough money to bet
-     */
-    int playerState[MAX_PLAYERS] = {0};
-    int playerMoney[MAX_PLAYERS] = {0};
-    int playerScore[MAX_PLAYERS] = {0};
-    /**
-     * Player Stats:
-     * 
-     * WINS - Number of player wins,
-     * DRAWS - Number of player draws
-     * LOSSES - Number of player losses
-     * BALANCE - Money house won with this player
-     */
-    int playerStats [MAX_PLAYERS][STATS] = {0};
-    int houseScore = 0;
-
-    int cardStack[DECK_SIZE * MAX_NUM_DECKS] = {0};
-    int stackTopCard = 0;
-    int playerCards[MAX_PLAYERS][MAX_CARD_HAND] = {{0}};
-    int posPlayerHand[MAX_PLAYERS] = {0};
-    int houseCards[MAX_CARD_HAND] = {0};
-    int posHouseHand = 0;
+    int frames = 0;
+    int steps = 0;
+    double nextStep = 0;
+    InputLog inputLog = {INPUT_OFF};
+    Layout layout = {0, 0, FONT_SIZE};    // no window yet, font opened at FONT_SIZE
+
+    // all the game state comes from one arena allocated at the start
+    Arena arena;
+    Table *table = NULL;
+    CountReport *countReport = NULL;
+    EvCache *evCache = NULL;
+    Engine *engine = NULL;
+    EngineFrame *frame = NULL;
+
+    // checkpoints of the table
+    const CheckpointHeader *checkpoint = NULL;
+    TableSnapshot *snapshot = NULL;
+    Checkpointer checkpointer;
+
+    // hardware counters of the benchmarks, read with --perf 1
+    PerfCounters perfCounters = {{0}};
     
     // parameters
-    int numberOfDecks = 0;
-    int startingPlayerMoney = 0;
-    int betMoney = 0;
+    GameOptions options = {0, 0, 0, DEFAULT_SEED, POLICY_HUMAN, RENDER_GUI, 0, 0, 
+        COUNT_NONE, DEALER_S17, 3, 2, 0, 0, SERVER_OFF, "", DEFAULT_NUM_TABLES, 0, 
+        DEFAULT_CHUNK, 64, 1000000, RESULTS_OFF, "", DEFAULT_BENCH_FRAMES, 
+        INPUT_OFF, "", 1, "", 0, "", DEFAULT_CHECKPOINT_SECONDS, "", POLICY_HUMAN, 0, 0, 0, 
+        "", 0, WINDOW_SEATS, 0, 0};
+
+    ParseOptions(argc, args, &options);
+#ifdef TRACE
+    if (options.tracePath[0] != '\0') StartTrace(options.tracePath);
+#endif
+
+    if (options.serverMode == SERVER_LOADGEN){
+        return RunLoadGenerator(&options);
+    }
+    if (options.resultsMode == RESULTS_READ){
+        return ReadResults(&options);
+    }
+
+    // a resumed game takes the options that make the game from the checkpoint
+    if (options.resumePath[0] != '\0'){
+        checkpoint = LoadCheckpoint(&options);
+    }
+    if (options.policy == POLICY_PLUGIN || options.comparePolicy == POLICY_PLUGIN){
+        LoadPlugin(&options);
+    }
 
     // initialize game mechanics
-    GameInit(cardStack, &stackTopCard, &numberOfDecks, &startingPlayerMoney, 
-        &betMoney, playerMoney, playerState);
+    GameInit(&options);
+
+    // no game: the expected value of a hand is computed exactly
+    if (options.exact){
+        return RunExact(&options);
+    }
+
+    // no window: two policies play the same cards
+    if (options.comparePolicy != POLICY_HUMAN){
+        return RunComparison(&options);
+    }
+
+    // no game: the bankroll is followed round by round as a distribution
+    if (options.ruinRounds > 0){
+        return RunRuin(&options);
+    }
+
+    // no window: every connected client plays its own table
+    if (options.serverMode == SERVER_RUN){
+        return RunServer(&options);
+    }
+
+    ArenaInit(&arena, GAME_ARENA_SIZE + MaxInputEvents(&options) * sizeof(InputEvent));
+    table = NewTable(&arena, &options, 0);
+
+    // no window: the tables are split over processes, each with its threads
+    if (options.shards > 0){
+        ArenaFree(&arena);
+        return RunShards(&options);
+    }
+
+    // no window: many tables are simulated by a pool of threads
+    if (options.renderMode == RENDER_NONE && options.threads > 0){
+        ArenaFree(&arena);
+        return RunSimulation(&options, checkpoint, NULL);
+    }
+
+    // the pool starts from the next shoe of the restored table
+    if (checkpoint != NULL) RestoreTable(table, CheckpointTables(checkpoint), &options);
+    if (options.shoePool) StartShoePool(&arena, &table->shoe, table->numOfDecks);
+
+    // no window: the policy plays all the rounds in the console
+    if (options.renderMode == RENDER_NONE){
+        ResultsWriter resultsWriter;
+        ResultsBuffer * results = NULL;
+        int rounds, played, startRounds = table->roundsPlayed;
+        double start;
+
+        if (options.countSystem != COUNT_NONE){
+            countReport = ArenaAlloc(&arena, sizeof(CountReport));
+            ResetCount(&countReport->counter, &countSystems[options.countSystem], 
+                options.numOfDecks);
+            if (checkpoint != NULL){
+                RestoreCountReport(countReport, CheckpointTables(checkpoint), &options);
+            }
+        }
+        if (options.resultsMode == RESULTS_WRITE){
+            OpenResults(&resultsWriter, &options);
+            results = ArenaAlloc(&arena, sizeof(ResultsBuffer));
+            results->writer = &resultsWriter;
+        }
+        if (options.checkpointPath[0] != '\0'){
+            snapshot = ArenaAlloc(&arena, sizeof(TableSnapshot));
+            PublishSnapshot(snapshot, table, countReport);
+            StartCheckpointer(&checkpointer, &options, snapshot, 1);
+        }
+
+        if (options.perf) PerfOpen(&perfCounters);
+        PerfStart(&perfCounters);
+        start = Now();
+
+        // rounds are played in chunks, so the table is checkpointed and its
+        // precision checked between them
+        do {
+            rounds = options.chunk;
+            if (options.rounds != 0 && options.rounds - table->roundsPlayed < rounds){
+                rounds = options.rounds - table->roundsPlayed;
+            }
+            if (rounds <= 0) break;
+            played = PlayGames(&options, table, countReport, results, rounds);
+            if (snapshot != NULL) PublishSnapshot(snapshot, table, countReport);
+        } while (played == rounds && !PrecisionReached(&table->roundProfit, &options));
+
+        PerfStop(&perfCounters);
+        if (options.perf){
+            double seconds = Now() - start;
+
+            printf("%d rounds in %.3f s (%.0f rounds/s)\n", table->roundsPlayed - startRounds, 
+                seconds, (table->roundsPlayed - startRounds) / seconds);
+            PrintPerfCounters(&perfCounters, "round", table->roundsPlayed - startRounds);
+            PerfClose(&perfCounters);
+        }
+        if (snapshot != NULL) StopCheckpointer(&checkpointer);
+        if (checkpoint != NULL) UnloadCheckpoint(checkpoint);
+        PrintProfitStats(table->seatProfit, &table->roundProfit, options.seats);
+        LogStats(table->playerStats, playerNames, options.seats);
+        if (countReport != NULL){
+            LogCountReport(countReport, options.betMoney);
+        }
+        if (results != NULL){
+            FlushResults(results);
+            CloseResults(&resultsWriter);
+        }
+        StopShoePool(&table->shoe);
+        ArenaFree(&arena);
+        return EXIT_SUCCESS;
+    }
+
+    // the benchmark needs no display: SDL's dummy driver has a software
+    // renderer, unless another driver is asked for in SDL_VIDEODRIVER
+    if (options.renderMode == RENDER_BENCH){
+        setenv("SDL_VIDEODRIVER", "dummy", 0);
+        renderProfile.enabled = true;
+        delay = 0;
+    }
+
+    // a replay runs the recorded keys without waiting between frames
+    if (options.inputMode == INPUT_REPLAY) delay = 0;
+
     // initialize graphics
-    InitEverything(WIDTH_WINDOW, HEIGHT_WINDOW, &serif, imgs, &window, &renderer);
+    InitEverything(WIDTH_WINDOW, HEIGHT_WINDOW, &serif, images.surfaces, &window, &renderer);
     // loads the cards images
-    LoadCards(cards);
+    LoadCards(images.surfaces);
+    // the images are drawn from textures uploaded once
+    UploadImages(&images, renderer, options.lowMemory);
+    // the benchmark draws every frame to a texture instead of the window
+    if (options.renderMode == RENDER_BENCH){
+        benchTarget = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, 
+            SDL_TEXTUREACCESS_TARGET, WIDTH_WINDOW + EXTRASPACE, HEIGHT_WINDOW);
+        if (benchTarget == NULL || SDL_SetRenderTarget(renderer, benchTarget) != 0){
+            printf("Failed to create the offscreen target : %s\n", SDL_GetError());
+            exit(EXIT_FAILURE);
+        }
+        benchStart = Now();
+    }
+    UpdateLayout(&layout, renderer, benchTarget, images.textures[IMAGE_LOGO], &serif);
+    // expected value panel, shown with --ev 1 or toggled with 'e'
+    evCache = StartEvWorker(&arena, options.dealerRule == DEALER_H17);
     
-    NewGame(cardStack, &stackTopCard, numberOfDecks, playerCards, 
-        posPlayerHand, &currentPlayer, playerScore, playerState, 
-        houseCards, &posHouseHand);
+    // keys are recorded or replayed from the first step on
+    if (options.inputMode != INPUT_OFF) OpenInputLog(&inputLog, &options, &arena);
+
+    // the table is checkpointed at the end of every round
+    if (options.checkpointPath[0] != '\0'){
+        snapshot = ArenaAlloc(&arena, sizeof(TableSnapshot));
+        PublishSnapshot(snapshot, table, NULL);
+        StartCheckpointer(&checkpointer, &options, snapshot, 1);
+    }
+
+    // the counters of the benchmark follow the engine thread too, but not the
+    // expected value worker started before it
+    if (options.perf && options.renderMode == RENDER_BENCH){
+        PerfOpen(&perfCounters);
+        PerfStart(&perfCounters);
+    }
+
+    // the game is played on the engine thread, this one handles the window
+    engine = ArenaAlloc(&arena, sizeof(Engine));
+    StartEngine(engine, &options, table, snapshot);
+    nextStep = Now();
 
     while( quit == 0 )
     {
+        TRACE_SCOPE("Frame");
+        bool stepDue = delay == 0 || Now() >= nextStep;
+
+        frameStart = ProfileStart();
+        // the keys recorded for this step are pushed as SDL events
+        if (inputLog.mode == INPUT_REPLAY && !ReplayInput(&inputLog, steps)) quit = 1;
         // while there's events to handle
         while( SDL_PollEvent( &event ) )
         {
@@ -169,38 +1477,38 @@ int main( int argc, char* args[] )
             {
                 quit = 1;
             }
+            // the window was resized or moved to a display of another density
+            else if ( event.type == SDL_WINDOWEVENT && 
+                event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED )
+            {
+                UpdateLayout(&layout, renderer, benchTarget, images.textures[IMAGE_LOGO], 
+                    &serif);
+            }
+            // the renderer lost its textures (e.g. the GPU was reset)
+            else if ( event.type == SDL_RENDER_DEVICE_RESET )
+            {
+                ReloadImages(&images, renderer, options.lowMemory);
+            }
             else if ( event.type == SDL_KEYDOWN )
             {
+                if (inputLog.mode == INPUT_RECORD) RecordInput(&inputLog, steps, &event);
+
                 switch ( event.key.keysym.sym )
                 {
-                    // press 's' to "stand"
+                    // 's' to "stand", 'h' to "hit", 'd' to "double down" and
+                    // 'n' to start a new game are played by the engine
                     case SDLK_s:
-
-                        if (!gameHasEnded) gameHasEnded = Stand(playerState, &currentPlayer);
-                        break;
-
-                    // press 'h' to "hit"
                     case SDLK_h:
+                    case SDLK_d:
+                    case SDLK_n:
 
-                        if (!gameHasEnded) {
-                            gameHasEnded = Hit(cardStack, &stackTopCard, 
-                                numberOfDecks, playerCards, posPlayerHand, 
-                                playerScore, &currentPlayer, playerState, 
-                                playerMoney, betMoney);
-                         }
+                        PushCommand(engine, event.key.keysym.sym);
                         break;
 
-                    // press 'n' to start a new game
-                    // only works when all cards have been distributed
-                    case SDLK_n:
+                    // press 'e' to show or hide the expected values
+                    case SDLK_e:
 
-                        if (gameHasEnded){
-                            gameHasEnded = false;
-                            houseHasPlayed = false;
-                            gameHasEnded = NewGame(cardStack, &stackTopCard, numberOfDecks, 
-                            	playerCards, posPlayerHand, &currentPlayer, playerScore, 
-                            	playerState, houseCards, &posHouseHand);
-                        }
+                        options.showEv = !options.showEv;
                         break;
 
                     // press 'q' to "quit" 
@@ -215,40 +1523,75 @@ int main( int argc, char* args[] )
 
             }
         }
-        if (gameHasEnded && !houseHasPlayed){
-            currentPlayer = -1; // no red rectangle around any player
-
-            HouseTurn(cardStack, &stackTopCard, numberOfDecks, houseCards,
-                &posHouseHand, &houseScore, posPlayerHand, playerScore, playerMoney, 
-                playerState, playerStats, betMoney, startingPlayerMoney);
-
-            houseHasPlayed = true;
-            
+        // the game moves on every delay ms, while frames are drawn at
+        // display rate
+        if (stepDue){
+            PushCommand(engine, ENGINE_STEP);
+            steps++;
+            nextStep = Now() + delay / 1000.0;
         }
 
-        
+        // draw the latest state published by the engine
+        frame = LatestFrame(engine);
+        if (frame->finished) quit = 1;
 
         // render game table
-        RenderTable(playerMoney, serif, imgs, renderer, currentPlayer);
+        RenderTable(frame->table.playerMoney, serif, images.textures, renderer, 
+            frame->table.currentPlayer, &layout);
         // render house cards
-        RenderHouseCards(houseCards, posHouseHand, cards, renderer, gameHasEnded);
+        RenderHouseCards(frame->table.houseCards, frame->table.posHouseHand, 
+            images.textures, renderer, frame->gameHasEnded, &layout);
         // render player cards
-        RenderPlayerCards(playerCards, posPlayerHand, cards, renderer);
+        RenderPlayerCards(frame->table.playerCards, frame->table.posPlayerHand, 
+            images.textures, renderer, &layout);
         // render bust and blackjack
-        RenderBustBlackjack(serif, renderer, playerState);
+        RenderBustBlackjack(serif, renderer, &frame->table.seats, &layout);
+        // render the expected values of the current player
+        if (options.showEv && !frame->gameHasEnded){
+            UpdateEv(evCache, frame->table.cardStack, frame->table.stackTopCard, 
+                frame->table.numOfDecks, frame->table.playerCards, 
+                frame->table.posPlayerHand, frame->table.currentPlayer, 
+                frame->table.houseCards);
+            RenderEvPanel(evCache, serif, renderer, &layout);
+        }
         // render in the screen all changes above
         SDL_RenderPresent(renderer);
-        // add a delay
-        SDL_Delay( delay );
+        ProfileStop(PROFILE_FRAME, frameStart);
+        TRACE_COUNTERS();
+        if (inputLog.mode == INPUT_REPLAY) FinishReplayFrame(&inputLog);
+        // wait for the next frame
+        if (delay > 0) SDL_Delay( FRAME_DELAY );
+
+        frames++;
+        if (options.memoryReport && frames == 1){
+            PrintMemoryReport("after the first frame", &images, &arena);
+        }
+        if (options.renderMode == RENDER_BENCH && frames >= options.frames) quit = 1;
+    }
+
+    // the engine runs the commands still queued before it stops
+    StopEngine(engine);
+    if (options.memoryReport) PrintMemoryReport("at the end", &images, &arena);
+
+    if (options.renderMode == RENDER_BENCH){
+        PerfStop(&perfCounters);
+        PrintRenderProfile(frames, Now() - benchStart);
+        PrintPerfCounters(&perfCounters, "frame", frames);
+        PerfClose(&perfCounters);
+        SDL_DestroyTexture(benchTarget);
     }
+    if (inputLog.mode != INPUT_OFF) CloseInputLog(&inputLog);
+    if (snapshot != NULL) StopCheckpointer(&checkpointer);
+    if (checkpoint != NULL) UnloadCheckpoint(checkpoint);
 
     // log stats
-    LogStats(playerStats, playerNames);
+    LogStats(table->playerStats, playerNames, options.seats);
     // free memory allocated for images and textures and close everything including fonts
-    UnLoadCards(cards);
+    UnLoadImages(&images);
+    StopEvWorker(evCache);
+    StopShoePool(&table->shoe);
+    ArenaFree(&arena);
     TTF_CloseFont(serif);
-    SDL_FreeSurface(imgs[0]);
-    SDL_FreeSurface(imgs[1]);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -264,91 +1607,95 @@ int main( int argc, char* args[] )
 
 /**
  * @brief         Displays a welcome message on the console and asks the user
- *                for the game parameters then initializes game variables
+ *                for the missing game parameters
  *
- * @param[in,out] cardStack         ptr to the card stack array
- * @param[out]    stackTopCard      ptr to the position of the top card in the
- *                                  stack
- * @param[out]    numOfDecks        ptr to game parameter: number of decks
- * @param[out]    startPlayerMoney  ptr to game parameter: player starting
- *                                  money
- * @param[out]    betMoney          ptr to game parameter: bet money
- * @param[in,out] playerMoney       ptr to player money array
- * @param[out]    playerState       ptr to array with player states
- *
- * Displays a welcome message to the user, asks for the game parameters
- * (number of decks to be used, amount of money with which each player starts
- * and the bet each player makes each game) and stores them in *numOfDecks,
- * *startPlayerMoney and *betMoney.
- *
- * Initializes playerMoney array with *startPlayerMoney and sets all
- * playerState to NORMAL.
- *
- * Seeds the pseudo-random number generator, initializes the card stack
- * pointed by cardStack with the number of decks *numOfDecks and shuffles it.
- *
- * Prints a message warning the game is starting.
- */
-void GameInit(
-        int cardStack[], int * stackTopCard, 
-        int * numOfDecks, int * startPlayerMoney, int * betMoney, 
-        int playerMoney[], int playerState[])
-{
-    printf(
-        "\n"
-        "*****************************************************************\n"
-        "*                                                               *\n"
-        "*                     WELCOME TO BLACKJACK                      *\n"
-        "*                                                               *\n"
-        "*      Please input the parameters asked to start the game      *\n"
-        "*                                                               *\n"
-        "*                                     André Agostinho IST425301 *\n"
-        "*****************************************************************\n"
-        "\n"
-        );
-
-    GetGameParameters(numOfDecks, startPlayerMoney, betMoney);
-
-    for (int i = 0; i < MAX_PLAYERS; i ++){
-        playerMoney[i] = *startPlayerMoney;
-        playerState[i] = NORMAL;
+ * @param[in,out] options  ptr to the game options
+ *
+ * If some game parameter (number of decks to be used, amount of money with
+ * which each player starts and the bet each player makes each game) was not
+ * given in the command line or config file, displays a welcome message to the
+ * user and asks for it. When every parameter was given nothing is printed, so
+ * the game can be started unattended.
+ *
+ * Names the players "Player 1" to "Player 64". The tables are created
+ * afterwards with NewTable, each one seeded from options->seed.
+ */
+void GameInit(GameOptions * options){
+    TRACE_SCOPE("GameInit");
+    bool isInteractive = options->numOfDecks == 0 || 
+        options->startPlayerMoney == 0 || options->betMoney == 0;
+
+    if (isInteractive){
+        printf(
+            "\n"
+            "*****************************************************************\n"
+            "*                                                               *\n"
+            "*                     WELCOME TO BLACKJACK                      *\n"
+            "*                                                               *\n"
+            "*      Please input the parameters asked to start the game      *\n"
+            "*                                                               *\n"
+            "*                                     André Agostinho IST425301 *\n"
+            "*****************************************************************\n"
+            "\n"
+            );
     }
 
-    srand(456);
-
-    GenerateDecks(cardStack, *numOfDecks);
+    GetGameParameters(options);
 
-    Shuffle(cardStack, stackTopCard, *numOfDecks);
+    for (int i = 0; i < MAX_PLAYERS; i++){
+        snprintf(playerNames[i], PLAYER_NAME_SIZE, "Player %d", i + 1);
+    }
 
-    printf(
-        "\n"
-        "********************* STARTING THE GAME *************************\n"
-        "\n"
-        );
+    if (isInteractive){
+        printf(
+            "\n"
+            "********************* STARTING THE GAME *************************\n"
+            "\n"
+            );
+    }
 }
 
 /**
- * @brief         Asks the user for the game parameters and retrieves them
+ * @brief         Asks the user for the missing game parameters and retrieves
+ *                them
  *
- * @param[out]    numOfDecks        ptr to game parameter: number of decks
- * @param[in,out] startPlayerMoney  ptr to game parameter: player starting money
- * @param[out]    betMoney          ptr to game parameter: bet money
+ * @param[in,out] options  ptr to the game options
  *
- * Asks the user for the game parameters and stores them in the locations
- * pointed by numOfDecks, startPlayerMoney and betMoney.
+ * Asks the user for every game parameter still set to zero in options. A bet
+ * given beforehand is checked against the maximum bet allowed by the starting
+ * money, and the seats against the decks: the first two cards of every seat
+ * and the house must be dealt from less than a whole shoe.
  */
-void GetGameParameters(int * numOfDecks, int * startPlayerMoney, int * betMoney){
-    printf("Insert the number of decks to use: ");
-    *numOfDecks = ReadParameter(1, MAX_NUM_DECKS);
+void GetGameParameters(GameOptions * options){
+    int maxBet;
 
-    printf("Insert the amount of money each player starts with: ");
-    *startPlayerMoney = ReadParameter(1, INT_MAX);
+    if (options->numOfDecks == 0){
+        printf("Insert the number of decks to use: ");
+        options->numOfDecks = ReadParameter(1, MAX_NUM_DECKS);
+    }
+    if (2 * (options->seats + 1) >= options->numOfDecks * DECK_SIZE){
+        printf("--seats %d needs more than --decks %d, the deal would use up the shoe\n", 
+            options->seats, options->numOfDecks);
+        exit(EXIT_FAILURE);
+    }
 
-    printf("Insert the amount of money each player bets: ");
-    *betMoney = ReadParameter(1, MAX_BET * (*startPlayerMoney));
-}
+    if (options->startPlayerMoney == 0){
+        printf("Insert the amount of money each player starts with: ");
+        options->startPlayerMoney = ReadParameter(1, INT_MAX);
+    }
 
-/**
+    maxBet = MAX_BET * options->startPlayerMoney;
+    if (options->betMoney == 0){
+        printf("Insert the amount of money each player bets: ");
+        options->betMoney = ReadParameter(1, maxBet);
+    } else if (options->betMoney > maxBet){
+        printf("Invalid bet %d, the maximum bet for this starting money is %d\n", 
+            options->betMoney, maxBet);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
  * @brief      Retrieves a valid input from the user
  *
  * @param[in]  minValue  minimum parameter value
@@ -369,7 +1716,9 @@ int ReadParameter(int minValue, int maxValue){
     while(!isValid){
         char *rv = fgets(buffer, 15, stdin);
         if(rv == NULL){
+            // nothing else will ever be read (closed or redirected input)
             printf("Error reading input\n");
+            exit(EXIT_FAILURE);
         }
         
         parameter = strtol(buffer, &testPtr, 10);
@@ -386,18 +1735,483 @@ int ReadParameter(int minValue, int maxValue){
     return parameter;
 }
 
+/**
+ * @brief         Reads the game options from the command line
+ *
+ * @param[in]     argc     number of command line arguments
+ * @param[in]     argv     command line arguments
+ * @param[in,out] options  ptr to the game options
+ *
+ * Every option takes a value: "--decks N", "--money N", "--bet N",
+ * "--seed N", "--policy human|dealer|cautious|plugin", "--plugin FILE",
+ * "--render gui|none|bench",
+ * "--frames N", "--record FILE", "--replay FILE", "--replays N",
+ * "--trace FILE", "--exact 0|1", "--checkpoint FILE", "--checkpoint-every N",
+ * "--resume FILE", "--compare P", "--precision X", "--ruin N", "--perf 0|1",
+ * "--memory 0|1", "--low-memory 0|1",
+ * "--rounds N", "--ev 0|1",
+ * "--count hilo|ko|omega2|zen|none", "--dealer s17|h17", "--payout N:M",
+ * "--double 0|1", "--pool 0|1", "--threads N", "--chunk N", "--shards N",
+ * "--results FILE", "--read-results FILE", "--server PATH", "--tables N",
+ * "--seats N", "--loadgen PATH", "--connections N", "--requests N" and "--config FILE".
+ * Options are applied in order, so the ones written after "--config"
+ * override the values in the file.
+ */
+void ParseOptions(int argc, char * argv[], GameOptions * options){
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
+            PrintUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc){
+            printf("Invalid option: %s\n", argv[i]);
+            PrintUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--config") == 0){
+            LoadConfigFile(argv[i + 1], options);
+        } else {
+            SetOption(argv[i] + 2, argv[i + 1], options);
+        }
+        i++; // skip the value
+    }
+
+    // a resumed game takes its policy from the checkpoint
+    if (options->renderMode != RENDER_GUI && options->policy == POLICY_HUMAN && 
+            options->resumePath[0] == '\0'){
+        printf("A policy other than \"human\" is needed to play without a window\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->ruinRounds > 0 && options->policy == POLICY_HUMAN){
+        printf("--ruin needs a policy other than \"human\"\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->shards > 0 && (options->renderMode != RENDER_NONE || options->threads == 0)){
+        printf("--shards needs --render none and --threads\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->shards > options->numTables){
+        printf("--shards can't be more than the --tables\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->shards > 0 && (options->checkpointPath[0] != '\0' || 
+            options->resumePath[0] != '\0' || options->resultsMode == RESULTS_WRITE || 
+            options->precision > 0)){
+        printf("--shards can't be used with --checkpoint, --resume, --results or "
+            "--precision\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->resumePath[0] != '\0' && options->resultsMode == RESULTS_WRITE){
+        printf("--results can't be used with --resume, it would replace the hands "
+            "played before the checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->seats != WINDOW_SEATS && 
+            (options->renderMode != RENDER_NONE || options->serverMode != SERVER_OFF)){
+        printf("--seats other than %d needs --render none and no --server\n", WINDOW_SEATS);
+        exit(EXIT_FAILURE);
+    }
+    if (options->exact && options->policy == POLICY_PLUGIN){
+        printf("--exact can't follow a plugin policy, its decisions aren't known\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->comparePolicy != POLICY_HUMAN && 
+            (options->renderMode != RENDER_NONE || options->rounds == 0)){
+        printf("--compare needs --render none and a number of --rounds\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief         Reads the game options from a config file
+ *
+ * @param[in]     filename  name of the config file
+ * @param[in,out] options   ptr to the game options
+ *
+ * Each line of the file has the form "key = value", with the same keys as the
+ * command line options without the leading "--". Empty lines and lines
+ * starting with '#' are ignored.
+ */
+void LoadConfigFile(const char * filename, GameOptions * options){
+    FILE *configFile;
+    char line[STRING_SIZE];
+    char key[STRING_SIZE], value[STRING_SIZE];
+    int lineNumber = 0;
+
+    configFile = fopen(filename, "r");
+    if (configFile == NULL){
+        printf("Couldn't open config file: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, STRING_SIZE, configFile) != NULL){
+        char *start = line;
+        lineNumber++;
+
+        while (isspace((unsigned char) *start)) start++;
+        if (*start == '\0' || *start == '#') continue;
+
+        if (sscanf(start, " %99[^= \t] = %99s", key, value) != 2){
+            printf("Invalid line %d in config file %s\n", lineNumber, filename);
+            exit(EXIT_FAILURE);
+        }
+        SetOption(key, value, options);
+    }
+
+    fclose(configFile);
+}
+
+/**
+ * @brief         Sets a single game option
+ *
+ * @param[in]     key      name of the option
+ * @param[in]     value    value of the option
+ * @param[in,out] options  ptr to the game options
+ *
+ * Exits the program with an error message if the option is unknown or the
+ * value is invalid.
+ */
+void SetOption(const char * key, const char * value, GameOptions * options){
+    if (strcmp(key, "decks") == 0){
+        options->numOfDecks = ParseInt(key, value, 1, MAX_NUM_DECKS);
+
+    } else if (strcmp(key, "money") == 0){
+        options->startPlayerMoney = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "bet") == 0){
+        options->betMoney = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "seed") == 0){
+        options->seed = ParseInt(key, value, 0, INT_MAX);
+
+    } else if (strcmp(key, "rounds") == 0){
+        options->rounds = ParseInt(key, value, 0, INT_MAX);
+
+    } else if (strcmp(key, "ev") == 0){
+        options->showEv = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "count") == 0){
+        options->countSystem = COUNT_NONE;
+        for (int i = 0; i < NUM_COUNT_SYSTEMS; i++){
+            if (strcmp(value, countSystems[i].name) == 0) options->countSystem = i;
+        }
+        if (options->countSystem == COUNT_NONE && strcmp(value, "none") != 0){
+            printf("Invalid counting system: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+    } else if (strcmp(key, "dealer") == 0){
+        if (strcmp(value, "s17") == 0){
+            options->dealerRule = DEALER_S17;
+        } else if (strcmp(value, "h17") == 0){
+            options->dealerRule = DEALER_H17;
+        } else {
+            printf("Invalid dealer rule: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+    } else if (strcmp(key, "payout") == 0){
+        char end;
+        if (sscanf(value, "%d:%d%c", &options->payoutNum, &options->payoutDen, &end) != 2 || 
+                options->payoutNum < 1 || options->payoutDen < 1 || 
+                options->payoutNum > (long long) MAX_PAYOUT * options->payoutDen){
+            printf("Invalid blackjack payout: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+    } else if (strcmp(key, "double") == 0){
+        options->allowDouble = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "pool") == 0){
+        options->shoePool = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "server") == 0 || strcmp(key, "loadgen") == 0){
+        if (strlen(value) >= sizeof(((struct sockaddr_un *) 0)->sun_path)){
+            printf("Socket path too long: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(options->socketPath, value);
+        options->serverMode = strcmp(key, "server") == 0 ? SERVER_RUN : SERVER_LOADGEN;
+
+    } else if (strcmp(key, "results") == 0 || strcmp(key, "read-results") == 0){
+        if (strlen(value) >= STRING_SIZE){
+            printf("Results file path too long: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(options->resultsPath, value);
+        options->resultsMode = strcmp(key, "results") == 0 ? RESULTS_WRITE : RESULTS_READ;
+
+    } else if (strcmp(key, "record") == 0 || strcmp(key, "replay") == 0){
+        if (strlen(value) >= STRING_SIZE){
+            printf("Input file path too long: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(options->inputPath, value);
+        options->inputMode = strcmp(key, "record") == 0 ? INPUT_RECORD : INPUT_REPLAY;
+
+    } else if (strcmp(key, "trace") == 0){
+#ifndef TRACE
+        printf("Tracing needs a build with -DTRACE\n");
+        exit(EXIT_FAILURE);
+#endif
+        if (strlen(value) >= STRING_SIZE){
+            printf("Trace file path too long: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(options->tracePath, value);
+
+    } else if (strcmp(key, "checkpoint") == 0 || strcmp(key, "resume") == 0){
+        if (strlen(value) >= STRING_SIZE){
+            printf("Checkpoint file path too long: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(strcmp(key, "checkpoint") == 0 ? options->checkpointPath : 
+            options->resumePath, value);
+
+    } else if (strcmp(key, "checkpoint-every") == 0){
+        options->checkpointSeconds = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "ruin") == 0){
+        options->ruinRounds = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "perf") == 0){
+        options->perf = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "memory") == 0){
+        options->memoryReport = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "low-memory") == 0){
+        options->lowMemory = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "plugin") == 0){
+        if (strlen(value) >= STRING_SIZE){
+            printf("Plugin file path too long: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(options->pluginPath, value);
+
+    } else if (strcmp(key, "precision") == 0){
+        options->precision = ParseDouble(key, value, 0, 100);
+
+    } else if (strcmp(key, "compare") == 0){
+        if (strcmp(value, "dealer") == 0) options->comparePolicy = POLICY_DEALER;
+        else if (strcmp(value, "cautious") == 0) options->comparePolicy = POLICY_CAUTIOUS;
+        else if (strcmp(value, "plugin") == 0) options->comparePolicy = POLICY_PLUGIN;
+        else {
+            printf("Invalid policy to compare: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+    } else if (strcmp(key, "exact") == 0){
+        options->exact = ParseInt(key, value, 0, 1);
+
+    } else if (strcmp(key, "replays") == 0){
+        options->replays = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "frames") == 0){
+        options->frames = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "tables") == 0){
+        options->numTables = ParseInt(key, value, 1, MAX_SERVER_TABLES);
+
+    } else if (strcmp(key, "seats") == 0){
+        options->seats = ParseInt(key, value, 1, MAX_PLAYERS);
+
+    } else if (strcmp(key, "threads") == 0){
+        options->threads = ParseInt(key, value, 0, MAX_THREADS);
+
+    } else if (strcmp(key, "shards") == 0){
+        options->shards = ParseInt(key, value, 0, MAX_SHARDS);
+
+    } else if (strcmp(key, "chunk") == 0){
+        options->chunk = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "connections") == 0){
+        options->connections = ParseInt(key, value, 1, MAX_SERVER_TABLES);
+
+    } else if (strcmp(key, "requests") == 0){
+        options->requests = ParseInt(key, value, 1, INT_MAX);
+
+    } else if (strcmp(key, "policy") == 0){
+        if (strcmp(value, "human") == 0) options->policy = POLICY_HUMAN;
+        else if (strcmp(value, "dealer") == 0) options->policy = POLICY_DEALER;
+        else if (strcmp(value, "cautious") == 0) options->policy = POLICY_CAUTIOUS;
+        else if (strcmp(value, "plugin") == 0) options->policy = POLICY_PLUGIN;
+        else {
+            printf("Invalid policy: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+    } else if (strcmp(key, "render") == 0){
+        if (strcmp(value, "gui") == 0) options->renderMode = RENDER_GUI;
+        else if (strcmp(value, "none") == 0) options->renderMode = RENDER_NONE;
+        else if (strcmp(value, "bench") == 0) options->renderMode = RENDER_BENCH;
+        else {
+            printf("Invalid render mode: %s\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+    } else {
+        printf("Unknown option: %s\n", key);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief      Converts the value of an option to an integer
+ *
+ * @param[in]  key       name of the option, used in the error message
+ * @param[in]  value     string with the value of the option
+ * @param[in]  minValue  minimum value allowed
+ * @param[in]  maxValue  maximum value allowed
+ *
+ * @return     the integer value of the option
+ *
+ * Exits the program with an error message if value isn't an integer between
+ * minValue and maxValue.
+ */
+int ParseInt(const char * key, const char * value, int minValue, int maxValue){
+    char * testPtr = NULL;
+    long parameter;
+
+    parameter = strtol(value, &testPtr, 10);
+
+    if (testPtr == value || *testPtr != '\0' || 
+            parameter < minValue || parameter > maxValue){
+        printf("Invalid value for %s: %s (must be an integer between %d and %d)\n", 
+            key, value, minValue, maxValue);
+        exit(EXIT_FAILURE);
+    }
+
+    return (int) parameter;
+}
+
+/**
+ * @brief      Converts the value of an option to a real number
+ *
+ * @param[in]  key       name of the option, used in the error message
+ * @param[in]  value     string with the value of the option
+ * @param[in]  minValue  minimum value allowed (excluded)
+ * @param[in]  maxValue  maximum value allowed
+ *
+ * @return     the value of the option
+ *
+ * Exits the program with an error message if value isn't a number greater
+ * than minValue and up to maxValue.
+ */
+double ParseDouble(const char * key, const char * value, double minValue, double maxValue){
+    char * testPtr = NULL;
+    double parameter;
+
+    parameter = strtod(value, &testPtr);
+
+    if (testPtr == value || *testPtr != '\0' || 
+            !(parameter > minValue) || parameter > maxValue){
+        printf("Invalid value for %s: %s (must be a number above %g and up to %g)\n", 
+            key, value, minValue, maxValue);
+        exit(EXIT_FAILURE);
+    }
+
+    return parameter;
+}
+
+/**
+ * @brief      Prints the command line usage
+ *
+ * @param[in]  programName  name used to run the program
+ */
+void PrintUsage(const char * programName){
+    printf(
+        "Usage: %s [options]\n"
+        "  --decks N        number of decks (1 to %d)\n"
+        "  --money N        money each player starts with\n"
+        "  --bet N          money each player bets every round\n"
+        "  --seed N         seed of the pseudo-random number generator\n"
+        "  --policy P       human, dealer (hits below 17), cautious (hits below 12)\n"
+        "                   or plugin (decided by the shared object of --plugin)\n"
+        "  --plugin FILE    policy plugin: exports PolicyAbiVersion and DecideBatch,\n"
+        "                   which decides a batch of hands of many tables at once\n"
+        "  --render R       gui, none (console only, needs a policy) or bench\n"
+        "                   (renders offscreen without delay, needs a policy)\n"
+        "  --frames N       frames rendered by --render bench (%d)\n"
+        "  --perf 0|1       prints the cycles, instructions, branch and cache misses\n"
+        "                   of every frame of --render bench or round of --render\n"
+        "                   none, when the kernel lets the counters be read\n"
+        "  --memory 0|1     prints the memory held by the images, textures, font and\n"
+        "                   game state after the first frame and at the end\n"
+        "  --low-memory 0|1 frees the pixels of the images once they are textures\n"
+        "  --record FILE    writes the keys pressed in the window to FILE\n"
+        "  --replay FILE    plays the keys of FILE without delay (give the same\n"
+        "                   options as when it was recorded)\n"
+        "  --replays N      replays FILE N times, ignoring 'q' until the last\n"
+        "  --trace FILE     writes a Chrome trace (JSON, opens in Perfetto) of\n"
+        "                   the run to FILE, in builds with -DTRACE\n"
+        "  --rounds N       number of rounds to play, 0 for no limit\n"
+        "  --exact 0|1      prints the exact expected value of a hand off the top\n"
+        "                   of the shoe instead of playing, on --threads threads\n"
+        "  --compare P      with --render none, plays --rounds rounds of --policy\n"
+        "                   and of P on the same shoes and house cards, and prints\n"
+        "                   their expected values and the paired difference\n"
+        "  --ruin N         prints the chance of going broke within N rounds and\n"
+        "                   the rounds until broke, from the money and the bet\n",
+        programName, MAX_NUM_DECKS, DEFAULT_BENCH_FRAMES);
+    printf(
+        "  --ev 0|1         shows the expected values of hitting and standing\n"
+        "  --count C        hilo, ko, omega2 or zen: logs the player edge by\n"
+        "                   true count to \"count.log\" (with --render none);\n"
+        "                   ko is unbalanced and logged by running count instead,\n"
+        "                   starting from 4 - 4 * decks\n"
+        "  --dealer R       s17 (house stands on soft 17) or h17 (hits soft 17)\n"
+        "  --payout N:M     blackjack payout, 3:2 or 6:5 (3:2), at most %d:1\n"
+        "  --double 0|1     lets players double down on their first two cards\n"
+        "  --pool 0|1       shuffles the next shoes in advance on another thread\n"
+        "  --threads N      with --render none, simulates --tables tables on N\n"
+        "                   threads, --rounds rounds each (0: until broke)\n"
+        "  --chunk N        rounds of a table played at once by a thread (%d)\n"
+        "  --shards N       with --threads, splits the tables over N processes\n"
+        "                   pinned to their own CPUs, each on --threads threads\n"
+        "  --precision X    with --render none, stops once the 95%% interval of\n"
+        "                   the house edge is within +-X%% of the bet\n"
+        "  --results FILE   with --render none, writes every hand to the binary\n"
+        "                   results file FILE\n"
+        "  --read-results FILE\n"
+        "                   prints a summary of the results file FILE\n"
+        "  --checkpoint FILE\n"
+        "                   saves the state of the tables to FILE every few\n"
+        "                   seconds and at the end\n"
+        "  --checkpoint-every N\n"
+        "                   seconds between two checkpoints (%d)\n"
+        "  --resume FILE    continues the game saved in the checkpoint FILE, with\n"
+        "                   its decks, money, bet, seed, policy, count, rules\n"
+        "                   and seats\n"
+        "  --server PATH    hosts a table per client on the UNIX socket PATH\n"
+        "  --tables N       number of tables simulated or hosted at once (%d)\n"
+        "  --seats N        players at each table (%d), 1 to %d with --render none\n"
+        "  --loadgen PATH   load generator client for a server on PATH\n"
+        "  --connections N  load generator connections (64)\n"
+        "  --requests N     load generator requests (1000000)\n"
+        "  --config FILE    reads \"key = value\" options from FILE\n"
+        "Parameters that are not given are asked in the console.\n",
+        MAX_PAYOUT, DEFAULT_CHUNK, DEFAULT_CHECKPOINT_SECONDS, DEFAULT_NUM_TABLES, WINDOW_SEATS, MAX_PLAYERS);
+}
+
 /**
  * @brief      Prints players stats to a file ("stats.log")
  *
  * @param[in]  playerStats  ptr to the array containing the player statistics
  * @param[in]  playerNames  ptr to the array containing the player names
+ * @param[in]  numSeats     number of players at the tables
  *
  * Prints the player stats (number of wins, draws and losses and the balance) to
  * the file "stats.log".
  *
  * The stats are printed in a table format.
  */
-void LogStats (int playerStats[MAX_PLAYERS][STATS], const char * playerNames[]){
+void LogStats (int playerStats[MAX_PLAYERS][STATS], char playerNames[][PLAYER_NAME_SIZE], 
+    int numSeats){
+    TRACE_SCOPE("LogStats");
     FILE *statsLog;
     int check;
 
@@ -411,7 +2225,7 @@ void LogStats (int playerStats[MAX_PLAYERS][STATS], const char * playerNames[]){
         printf("Couldn't write to stats file");
     }
 
-    for (int i = 0; i < MAX_PLAYERS; i++){
+    for (int i = 0; i < numSeats; i++){
         check = fprintf(statsLog, "%s \t %d \t %d\t %d \t %d \n", playerNames[i], 
             playerStats[i][WINS], playerStats[i][DRAWS], playerStats[i][LOSSES], playerStats[i][BALANCE]);
         if (check == 0){
@@ -421,129 +2235,391 @@ void LogStats (int playerStats[MAX_PLAYERS][STATS], const char * playerNames[]){
     fclose(statsLog);
 }
 
+/**
+ * @brief         Adds a sample to streaming statistics
+ *
+ * @param[in,out] stats   ptr to the statistics
+ * @param[in]     sample  value of the sample
+ */
+void AddSample(RunningStats * stats, double sample){
+    double delta = sample - stats->mean;
 
-/****************************************************************************
- *                                                                          *
- *                         GAME MECHANICS FUNCTIONS                         *
- *                                                                          *
- ****************************************************************************/
+    stats->count++;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (sample - stats->mean);
+}
 
 /**
- * @brief         Loads the decks to the card stack
+ * @brief         Adds the samples of other statistics to statistics
  *
- * @param[in,out] cardStack   ptr to the card stack where to put the decks
- * @param[in]     numOfDecks  number of decks to load
+ * @param[in,out] stats  ptr to the statistics
+ * @param[in]     other  ptr to the statistics to add
  *
- * Initializes the card stack pointed by cardStack with the number of decks
- * pointed by numOfDecks.
+ * The result is the same as adding every sample of other one by one, up to
+ * rounding (Chan et al.).
  */
-void GenerateDecks(int cardStack[], int numOfDecks){
-    for (int i = 0; i < numOfDecks; i++){
-        for (int j = 0; j < DECK_SIZE; j++){
-            cardStack[i * DECK_SIZE + j] = j;
-        }
-    }
+void MergeStats(RunningStats * stats, const RunningStats * other){
+    long long count = stats->count + other->count;
+    double delta = other->mean - stats->mean;
+
+    if (other->count == 0) return;
+    stats->mean += delta * other->count / count;
+    stats->m2 += other->m2 + delta * delta * stats->count * other->count / count;
+    stats->count = count;
 }
 
 /**
- * @brief         Shuffles the card stack
+ * @brief      Computes the half width of the 95% confidence interval of the
+ *             mean
  *
- * @param[in,out] cardStack     ptr to the card stack array to be shuffled
- * @param[out]    stackTopCard  ptr to the stack's top card location
- * @param[in]     numOfDecks    number of decks used
+ * @param[in]  stats  ptr to the statistics
  *
- * Shuffles the card stack pointed by cardStack using Fisher-Yates algorithm
+ * @return     the half width, 0 with fewer than two samples
  */
-void Shuffle(int cardStack[], int * stackTopCard, int numOfDecks){
-    for (int i = numOfDecks * DECK_SIZE - 1; i >= 1; i--){
-        int j, aux; 
-        j = rand() % i;
-        aux = cardStack[i];
-        cardStack[i] = cardStack[j];
-        cardStack[j] = aux;
-    }
-    *stackTopCard = 0;
+double StatsInterval(const RunningStats * stats){
+    if (stats->count < 2) return 0;
+    return CONFIDENCE_Z * sqrt(stats->m2 / (stats->count - 1) / stats->count);
 }
 
 /**
- * @brief      Counts the points in a player's (or house) hand
+ * @brief      Checks if the house edge is known to the precision asked
  *
- * @param[in]  playerHand      ptr to the array of cards to count points
- * @param[in]  numCardsInHand  number of cards in hand
+ * @param[in]  roundProfit  ptr to the statistics of the money won per hand
+ * @param[in]  options      ptr to the game options (options->precision)
  *
- * @return     the number of points in the player's (or house) hand
+ * @return     true if options->precision is set, at least
+ *             MIN_PRECISION_ROUNDS rounds were played and the interval is
+ *             within it, false otherwise
  */
-int CountScore(int playerHand[], int numCardsInHand){
-
-    int playerScore = 0, numOfAces = 0;
-    for (int i = 0; i < numCardsInHand; i++){
-        int cardID, cardRank;
+bool PrecisionReached(const RunningStats * roundProfit, GameOptions * options){
+    return options->precision > 0 && roundProfit->count >= MIN_PRECISION_ROUNDS && 
+        100.0 * StatsInterval(roundProfit) <= options->precision;
+}
 
-        cardID = playerHand[i];
-        cardRank = cardID % 13; // find card rank
+/**
+ * @brief      Prints the expected value of each seat and the house edge
+ *
+ * @param[in]  seatProfit   ptr to the statistics of the money won by each seat
+ * @param[in]  roundProfit  ptr to the statistics of the money won per hand
+ * @param[in]  numSeats     number of players at the tables
+ *
+ * Values are in % of the bet, with their 95% confidence intervals.
+ */
+void PrintProfitStats(RunningStats seatProfit[], RunningStats * roundProfit, int numSeats){
+    for (int i = 0; i < numSeats; i++){
+        printf("%s: EV %+.4f%% +- %.4f%% per round, %lld rounds\n", playerNames[i], 
+            100.0 * seatProfit[i].mean, 100.0 * StatsInterval(&seatProfit[i]), 
+            seatProfit[i].count);
+    }
+    printf("House edge: %.4f%% +- %.4f%% per hand, %lld rounds\n", 
+        -100.0 * roundProfit->mean, 100.0 * StatsInterval(roundProfit), 
+        roundProfit->count);
+}
 
-        playerScore += CardPoints(cardRank);
 
-        if (cardRank == 12){
-            numOfAces += 1;
-        }
-    }
+/****************************************************************************
+ *                                                                          *
+ *                        STATE ALLOCATION FUNCTIONS                        *
+ *                                                                          *
+ ****************************************************************************/
 
-    // account for ace's two possible values
-    for (int i = 0; i < numOfAces; i++){
-        if (playerScore > 21) {
-            playerScore -= 10; // change an ace's value to 1
-        }
+/**
+ * @brief      Allocates the memory of an arena
+ *
+ * @param[out] arena  ptr to the arena
+ * @param[in]  size   number of bytes the arena can hand out
+ *
+ * This is the only allocation: everything taken from the arena afterwards
+ * comes from this block. Exits the program if there is not enough memory.
+ */
+void ArenaInit(Arena * arena, size_t size){
+    arena->base = malloc(size);
+    if (arena->base == NULL){
+        printf("Couldn't allocate %lu bytes for the game state\n", (unsigned long) size);
+        exit(EXIT_FAILURE);
     }
-
-    return playerScore;
+    arena->size = size;
+    arena->used = 0;
 }
 
 /**
- * @brief      Returns the value of a given card based on its rank
+ * @brief         Takes a block of memory from an arena
  *
- * @param[in]  cardRank  rank of the card
+ * @param[in,out] arena  ptr to the arena
+ * @param[in]     size   number of bytes of the block
  *
- * @return     the value of the card based on cardRank
+ * @return        ptr to the block, filled with zeros and aligned to
+ *                ARENA_ALIGN bytes
  *
- * Aces return 11 points, 1 point possible value has to be accounted later
+ * Exits the program if the arena is full: its size is computed beforehand,
+ * so this is a programming error.
  */
-int CardPoints(int cardRank){
-    if (cardRank <= 7){ //number cards
-        return cardRank + 2;
-    } else if (cardRank <= 11){ //10 point cards
-        return 10;
-    } else { //ace
-        return 11;
+void * ArenaAlloc(Arena * arena, size_t size){
+    uintptr_t start = ((uintptr_t) arena->base + arena->used + ARENA_ALIGN - 1) 
+        & ~(uintptr_t) (ARENA_ALIGN - 1);
+    size_t offset = start - (uintptr_t) arena->base;
+
+    if (offset + size > arena->size){
+        printf("Game state arena is full (%lu of %lu bytes used)\n", 
+            (unsigned long) arena->used, (unsigned long) arena->size);
+        exit(EXIT_FAILURE);
     }
+
+    arena->used = offset + size;
+    memset((void *) start, 0, size);
+    return (void *) start;
 }
 
+/**
+ * @brief         Frees the memory of an arena
+ *
+ * @param[in,out] arena  ptr to the arena
+ */
+void ArenaFree(Arena * arena){
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
 
 /**
- * @brief         Hands a card to a player (or house) from the card stack
+ * @brief         Creates a game table
  *
- * @param[in]     cardStack       ptr to the card stack array
- * @param[in,out] stackTopCard    ptr to position of the top card in the stack
- * @param[in]     numOfDecks      number of decks used
- * @param[out]    playerHand      ptr to array containing player/house hand
- * @param[in,out] numCardsInHand  ptr to number of cards in player's hand
+ * @param[in,out] arena    ptr to the arena the table is taken from
+ * @param[in]     options  ptr to the game options
+ * @param[in]     tableId  number of the table, selects its random stream
  *
- * Draws a card and put it in the player hand, increments the number of cards in
- * player's hand and the position of the top card in the stack. Shuffles if the
- * end of the stack is reached.
+ * @return        ptr to the new table, ready for NewGame
  */
-void DrawCard(int cardStack[], int * stackTopCard, int numOfDecks, 
-    int playerHand[], int * numCardsInHand){
+Table * NewTable(Arena * arena, GameOptions * options, int tableId){
+    Table * table = ArenaAlloc(arena, sizeof(Table));
 
-    playerHand[*numCardsInHand] = cardStack[*stackTopCard];
-    *numCardsInHand += 1;
-    *stackTopCard += 1;
-
-    // check if it was the last card on the card stack
-    if (*stackTopCard == numOfDecks * DECK_SIZE){
-        Shuffle (cardStack, stackTopCard, numOfDecks);
-        *stackTopCard = 0;
-    }
+    ResetTable(table, options, tableId);
+    return table;
+}
+
+/**
+ * @brief         Puts a table back in its starting state
+ *
+ * @param[out]    table    ptr to the table
+ * @param[in]     options  ptr to the game options
+ * @param[in]     tableId  number of the table, selects its random stream
+ *
+ * Seats options->seats players, with options->startPlayerMoney each, in the
+ * NORMAL state. Clears the hands and stats and deals the first shoe of
+ * options->numOfDecks decks, shuffled when needed (no shoe pool).
+ *
+ * The shoes are shuffled from a key made of options->seed and tableId, so a
+ * table always gets the same cards for the same seed. The house rules are set
+ * from the options.
+ */
+void ResetTable(Table * table, GameOptions * options, int tableId){
+    memset(table, 0, sizeof(Table));
+
+    table->numOfDecks = options->numOfDecks;
+    table->currentPlayer = -1;
+    table->id = tableId;
+    table->shoe.key = MixBits(options->seed ^ MixBits((uint64_t) tableId + 1));
+
+    for (int i = 0; i < options->seats; i ++){
+        table->playerMoney[i] = options->startPlayerMoney;
+        table->playerBet[i] = options->betMoney;
+    }
+    SeatPlayers(&table->seats, options->seats);
+    SetRules(&table->rules, options);
+
+    Shuffle(table->cardStack, &table->stackTopCard, table->numOfDecks, 
+        &table->shoe);
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                         GAME MECHANICS FUNCTIONS                         *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Loads the decks to the card stack
+ *
+ * @param[in,out] cardStack   ptr to the card stack where to put the decks
+ * @param[in]     numOfDecks  number of decks to load
+ *
+ * Initializes the card stack pointed by cardStack with the number of decks
+ * pointed by numOfDecks.
+ */
+void GenerateDecks(card_t cardStack[], int numOfDecks){
+    for (int i = 0; i < numOfDecks; i++){
+        for (int j = 0; j < DECK_SIZE; j++){
+            cardStack[i * DECK_SIZE + j] = j;
+        }
+    }
+}
+
+/**
+ * @brief         Replaces the card stack with the next shuffled shoe
+ *
+ * @param[out]    cardStack     ptr to the card stack array
+ * @param[out]    stackTopCard  ptr to the stack's top card location
+ * @param[in]     numOfDecks    number of decks used
+ * @param[in,out] shoe          ptr to the source of shuffled shoes
+ *
+ * Takes the shoe from the shoe pool if the table has one, or shuffles it
+ * now. Either way it is the same shoe.
+ */
+void Shuffle(card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe){
+    TRACE_SCOPE("Shuffle");
+    TRACE_COUNT(TRACE_RESHUFFLES, 1);
+    if (shoe->pool != NULL){
+        TakeShoe(shoe->pool, cardStack);
+    } else {
+        ShuffleShoe(cardStack, numOfDecks, shoe->key, shoe->shoesDealt);
+    }
+    shoe->shoesDealt++;
+    *stackTopCard = 0;
+}
+
+/**
+ * @brief      Shuffles one shoe of a table
+ *
+ * @param[out] cardStack   ptr to the card stack array to fill
+ * @param[in]  numOfDecks  number of decks in the shoe
+ * @param[in]  key         random stream of the table
+ * @param[in]  shoeNumber  number of the shoe in the stream
+ *
+ * Fisher-Yates shuffle of fresh decks. All the random indices are made first,
+ * in one pass: each one is a hash of (key, shoeNumber, position), so the loop
+ * has no dependency between iterations and the compiler can vectorize it. The
+ * index of position i is a 32 bit random number scaled to 0..i with a multiply
+ * and a shift instead of a modulo.
+ */
+void ShuffleShoe(card_t cardStack[], int numOfDecks, uint64_t key, uint64_t shoeNumber){
+    uint32_t index[DECK_SIZE * MAX_NUM_DECKS];
+    uint64_t base = MixBits(key + shoeNumber * 0xD1B54A32D192ED03ull);
+    int numCards = numOfDecks * DECK_SIZE;
+
+    for (int i = 1; i < numCards; i++){
+        uint64_t bits = MixBits(base + i * 0x9E3779B97F4A7C15ull) >> 32;
+        index[i] = (uint32_t) ((bits * (uint64_t) (i + 1)) >> 32);
+    }
+
+    GenerateDecks(cardStack, numOfDecks);
+    for (int i = numCards - 1; i >= 1; i--){
+        card_t aux = cardStack[i];
+        cardStack[i] = cardStack[index[i]];
+        cardStack[index[i]] = aux;
+    }
+}
+
+/**
+ * @brief         Generates a pseudo-random number
+ *
+ * @param[in,out] rngState  ptr to the random number generator state
+ *
+ * @return        64 random bits
+ *
+ * SplitMix64 generator, with the same mixing as the shoe shuffles.
+ */
+uint64_t NextRandom(uint64_t * rngState){
+    *rngState += 0x9E3779B97F4A7C15ull;
+    return MixBits(*rngState);
+}
+
+/**
+ * @brief      Mixes the bits of a number (SplitMix64 finalizer)
+ *
+ * @param[in]  x     number to mix
+ *
+ * @return     the mixed number
+ */
+uint64_t MixBits(uint64_t x){
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief      Counts the points in a player's (or house) hand
+ *
+ * @param[in]  playerHand      ptr to the array of cards to count points
+ * @param[in]  numCardsInHand  number of cards in hand
+ *
+ * @return     the number of points in the player's (or house) hand
+ */
+int CountScore(card_t playerHand[], int numCardsInHand){
+
+    int playerScore = 0, numOfAces = 0;
+    for (int i = 0; i < numCardsInHand; i++){
+        int cardID, cardRank;
+
+        cardID = playerHand[i];
+        cardRank = cardID % 13; // find card rank
+
+        playerScore += CardPoints(cardRank);
+
+        if (cardRank == 12){
+            numOfAces += 1;
+        }
+    }
+
+    // account for ace's two possible values
+    for (int i = 0; i < numOfAces; i++){
+        if (playerScore > 21) {
+            playerScore -= 10; // change an ace's value to 1
+        }
+    }
+
+    return playerScore;
+}
+
+/**
+ * @brief      Returns the value of a given card based on its rank
+ *
+ * @param[in]  cardRank  rank of the card
+ *
+ * @return     the value of the card based on cardRank
+ *
+ * Aces return 11 points, 1 point possible value has to be accounted later
+ */
+int CardPoints(int cardRank){
+    if (cardRank <= 7){ //number cards
+        return cardRank + 2;
+    } else if (cardRank <= 11){ //10 point cards
+        return 10;
+    } else { //ace
+        return 11;
+    }
+}
+
+
+/**
+ * @brief         Hands a card to a player (or house) from the card stack
+ *
+ * @param[in]     cardStack       ptr to the card stack array
+ * @param[in,out] stackTopCard    ptr to position of the top card in the stack
+ * @param[in]     numOfDecks      number of decks used
+ * @param[in,out] shoe            ptr to the source of shuffled shoes
+ * @param[out]    playerHand      ptr to array containing player/house hand
+ * @param[in,out] numCardsInHand  ptr to number of cards in player's hand
+ *
+ * Draws a card and put it in the player hand, increments the number of cards in
+ * player's hand and the position of the top card in the stack. Shuffles if the
+ * end of the stack is reached.
+ */
+void DrawCard(card_t cardStack[], int * stackTopCard, int numOfDecks, 
+    ShoeSource * shoe, card_t playerHand[], int * numCardsInHand){
+
+    TRACE_COUNT(TRACE_CARDS_DRAWN, 1);
+    playerHand[*numCardsInHand] = cardStack[*stackTopCard];
+    *numCardsInHand += 1;
+    *stackTopCard += 1;
+
+    // check if it was the last card on the card stack
+    if (*stackTopCard == numOfDecks * DECK_SIZE){
+        Shuffle (cardStack, stackTopCard, numOfDecks, shoe);
+        *stackTopCard = 0;
+    }
 }
 
 
@@ -554,66 +2630,75 @@ void DrawCard(int cardStack[], int * stackTopCard, int numOfDecks,
  * @param[in]     cardStack      ptr to card stack array
  * @param[in,out] stackTopCard   ptr to location of the stack top card
  * @param[in]     numOfDecks     number of decks used
+ * @param[in,out] shoe           ptr to the source of shuffled shoes
  * @param[in,out] playerCards    ptr to all player's cards array
  * @param[in,out] posPlayerHand  ptr to number of cards in player's hand array
  * @param[in,out] currentPlayer  ptr to current player number
  * @param[out]    playerScore    ptr to array of player scores
- * @param[in,out] playerState    ptr to array with players current state
+ * @param[in,out] seats          ptr to the player states
  * @param[out]    houseCards     ptr to array of house cards
  * @param[in,out] posHouseHand   ptr to number of cards in house hand
  *
  * @return        true if the game is over, false otherwise
  *
  * Resets posPlayerHand and posHouseHand and hands two cards to each player and
- * house.
+ * house. Only the seats that aren't broke are visited to deal.
  *
  * Searches for BlackJacks in the player's hands and passes the turn to the
  * first valid player. Returns true if no player is valid to play, returns false
  * otherwise
  */
 bool NewGame(
-        int cardStack[], int * stackTopCard, int numOfDecks, 
-        int playerCards[][MAX_CARD_HAND], int posPlayerHand[],
-        int * currentPlayer, int playerScore[], int playerState[],
-        int houseCards[], int * posHouseHand)
+        card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe, 
+        card_t playerCards[][MAX_CARD_HAND], int posPlayerHand[],
+        int * currentPlayer, int playerScore[], SeatStates * seats,
+        card_t houseCards[], int * posHouseHand)
 {
+    TRACE_SCOPE("NewGame");
+    seatmask_t playing = SeatsPlaying(seats);
 
     *currentPlayer = -1;
 
     // reset everyone's hands
-    // put everyone in the game except broke players
-    for (int i = 0; i < MAX_PLAYERS; i++){
+    for (seatmask_t left = playing | seats->broke; left != 0; left &= left - 1){
+        int i = __builtin_ctzll(left);
+
         posPlayerHand[i] = 0;
-        if (playerState[i] != BROKE) playerState[i] = NORMAL;
+        playerScore[i] = 0;
     }
     *posHouseHand = 0;
 
-    
+    // put everyone in the game except broke players
+    seats->active = playing;
+    seats->blackjack = 0;
+    seats->busted = 0;
 
     // hand initial cards
     for (int i = 0; i < 2; i++){
-        for (int j = 0; j < MAX_PLAYERS; j++){
-            if (playerState[j] != BROKE){
-                // hand card to player
-                DrawCard(cardStack, stackTopCard, numOfDecks, 
-                    playerCards[j], &posPlayerHand[j]);    
-            }
+        for (seatmask_t left = playing; left != 0; left &= left - 1){
+            int j = __builtin_ctzll(left);
+
+            // hand card to player
+            DrawCard(cardStack, stackTopCard, numOfDecks, shoe, 
+                playerCards[j], &posPlayerHand[j]);    
         }
         // hand card to house
-        DrawCard(cardStack, stackTopCard, numOfDecks, 
+        DrawCard(cardStack, stackTopCard, numOfDecks, shoe, 
             houseCards, posHouseHand);
     }
 
     // search for BlackJacks
-    for (int i = 0; i < MAX_PLAYERS; i++){
+    for (seatmask_t left = playing; left != 0; left &= left - 1){
+        int i = __builtin_ctzll(left);
+
         playerScore[i] = CountScore(playerCards[i], posPlayerHand[i]);
         if (playerScore[i] == 21){
-            BlackJack(&playerState[i]);
+            BlackJack(seats, i);
         }
     }
 
     // select the first player to play this round
-    *currentPlayer = WhosNext(playerState, *currentPlayer);
+    *currentPlayer = WhosNext(seats, *currentPlayer);
 
     // end the game if no players are valid to play
     if(*currentPlayer == -1){
@@ -630,12 +2715,13 @@ bool NewGame(
  * @param[in]     cardStack      ptr to card stack array
  * @param[in,out] stackTopCard   ptr to index of the top card of the card stack
  * @param[in]     numOfDecks     number of decks used
+ * @param[in,out] shoe           ptr to the source of shuffled shoes
  * @param[in,out] playerCards    ptr to array with all players cards
  * @param[in,out] posPlayerHand  ptr to array with the number of cards on each
  *                               player's hands
  * @param[in,out] playerScore    ptr to array of players scores
  * @param[in,out] currentPlayer  ptr to player currently playing
- * @param[in,out] playerState    ptr to array with players current state
+ * @param[in,out] seats          ptr to the player states
  * @param[out]    playerMoney    ptr to array with players money
  * @param[in]     betMoney       bet money game parameter
  *
@@ -646,211 +2732,5186 @@ bool NewGame(
  * the next player or returns true if there is no other player to play.
  */
 bool Hit(
-    int cardStack[], int * stackTopCard, int numOfDecks, 
-    int playerCards[][MAX_CARD_HAND], int posPlayerHand[], int playerScore[], 
-    int * currentPlayer, int playerState[], int playerMoney[], int betMoney)
+    card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe, 
+    card_t playerCards[][MAX_CARD_HAND], int posPlayerHand[], int playerScore[], 
+    int * currentPlayer, SeatStates * seats, int playerMoney[], int betMoney)
 {
+    TRACE_SCOPE("Hit");
+    int nextPlayer;
+
+    DrawCard(cardStack, stackTopCard, numOfDecks, shoe, 
+        playerCards[*currentPlayer], &posPlayerHand[*currentPlayer]);
+
+    // check for bust or BlackJack
+    playerScore[*currentPlayer] = CountScore(playerCards[*currentPlayer], posPlayerHand[*currentPlayer]);
+
+    if (playerScore[*currentPlayer] >= 21){
+        if (playerScore[*currentPlayer] > 21){
+            Bust(seats, *currentPlayer, &playerMoney[*currentPlayer], betMoney);
+        } else BlackJack(seats, *currentPlayer);
+
+        nextPlayer = WhosNext(seats, *currentPlayer);
+
+        // end the game if there is no other player to play
+        if (nextPlayer == -1){
+            return true;
+        } else {
+            *currentPlayer = nextPlayer;
+            return false;
+        }
+
+    } else {
+        return false;
+    }
+}
+
+/**
+ * @brief      "Stand" function. Passes the turn to next valid player
+ *
+ * @param      seats          ptr to the player states
+ * @param      currentPlayer  ptr to player currently playing
+ *
+ * @return     true if the game is over, false otherwise
+ */
+bool Stand(SeatStates * seats, int * currentPlayer){
+    TRACE_SCOPE("Stand");
     int nextPlayer;
 
-    DrawCard(cardStack, stackTopCard, numOfDecks, 
-        playerCards[*currentPlayer], &posPlayerHand[*currentPlayer]);
+    nextPlayer = WhosNext(seats, *currentPlayer);
+
+    // end the game if there is no other player to play
+    if (nextPlayer == -1){
+            return true;
+        } else {
+            *currentPlayer = nextPlayer;
+            return false;
+        }
+}
+
+
+/**
+ * @brief         "Double down" function. Doubles the bet of the current
+ *                player, hands him one card and ends his turn.
+ *
+ * @param[in]     cardStack      ptr to card stack array
+ * @param[in,out] stackTopCard   ptr to index of the top card of the card stack
+ * @param[in]     numOfDecks     number of decks used
+ * @param[in,out] shoe           ptr to the source of shuffled shoes
+ * @param[in,out] playerCards    ptr to array with all players cards
+ * @param[in,out] posPlayerHand  ptr to array with the number of cards on each
+ *                               player's hands
+ * @param[in,out] playerScore    ptr to array of players scores
+ * @param[in,out] currentPlayer  ptr to player currently playing
+ * @param[in,out] seats          ptr to the player states
+ * @param[in,out] playerMoney    ptr to array with players money
+ * @param[out]    playerBet      ptr to array with players bets of the round
+ * @param[in]     betMoney       bet money game parameter
+ *
+ * @return        true if the game is over, false otherwise
+ *
+ * The caller checks with CanDouble that the player may double.
+ */
+bool Double(
+    card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe, 
+    card_t playerCards[][MAX_CARD_HAND], int posPlayerHand[], int playerScore[], 
+    int * currentPlayer, SeatStates * seats, int playerMoney[], int playerBet[], 
+    int betMoney)
+{
+    TRACE_SCOPE("Double");
+    int player = *currentPlayer;
+
+    playerBet[player] = 2 * betMoney;
+
+    // a bust or a 21 already passes the turn
+    if (Hit(cardStack, stackTopCard, numOfDecks, shoe, playerCards, posPlayerHand, 
+            playerScore, currentPlayer, seats, playerMoney, playerBet[player])){
+        return true;
+    } else if (*currentPlayer != player){
+        return false;
+    }
+    return Stand(seats, currentPlayer);
+}
+
+/**
+ * @brief      Checks if a player may double down
+ *
+ * @param[in]  rules           ptr to the house rules
+ * @param[in]  numCardsInHand  number of cards in the player's hand
+ * @param[in]  playerMoney     player's money
+ * @param[in]  betMoney        bet money game parameter
+ *
+ * @return     true if the rules allow it, the player has only his first two
+ *             cards and can pay twice the bet, false otherwise
+ */
+bool CanDouble(const RuleSet * rules, int numCardsInHand, int playerMoney, int betMoney){
+    return rules->allowDouble && numCardsInHand == 2 && playerMoney >= 2 * betMoney;
+}
+
+/**
+ * @brief         Marks a player as busted and deducts the bet money from his
+ *                money
+ *
+ * @param[in,out] seats        ptr to the player states
+ * @param[in]     player       number of the player
+ * @param[out]    playerMoney  ptr to player's money
+ * @param[in]     betMoney     bet money game parameter
+ */
+void Bust(SeatStates * seats, int player, int * playerMoney, int betMoney){
+    seats->active &= ~((seatmask_t) 1 << player);
+    seats->busted |= (seatmask_t) 1 << player;
+    *playerMoney -= betMoney;
+}
+
+/**
+ * @brief         Marks a player has having a blackjack
+ *
+ * @param[in,out] seats   ptr to the player states
+ * @param[in]     player  number of the player
+ */
+void BlackJack(SeatStates * seats, int player){
+    seats->active &= ~((seatmask_t) 1 << player);
+    seats->blackjack |= (seatmask_t) 1 << player;
+}
+
+
+/**
+ * @brief      Picks the next valid player and flags if there
+ *             is no player left to play
+ *
+ * @param[in]  seats          ptr to the player states
+ * @param[in]  currentPlayer  player currently playing, -1 before the first
+ *
+ * @return     number of the next player if there is a valid player, -1 if there
+ *             is no valid player left
+ *
+ * The next player is the lowest active seat after currentPlayer, so it is
+ * found with a count of trailing zeros however many seats the table has.
+ */
+int WhosNext(const SeatStates * seats, int currentPlayer){
+    seatmask_t later = 0;
+
+    if (currentPlayer + 1 < (int) (8 * sizeof(seatmask_t))){
+        later = ~(seatmask_t) 0 << (currentPlayer + 1);
+    }
+    later &= seats->active;
+
+    if (later == 0){
+        return (-1); // no player left to play
+    }
+    return __builtin_ctzll(later); // next player
+}
+
+/**
+ * @brief      Makes the set of the first seats of a table
+ *
+ * @param[in]  numSeats  number of seats, up to MAX_PLAYERS
+ *
+ * @return     set of the seats 0 to numSeats - 1
+ */
+seatmask_t AllSeats(int numSeats){
+    if (numSeats >= (int) (8 * sizeof(seatmask_t))) return ~(seatmask_t) 0;
+    return ((seatmask_t) 1 << numSeats) - 1;
+}
+
+/**
+ * @brief      Gets the seats that play the rounds
+ *
+ * @param[in]  seats  ptr to the player states
+ *
+ * @return     set of the seats that aren't broke
+ */
+seatmask_t SeatsPlaying(const SeatStates * seats){
+    return seats->active | seats->blackjack | seats->busted;
+}
+
+/**
+ * @brief      Seats players at a table, all of them in the NORMAL state
+ *
+ * @param[out] seats     ptr to the player states
+ * @param[in]  numSeats  number of players
+ */
+void SeatPlayers(SeatStates * seats, int numSeats){
+    seats->active = AllSeats(numSeats);
+    seats->blackjack = 0;
+    seats->busted = 0;
+    seats->broke = 0;
+}
+
+/**
+ * @brief      Gets the state of a player
+ *
+ * @param[in]  seats  ptr to the player states
+ * @param[in]  seat   number of the player
+ *
+ * @return     NORMAL, BLACKJACK, BUSTED or BROKE, which is also the state of a
+ *             seat without a player
+ */
+int SeatState(const SeatStates * seats, int seat){
+    seatmask_t bit = (seatmask_t) 1 << seat;
+
+    if (seats->active & bit) return NORMAL;
+    if (seats->blackjack & bit) return BLACKJACK;
+    if (seats->busted & bit) return BUSTED;
+    return BROKE;
+}
+
+/**
+ * @brief         Handles house mechanics, bet collecting and stats updating
+ *
+ * @param[in]     cardStack         ptr to the card stack array
+ * @param[in,out] stackTopCard      ptr to the index of the top card in the
+ *                                  stack
+ * @param[in]     numOfDecks        number of decks used
+ * @param[in,out] shoe              ptr to the source of shuffled shoes
+ * @param[in,out] houseCards        ptr to array with house cards
+ * @param[in,out] posHouseHand      ptr to the number of cards in house hand
+ * @param[in,out] houseScore        ptr to house score
+ * @param[in]     posPlayerHand     ptr to array with players numbers of cards
+ *                                  in hand
+ * @param[in]     playerScore       ptr to array with each player's score
+ * @param[in,out] playerMoney       ptr to array with each player's money
+ * @param[in,out] playerBet         ptr to array with each player's bet of the
+ *                                  round, reset to betMoney
+ * @param[in,out] seats             ptr to the player states
+ * @param[out]    playerStats       ptr to array with each player's stats
+ * @param[in]     betMoney          bet money game parameter
+ * @param[in]     startPlayerMoney  starting player money game parameter
+ * @param[in]     rules             ptr to the house rules of the table
+ *
+ * Hands cards to the house with the house loop of the rules. Determines if a
+ * player won, won with a two card blackjack, drawn, loss or busted, manages
+ * players money and updates stats accordingly. A blackjack pays the bet times
+ * payoutNum / payoutDen, rounded down. Determines if a player is broken and
+ * updates his state if he is. Only the seats that played the round are
+ * visited.
+ */
+void HouseTurn(
+        card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe, 
+        card_t houseCards[], int * posHouseHand, int * houseScore, 
+        int posPlayerHand[], int playerScore[], int playerMoney[], int playerBet[], 
+        SeatStates * seats, int playerStats[MAX_PLAYERS][STATS], 
+        int betMoney, int startPlayerMoney, const RuleSet * rules)
+{
+    TRACE_SCOPE("HouseTurn");
+    seatmask_t broke = 0;
+    bool houseBusted;
+
+    *houseScore = rules->dealerPlay(cardStack, stackTopCard, numOfDecks, shoe, 
+        houseCards, posHouseHand);
+    houseBusted = *houseScore > 21;
+
+    // check win, loss or draw (only for players not broke) and manage money
+    for (seatmask_t left = SeatsPlaying(seats); left != 0; left &= left - 1){
+        int i = __builtin_ctzll(left);
+
+        if (playerScore[i] > 21) { // busted
+            playerStats[i][LOSSES] += 1;
+            // bet money took already when busted
+            
+        } else if (playerScore[i] == 21 && posPlayerHand[i] == 2 && *houseScore != 21) { //blackjack
+            playerMoney[i] += (int) ((long long) playerBet[i] * rules->payoutNum / 
+                rules->payoutDen);
+            playerStats[i][WINS] += 1;
+
+        } else if (playerScore[i] > *houseScore || houseBusted) { // won
+            playerMoney[i] += playerBet[i];
+            playerStats[i][WINS] += 1;
+           
+        } else if (playerScore[i] < *houseScore) { // lost
+            playerMoney[i] -= playerBet[i];
+            playerStats[i][LOSSES] += 1;
+
+        } else { // draw
+            playerStats[i][DRAWS] += 1;
+            
+        }
+
+        // check if the player is broke
+        if (playerMoney[i] < betMoney){
+            broke |= (seatmask_t) 1 << i;
+        } else {
+            // retain last state
+        }
+
+        // calculate money house won or lost with each player
+        playerStats[i][BALANCE] = startPlayerMoney - playerMoney[i];
+        playerBet[i] = betMoney;
+    }
+
+    // broke players leave the other states
+    seats->active &= ~broke;
+    seats->blackjack &= ~broke;
+    seats->busted &= ~broke;
+    seats->broke |= broke;
+}
+
+/**
+ * @brief         House loop when the house stands on every 17
+ *
+ * @param[in]     cardStack     ptr to the card stack array
+ * @param[in,out] stackTopCard  ptr to the index of the top card in the stack
+ * @param[in]     numOfDecks    number of decks used
+ * @param[in,out] shoe          ptr to the source of shuffled shoes
+ * @param[in,out] houseCards    ptr to array with house cards
+ * @param[in,out] posHouseHand  ptr to the number of cards in house hand
+ *
+ * @return        the house final score
+ */
+int HouseStandsSoft17(
+        card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe, 
+        card_t houseCards[], int * posHouseHand)
+{
+    int score = 0, softAces = 0;
+
+    for (int i = 0; i < *posHouseHand; i++){
+        AddCardValue(CardPoints(houseCards[i] % 13), &score, &softAces);
+    }
+
+    while (score < 17){
+        DrawCard(cardStack, stackTopCard, numOfDecks, shoe, houseCards, posHouseHand);
+        AddCardValue(CardPoints(houseCards[*posHouseHand - 1] % 13), &score, &softAces);
+    }
+    return score;
+}
+
+/**
+ * @brief         House loop when the house hits a soft 17
+ *
+ * @param[in]     cardStack     ptr to the card stack array
+ * @param[in,out] stackTopCard  ptr to the index of the top card in the stack
+ * @param[in]     numOfDecks    number of decks used
+ * @param[in,out] shoe          ptr to the source of shuffled shoes
+ * @param[in,out] houseCards    ptr to array with house cards
+ * @param[in,out] posHouseHand  ptr to the number of cards in house hand
+ *
+ * @return        the house final score
+ */
+int HouseHitsSoft17(
+        card_t cardStack[], int * stackTopCard, int numOfDecks, ShoeSource * shoe, 
+        card_t houseCards[], int * posHouseHand)
+{
+    int score = 0, softAces = 0;
+
+    for (int i = 0; i < *posHouseHand; i++){
+        AddCardValue(CardPoints(houseCards[i] % 13), &score, &softAces);
+    }
+
+    while (score < 17 || (score == 17 && softAces > 0)){
+        DrawCard(cardStack, stackTopCard, numOfDecks, shoe, houseCards, posHouseHand);
+        AddCardValue(CardPoints(houseCards[*posHouseHand - 1] % 13), &score, &softAces);
+    }
+    return score;
+}
+
+/**
+ * @brief      Sets the house rules of a table from the game options
+ *
+ * @param[out] rules    ptr to the house rules
+ * @param[in]  options  ptr to the game options
+ */
+void SetRules(RuleSet * rules, GameOptions * options){
+    if (options->dealerRule == DEALER_H17){
+        rules->dealerPlay = HouseHitsSoft17;
+    } else {
+        rules->dealerPlay = HouseStandsSoft17;
+    }
+    rules->payoutNum = options->payoutNum;
+    rules->payoutDen = options->payoutDen;
+    rules->allowDouble = options->allowDouble;
+}
+
+
+
+
+
+/**
+ * @brief      Decides if an automatic player hits or stands
+ *
+ * @param[in]  policy  player policy (POLICY_DEALER or POLICY_CAUTIOUS)
+ * @param[in]  score   current score of the player
+ *
+ * @return     true to hit, false to stand
+ */
+bool PlayerDecision(int policy, int score){
+    if (policy == POLICY_CAUTIOUS){
+        return score < 12;
+    } else {
+        return score < 17;
+    }
+}
+
+/**
+ * @brief      Decides if an automatic player doubles down
+ *
+ * @param[in]  policy  player policy (POLICY_DEALER or POLICY_CAUTIOUS)
+ * @param[in]  score   current score of the player (first two cards)
+ *
+ * @return     true to double, false otherwise
+ *
+ * Both policies double on 10 and 11, where one more card can't bust.
+ */
+bool PlayerDoubles(int policy, int score){
+    (void) policy;
+    return score == 10 || score == 11;
+}
+
+/**
+ * @brief         Plays one move of the current player following a policy
+ *
+ * @param[in,out] table     ptr to the game table
+ * @param[in]     policy    player policy (POLICY_DEALER, POLICY_CAUTIOUS or
+ *                          POLICY_PLUGIN)
+ * @param[in]     betMoney  bet money game parameter
+ *
+ * @return        true if the game is over, false otherwise
+ *
+ * Doubles down if the rules and the policy let the player, otherwise hits or
+ * stands as the policy decides. A plugin is asked for this move alone.
+ */
+bool PolicyMove(Table * table, int policy, int betMoney){
+    int player = table->currentPlayer;
+    int action = ACTION_STAND;
+
+    if (policy == POLICY_PLUGIN) return PluginMove(table, betMoney);
+
+    if (CanDouble(&table->rules, table->posPlayerHand[player], 
+            table->playerMoney[player], betMoney) && 
+            PlayerDoubles(policy, table->playerScore[player])){
+        action = ACTION_DOUBLE;
+    } else if (PlayerDecision(policy, table->playerScore[player])){
+        action = ACTION_HIT;
+    }
+    return PlayAction(table, action, betMoney);
+}
+
+/**
+ * @brief         Plays an action of the current player
+ *
+ * @param[in,out] table     ptr to the game table
+ * @param[in]     action    ACTION_HIT or ACTION_DOUBLE, any other value stands
+ * @param[in]     betMoney  bet money game parameter
+ *
+ * @return        true if the game is over, false otherwise
+ *
+ * The action must be allowed: doubling is checked with CanDouble first.
+ */
+bool PlayAction(Table * table, int action, int betMoney){
+    if (action == ACTION_DOUBLE){
+        return Double(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            table->playerScore, &table->currentPlayer, &table->seats, 
+            table->playerMoney, table->playerBet, betMoney);
+    } else if (action == ACTION_HIT){
+        return Hit(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            table->playerScore, &table->currentPlayer, &table->seats, 
+            table->playerMoney, betMoney);
+    }
+    return Stand(&table->seats, &table->currentPlayer);
+}
+
+/**
+ * @brief      Checks if every player is broke
+ *
+ * @param[in]  seats  ptr to the player states
+ *
+ * @return     true if no player can bet anymore, false otherwise
+ */
+bool AllPlayersBroke(const SeatStates * seats){
+    return SeatsPlaying(seats) == 0;
+}
+
+/**
+ * @brief         Adds the money won in a round to the statistics of a table
+ *
+ * @param[in,out] table       ptr to the game table
+ * @param[in]     played      set of the seats that played the round
+ * @param[in]     startMoney  ptr to array with each seat's money before it
+ * @param[in]     betMoney    bet money game parameter
+ *
+ * Each seat that played adds its profit, in bets, to its own statistics, and
+ * their mean is added to the statistics of the rounds, which estimate the
+ * house edge.
+ */
+void AddRoundProfit(Table * table, seatmask_t played, int startMoney[], int betMoney){
+    double roundProfit = 0;
+    int hands = 0;
+
+    for (seatmask_t left = played; left != 0; left &= left - 1){
+        int i = __builtin_ctzll(left);
+        double profit;
+
+        profit = (double) (table->playerMoney[i] - startMoney[i]) / betMoney;
+        AddSample(&table->seatProfit[i], profit);
+        roundProfit += profit;
+        hands++;
+    }
+    if (hands > 0) AddSample(&table->roundProfit, roundProfit / hands);
+}
+
+/**
+ * @brief         Plays whole rounds without a window, following the player
+ *                policy
+ *
+ * @param[in]     options      ptr to the game options
+ * @param[in,out] table        ptr to the game table
+ * @param[in,out] countReport  ptr to the card counting report, NULL if the
+ *                             cards aren't counted
+ * @param[in,out] results      ptr to the results buffer, NULL if the hands
+ *                             aren't written to a results file
+ * @param[in]     rounds       number of rounds to play, 0 for no limit
+ *
+ * @return        number of rounds played
+ *
+ * Plays the given number of rounds and stops early if every player goes
+ * broke. When counting, the count is updated after every move and
+ * the results of each round are recorded under the true count at its start.
+ */
+int PlayGames(GameOptions * options, Table * table, CountReport * countReport, 
+    ResultsBuffer * results, int rounds)
+{
+    TRACE_SCOPE("PlayGames");
+    int round, trueCount = 0;
+    int startMoney[MAX_PLAYERS];
+    seatmask_t played;
+    bool gameHasEnded;
+
+    for (round = 0; rounds == 0 || round < rounds; round++){
+        if (AllPlayersBroke(&table->seats)) break;
+
+        if (countReport != NULL){
+            trueCount = TrueCount(&countReport->counter, table->stackTopCard, 
+                table->numOfDecks);
+        }
+        memcpy(startMoney, table->playerMoney, options->seats * sizeof(int));
+        played = SeatsPlaying(&table->seats);
+
+        gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            &table->currentPlayer, table->playerScore, &table->seats, 
+            table->houseCards, &table->posHouseHand);
+        if (countReport != NULL) 
+            UpdateCount(&countReport->counter, table->cardStack, table->stackTopCard, 
+                table->shoe.shoesDealt);
+
+        while (!gameHasEnded){
+            gameHasEnded = PolicyMove(table, options->policy, options->betMoney);
+            if (countReport != NULL) 
+                UpdateCount(&countReport->counter, table->cardStack, table->stackTopCard, 
+                    table->shoe.shoesDealt);
+        }
+
+        HouseTurn(table->cardStack, &table->stackTopCard, table->numOfDecks, &table->shoe, 
+            table->houseCards, &table->posHouseHand, &table->houseScore, 
+            table->posPlayerHand, table->playerScore, table->playerMoney, 
+            table->playerBet, &table->seats, table->playerStats, 
+            options->betMoney, options->startPlayerMoney, &table->rules);
+
+        if (countReport != NULL){
+            UpdateCount(&countReport->counter, table->cardStack, table->stackTopCard, 
+                table->shoe.shoesDealt);
+            RecordRound(countReport, trueCount, played, startMoney, table->playerMoney, 
+                options->betMoney);
+        }
+        if (results != NULL) AddResults(results, table, played, startMoney);
+        AddRoundProfit(table, played, startMoney, options->betMoney);
+        table->roundsPlayed++;
+    }
+
+    TRACE_COUNTERS();
+    return round;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                         POLICY PLUGIN FUNCTIONS                          *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Loads the policy plugin
+ *
+ * @param[in]     options  ptr to the game options (options->pluginPath)
+ *
+ * The shared object must export PolicyAbiVersion and DecideBatch of
+ * policy_plugin.h and be built for its PLUGIN_ABI_VERSION. It stays loaded until
+ * the program exits. Exits if it can't be used.
+ */
+void LoadPlugin(GameOptions * options){
+    int (*abiVersion)(void);
+
+    if (options->pluginPath[0] == '\0'){
+        printf("The plugin policy needs a --plugin FILE\n");
+        exit(EXIT_FAILURE);
+    }
+
+    policyPlugin.handle = dlopen(options->pluginPath, RTLD_NOW | RTLD_LOCAL);
+    if (policyPlugin.handle == NULL){
+        printf("Couldn't load the policy plugin: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+
+    // dlsym returns a data pointer, converted to a function pointer as POSIX
+    // suggests
+    *(void **) &abiVersion = dlsym(policyPlugin.handle, "PolicyAbiVersion");
+    *(void **) &policyPlugin.decideBatch = dlsym(policyPlugin.handle, "DecideBatch");
+    if (abiVersion == NULL || policyPlugin.decideBatch == NULL){
+        printf("%s doesn't export PolicyAbiVersion and DecideBatch\n", options->pluginPath);
+        exit(EXIT_FAILURE);
+    }
+    if (abiVersion() != PLUGIN_ABI_VERSION){
+        printf("%s was built for plugin ABI %d, not %d\n", options->pluginPath, 
+            abiVersion(), PLUGIN_ABI_VERSION);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief         Plays one move of the current player decided by the plugin
+ *
+ * @param[in,out] table     ptr to the game table
+ * @param[in]     betMoney  bet money game parameter
+ *
+ * @return        true if the game is over, false otherwise
+ *
+ * The plugin is asked for a batch of this hand alone, with the unseen cards
+ * counted over the whole stack. Simulations with many tables play them
+ * together with PlayBatch instead.
+ */
+bool PluginMove(Table * table, int betMoney){
+    int32_t total, upCard, shoe[EV_VALUES];
+    uint8_t soft, numCards, canDouble, action = ACTION_STAND;
+    int countedTo = INT_MAX;
+    uint64_t countedShoe = 0;
+    PolicyBatch batch = {1, &total, &soft, &numCards, &canDouble, &upCard, {NULL}};
+
+    DescribeHand(table, betMoney, &total, &soft, &numCards, &canDouble, &upCard);
+    CountUnseen(table, shoe, &countedTo, &countedShoe);
+    shoe[CardPoints(table->houseCards[0] % 13) - 2] += 1;
+    for (int i = 0; i < EV_VALUES; i++) batch.shoe[i] = &shoe[i];
+
+    policyPlugin.decideBatch(&batch, &action);
+    if (action == ACTION_DOUBLE && !canDouble) action = ACTION_HIT;
+    return PlayAction(table, action, betMoney);
+}
+
+/**
+ * @brief         Plays whole rounds of a batch of tables in lockstep, with
+ *                the moves decided by the policy plugin
+ *
+ * @param[in]     options  ptr to the game options
+ * @param[in,out] batch    ptr to the batch: table, count report and rounds
+ *                         (at least 1) of each table, and the rounds each one
+ *                         played on return
+ * @param[in,out] results  ptr to the results buffer, NULL if the hands
+ *                         aren't written to a results file
+ *
+ * Every table plays its rounds like in PlayGames, and stops early if its
+ * players go broke. Moves are made in steps: the current player of every
+ * table still deciding is written to the batch, and the plugin decides all
+ * of them in one call, so the cost of the call is shared by up to
+ * PLUGIN_BATCH_TABLES tables.
+ */
+void PlayBatch(GameOptions * options, DecisionBatch * batch, ResultsBuffer * results){
+    TRACE_SCOPE("PlayBatch");
+    int dealt, deciding;
+
+    for (int i = 0; i < batch->numTables; i++){
+        batch->tables[i].played = 0;
+        batch->tables[i].countedTo = INT_MAX;
+    }
+
+    do {
+        // every table with rounds left deals a new round
+        dealt = deciding = 0;
+        for (int i = 0; i < batch->numTables; i++){
+            BatchTable * slot = &batch->tables[i];
+            Table * table = slot->table;
+
+            slot->inRound = slot->played < slot->rounds && 
+                !AllPlayersBroke(&table->seats);
+            if (!slot->inRound) continue;
+
+            if (slot->countReport != NULL){
+                slot->trueCount = TrueCount(&slot->countReport->counter, 
+                    table->stackTopCard, table->numOfDecks);
+            }
+            memcpy(slot->startMoney, table->playerMoney, options->seats * sizeof(int));
+            slot->seated = SeatsPlaying(&table->seats);
+
+            if (!NewGame(table->cardStack, &table->stackTopCard, 
+                    table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+                    &table->currentPlayer, table->playerScore, &table->seats, 
+                    table->houseCards, &table->posHouseHand)){
+                batch->pending[deciding++] = i;
+            }
+            if (slot->countReport != NULL){
+                UpdateCount(&slot->countReport->counter, table->cardStack, 
+                    table->stackTopCard, table->shoe.shoesDealt);
+            }
+            dealt++;
+        }
+
+        // one move of every table still deciding per call to the plugin, the
+        // tables that finished are taken out of pending
+        while (deciding > 0){
+            int count = deciding;
+
+            for (int i = 0; i < count; i++){
+                BatchTable * slot = &batch->tables[batch->pending[i]];
+
+                DescribeHand(slot->table, options->betMoney, &batch->total[i], 
+                    &batch->soft[i], &batch->numCards[i], &batch->canDouble[i], 
+                    &batch->upCard[i]);
+                CountUnseen(slot->table, slot->unseen, &slot->countedTo, 
+                    &slot->countedShoe);
+                for (int j = 0; j < EV_VALUES; j++) batch->shoe[j][i] = slot->unseen[j];
+                batch->shoe[CardPoints(slot->table->houseCards[0] % 13) - 2][i] += 1;
+            }
+
+            AskDecisions(batch, count);
+
+            deciding = 0;
+            for (int i = 0; i < count; i++){
+                BatchTable * slot = &batch->tables[batch->pending[i]];
+                Table * table = slot->table;
+
+                if (!PlayAction(table, batch->actions[i], options->betMoney)){
+                    batch->pending[deciding++] = batch->pending[i];
+                }
+                if (slot->countReport != NULL){
+                    UpdateCount(&slot->countReport->counter, table->cardStack, 
+                        table->stackTopCard, table->shoe.shoesDealt);
+                }
+            }
+        }
+
+        // the house plays on every table dealt
+        for (int i = 0; i < batch->numTables; i++){
+            BatchTable * slot = &batch->tables[i];
+            Table * table = slot->table;
+
+            if (!slot->inRound) continue;
+            HouseTurn(table->cardStack, &table->stackTopCard, table->numOfDecks, 
+                &table->shoe, table->houseCards, &table->posHouseHand, &table->houseScore, 
+                table->posPlayerHand, table->playerScore, table->playerMoney, 
+                table->playerBet, &table->seats, table->playerStats, 
+                options->betMoney, options->startPlayerMoney, &table->rules);
+
+            if (slot->countReport != NULL){
+                UpdateCount(&slot->countReport->counter, table->cardStack, 
+                    table->stackTopCard, table->shoe.shoesDealt);
+                RecordRound(slot->countReport, slot->trueCount, slot->seated, 
+                    slot->startMoney, table->playerMoney, options->betMoney);
+            }
+            if (results != NULL) AddResults(results, table, slot->seated, slot->startMoney);
+            AddRoundProfit(table, slot->seated, slot->startMoney, options->betMoney);
+            table->roundsPlayed++;
+            slot->played++;
+        }
+    } while (dealt > 0);
+
+    TRACE_COUNTERS();
+}
+
+/**
+ * @brief         Asks the plugin for the decisions written to a batch
+ *
+ * @param[in,out] batch  ptr to the batch, its actions are written
+ * @param[in]     count  number of decisions
+ *
+ * Doubles where doubling isn't allowed are taken as hits.
+ */
+void AskDecisions(DecisionBatch * batch, int count){
+    PolicyBatch decisions = {count, batch->total, batch->soft, batch->numCards, 
+        batch->canDouble, batch->upCard, {NULL}};
+
+    for (int i = 0; i < EV_VALUES; i++) decisions.shoe[i] = batch->shoe[i];
+    policyPlugin.decideBatch(&decisions, batch->actions);
+
+    for (int i = 0; i < count; i++){
+        if (batch->actions[i] == ACTION_DOUBLE && !batch->canDouble[i]){
+            batch->actions[i] = ACTION_HIT;
+        }
+    }
+}
+
+/**
+ * @brief      Describes the hand of the current player for the plugin
+ *
+ * @param[in]  table      ptr to the game table
+ * @param[in]  betMoney   bet money game parameter
+ * @param[out] total      ptr to the score of the hand
+ * @param[out] soft       ptr set to 1 if an ace of the hand counts 11
+ * @param[out] numCards   ptr to the number of cards in the hand
+ * @param[out] canDouble  ptr set to 1 if the player can double down
+ * @param[out] upCard     ptr to the value of the house up card
+ */
+void DescribeHand(Table * table, int betMoney, int32_t * total, uint8_t * soft, 
+    uint8_t * numCards, uint8_t * canDouble, int32_t * upCard)
+{
+    int player = table->currentPlayer;
+    int score = 0, softAces = 0;
+
+    for (int i = 0; i < table->posPlayerHand[player]; i++){
+        AddCardValue(CardPoints(table->playerCards[player][i] % 13), &score, &softAces);
+    }
+    *total = score;
+    *soft = softAces > 0;
+    *numCards = table->posPlayerHand[player];
+    *canDouble = CanDouble(&table->rules, table->posPlayerHand[player], 
+        table->playerMoney[player], betMoney);
+    *upCard = CardPoints(table->houseCards[1] % 13);
+}
+
+/**
+ * @brief         Counts the cards of each value past the top of the stack
+ *
+ * @param[in]     table        ptr to the game table
+ * @param[in,out] unseen       ptr to array with the cards of each value
+ * @param[in,out] countedTo    ptr to stackTopCard when unseen was counted,
+ *                             INT_MAX to count the whole stack
+ * @param[in,out] countedShoe  ptr to shoesDealt when unseen was counted
+ *
+ * Like UpdateCount, only the cards dealt since the last count are taken out,
+ * unless the stack was reshuffled since.
+ */
+void CountUnseen(Table * table, int32_t unseen[], int * countedTo, uint64_t * countedShoe){
+    if (*countedTo == INT_MAX || *countedShoe != table->shoe.shoesDealt){
+        memset(unseen, 0, EV_VALUES * sizeof(int32_t));
+        for (int i = table->stackTopCard; i < table->numOfDecks * DECK_SIZE; i++){
+            unseen[CardPoints(table->cardStack[i] % 13) - 2] += 1;
+        }
+    } else {
+        for (int i = *countedTo; i < table->stackTopCard; i++){
+            unseen[CardPoints(table->cardStack[i] % 13) - 2] -= 1;
+        }
+    }
+    *countedTo = table->stackTopCard;
+    *countedShoe = table->shoe.shoesDealt;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                         CARD COUNTING FUNCTIONS                          *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Starts a new count
+ *
+ * @param[out] counter     ptr to the card counter
+ * @param[in]  system      ptr to the counting system to use
+ * @param[in]  numOfDecks  number of decks used
+ *
+ * A balanced system starts from 0. An unbalanced one, like KO, starts from
+ * its initial running count: minus the sum of its tags over a deck for every
+ * deck but one (4 - 4 * decks for KO), so it reaches +4 at the end of a KO shoe.
+ */
+void ResetCount(CardCounter * counter, const CountSystem * system, int numOfDecks){
+    int deckCount = 0;        // sum of the tags over a whole deck
+
+    for (int i = 0; i < 13; i++) deckCount += 4 * system->tags[i];
+
+    counter->system = system;
+    counter->balanced = deckCount == 0;
+    counter->initialCount = deckCount * (1 - numOfDecks);
+    counter->runningCount = counter->initialCount;
+    counter->countedTo = 0;
+    counter->countedShoe = 0;
+}
+
+/**
+ * @brief         Adds the cards dealt since the last update to the running
+ *                count
+ *
+ * @param[in,out] counter       ptr to the card counter
+ * @param[in]     cardStack     ptr to the card stack array
+ * @param[in]     stackTopCard  index of the top card in the stack
+ * @param[in]     shoesDealt    shoes dealt by the table so far
+ *
+ * Cards are dealt in order from the card stack, so only the cards between the
+ * last counted one and stackTopCard are added, one table lookup each. If
+ * DrawCard reshuffled the stack since the last update, however many times, the
+ * count starts again from the top of the new stack.
+ */
+void UpdateCount(CardCounter * counter, card_t cardStack[], int stackTopCard, 
+    uint64_t shoesDealt)
+{
+    const int * tags = counter->system->tags;
+
+    if (shoesDealt != counter->countedShoe){
+        counter->runningCount = counter->initialCount;
+        counter->countedTo = 0;
+    }
+
+    for (int i = counter->countedTo; i < stackTopCard; i++){
+        counter->runningCount += tags[cardStack[i] % 13];
+    }
+    counter->countedTo = stackTopCard;
+    counter->countedShoe = shoesDealt;
+}
+
+/**
+ * @brief      Computes the true count
+ *
+ * @param[in]  counter       ptr to the card counter
+ * @param[in]  stackTopCard  index of the top card in the stack
+ * @param[in]  numOfDecks    number of decks used
+ *
+ * @return     the running count per deck left in the stack, rounded down and
+ *             limited to +/-MAX_TRUE_COUNT
+ *
+ * Unbalanced systems are read by their running count, not divided by the
+ * decks left: their initial running count already takes the decks into account.
+ */
+int TrueCount(CardCounter * counter, int stackTopCard, int numOfDecks){
+    int cardsLeft = numOfDecks * DECK_SIZE - stackTopCard;
+    int trueCount;
+
+    if (!counter->balanced){
+        trueCount = counter->runningCount;
+    } else {
+        // integer division rounding down, also for negative counts
+        trueCount = counter->runningCount * DECK_SIZE;
+        if (trueCount >= 0) trueCount /= cardsLeft;
+        else trueCount = -((-trueCount + cardsLeft - 1) / cardsLeft);
+    }
+
+    if (trueCount > MAX_TRUE_COUNT) trueCount = MAX_TRUE_COUNT;
+    if (trueCount < -MAX_TRUE_COUNT) trueCount = -MAX_TRUE_COUNT;
+    return trueCount;
+}
+
+/**
+ * @brief         Records the results of a round under the true count at its
+ *                start
+ *
+ * @param[in,out] countReport  ptr to the card counting report
+ * @param[in]     trueCount    true count at the start of the round
+ * @param[in]     played       set of the seats that played the round
+ * @param[in]     startMoney   ptr to array with each player's money at the
+ *                             start of the round
+ * @param[in]     playerMoney  ptr to array with each player's money
+ * @param[in]     betMoney     bet money game parameter
+ *
+ * Only players that could bet at the start of the round are recorded.
+ */
+void RecordRound(CountReport * countReport, int trueCount, seatmask_t played, 
+    int startMoney[], int playerMoney[], int betMoney)
+{
+    int bucket = trueCount + MAX_TRUE_COUNT;
+
+    for (seatmask_t left = played; left != 0; left &= left - 1){
+        int i = __builtin_ctzll(left);
+        int profit = playerMoney[i] - startMoney[i];
+
+        if (startMoney[i] < betMoney) continue; // broke player
+
+        countReport->hands[bucket] += 1;
+        countReport->profit[bucket] += profit;
+        if (profit > 0) countReport->wins[bucket] += 1;
+        else if (profit < 0) countReport->losses[bucket] += 1;
+    }
+}
+
+/**
+ * @brief      Prints the card counting report to a file ("count.log")
+ *
+ * @param[in]  countReport  ptr to the card counting report
+ * @param[in]  betMoney     bet money game parameter
+ *
+ * For each true count with hands played prints the number of hands, wins,
+ * losses and the player edge (money won per money bet). Unbalanced systems
+ * are bucketed by their running count instead.
+ */
+void LogCountReport(CountReport * countReport, int betMoney){
+    FILE *countLog;
+
+    countLog = fopen("count.log", "w");
+    if (countLog == NULL){
+        printf("Couldn't open count file. No count report logged\n");
+        return;
+    }
+
+    fprintf(countLog, "Counting system: %s\n", countReport->counter.system->name);
+    fprintf(countLog, "%s \t Hands \t Wins \t Losses \t Player Edge\n", 
+        countReport->counter.balanced ? "True Count" : "Running Count");
+
+    for (int i = 0; i < COUNT_BUCKETS; i++){
+        if (countReport->hands[i] == 0) continue;
+
+        fprintf(countLog, "%+d \t %lld \t %lld \t %lld \t %+.4f%%\n", 
+            i - MAX_TRUE_COUNT, countReport->hands[i], countReport->wins[i], 
+            countReport->losses[i], 
+            100.0 * countReport->profit[i] / ((double) countReport->hands[i] * betMoney));
+    }
+    fclose(countLog);
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                        POLICY COMPARISON FUNCTIONS                       *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Compares two player policies with common random numbers
+ *
+ * @param[in]  options  ptr to the game options (options->policy and
+ *                      options->comparePolicy are compared)
+ *
+ * @return     EXIT_SUCCESS
+ *
+ * Plays options->rounds rounds on two tables with the same random stream,
+ * one per policy. Both tables deal every round from the same place of the
+ * same shoe, so the seats get the same first cards and the house the same
+ * up card. Before the house plays, the table that dealt fewer cards catches
+ * up with the other, so the house also draws the same cards. Every round
+ * starts with the money of options->startPlayerMoney, so no seat goes broke
+ * and the tables stay in step.
+ *
+ * The outcomes of the two policies are then strongly correlated, and the
+ * variance of their paired difference is much lower than the sum of their
+ * variances. The expected value per hand of each policy and of the difference
+ * are printed with 95% confidence intervals, along with the interval two
+ * independent runs would give and how many times more rounds they would need.
+ */
+int RunComparison(GameOptions * options){
+    Arena arena;
+    Table * tables[2];
+    int policies[2] = {options->policy, options->comparePolicy};
+    const char * names[3] = {policyNames[options->policy], 
+        policyNames[options->comparePolicy], "difference"};
+    RunningStats stats[3] = {{0}};
+    double variance[3];
+    double start = Now(), seconds;
+    long long rounds = options->rounds;
+
+    // both tables get the random stream of table 0: the same shoes
+    ArenaInit(&arena, 2 * (sizeof(Table) + ARENA_ALIGN));
+    for (int arm = 0; arm < 2; arm++){
+        tables[arm] = NewTable(&arena, options, 0);
+    }
+
+    for (long long round = 0; round < rounds; round++){
+        double profit[3];
+
+        for (int arm = 0; arm < 2; arm++){
+            Table * table = tables[arm];
+            bool gameHasEnded;
+
+            for (int i = 0; i < options->seats; i++){
+                table->playerMoney[i] = options->startPlayerMoney;
+            }
+            SeatPlayers(&table->seats, options->seats);
+            gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+                table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+                &table->currentPlayer, table->playerScore, &table->seats, 
+                table->houseCards, &table->posHouseHand);
+            while (!gameHasEnded){
+                gameHasEnded = PolicyMove(table, policies[arm], options->betMoney);
+            }
+        }
+
+        // the house draws the same cards on both tables
+        if (CardsDealt(tables[0]) < CardsDealt(tables[1])){
+            CatchUpShoe(tables[0], tables[1]);
+        } else {
+            CatchUpShoe(tables[1], tables[0]);
+        }
+
+        for (int arm = 0; arm < 2; arm++){
+            Table * table = tables[arm];
+
+            HouseTurn(table->cardStack, &table->stackTopCard, table->numOfDecks, 
+                &table->shoe, table->houseCards, &table->posHouseHand, &table->houseScore, 
+                table->posPlayerHand, table->playerScore, table->playerMoney, 
+                table->playerBet, &table->seats, table->playerStats, 
+                options->betMoney, options->startPlayerMoney, &table->rules);
+            table->roundsPlayed++;
+
+            // money won per hand, in bets
+            profit[arm] = 0;
+            for (int i = 0; i < options->seats; i++){
+                profit[arm] += table->playerMoney[i] - options->startPlayerMoney;
+            }
+            profit[arm] /= (double) options->seats * options->betMoney;
+        }
+        profit[2] = profit[0] - profit[1];
+
+        for (int i = 0; i < 3; i++){
+            AddSample(&stats[i], profit[i]);
+        }
+    }
+    seconds = Now() - start;
+
+    for (int i = 0; i < 3; i++){
+        variance[i] = rounds > 1 ? stats[i].m2 / (rounds - 1) : 0;
+    }
+
+    printf("%s vs %s: %lld rounds of %d hands on the same shoes and house cards "
+        "in %.3f s\n", names[0], names[1], rounds, options->seats, seconds);
+    for (int i = 0; i < 3; i++){
+        printf("%-11s EV %+.4f%% +- %.4f%% per hand\n", names[i], 100.0 * stats[i].mean, 
+            100.0 * StatsInterval(&stats[i]));
+    }
+    printf("Independent runs: difference +- %.4f%%", 
+        100.0 * CONFIDENCE_Z * sqrt((variance[0] + variance[1]) / rounds));
+    if (variance[2] > 0){
+        printf(", %.1f times the rounds for the same interval", 
+            (variance[0] + variance[1]) / variance[2]);
+    }
+    printf("\n");
+
+    ArenaFree(&arena);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief      Counts the cards a table dealt since it was created
+ *
+ * @param[in]  table  ptr to the table
+ *
+ * @return     number of cards dealt, counting every shoe
+ */
+long long CardsDealt(Table * table){
+    return (long long) table->shoe.shoesDealt * table->numOfDecks * DECK_SIZE 
+        + table->stackTopCard;
+}
+
+/**
+ * @brief         Moves a table to the place of the shoe another table with
+ *                the same random stream reached
+ *
+ * @param[in,out] behind  ptr to the table that dealt fewer cards
+ * @param[in]     ahead   ptr to the table that dealt more cards
+ *
+ * The cards between the two places are burned. The card stack is only copied
+ * when the other table already dealt the next shoe.
+ */
+void CatchUpShoe(Table * behind, Table * ahead){
+    if (behind->shoe.shoesDealt != ahead->shoe.shoesDealt){
+        memcpy(behind->cardStack, ahead->cardStack, sizeof(behind->cardStack));
+        behind->shoe.shoesDealt = ahead->shoe.shoesDealt;
+    }
+    behind->stackTopCard = ahead->stackTopCard;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                          RISK OF RUIN FUNCTIONS                          *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Computes how long a player's money lasts
+ *
+ * @param[in]  options  ptr to the game options (money, bet, policy, rules
+ *                      and options->ruinRounds)
+ *
+ * @return     EXIT_SUCCESS
+ *
+ * The money results of a hand are measured on the engine with
+ * SampleOutcomes, with and without doubling down since a player who can't
+ * pay twice the bet can't double. The money of a player is then a Markov
+ * chain: its distribution is carried round by round with RuinStep, and the
+ * probability that falls below the bet is the chance of going broke in that
+ * round, like the BROKE state of HouseTurn. Money is counted in units of the
+ * greatest common divisor of the results, and states too unlikely to matter
+ * are dropped from the top, so a round costs a few vectorized passes over
+ * the states that are still likely. At most RUIN_MAX_STATES states are kept:
+ * the money that goes above them is held apart and never goes broke, so the
+ * chances printed are then lower bounds and a warning tells by how much.
+ *
+ * Prints the chance of being broke after some numbers of rounds up to
+ * options->ruinRounds, the rounds by which 10%, 50% and 90% of the players
+ * are broke and the expected rounds until broke, counting those still
+ * playing after options->ruinRounds rounds as broke then.
+ */
+int RunRuin(GameOptions * options){
+    OutcomeDistribution outcomes, noDouble;
+    double * now, * next, * swap;
+    double alive = 1, ruined = 0, broke, capped = 0, expectedRounds = 0, sampleSeconds, start;
+    int unit = 0, lowest, first, top, maxTop, numStates, doubleFrom, maxUp = 0;
+    int quantiles[3] = {0}, report = 1, round;
+    long long states;
+    const double levels[3] = {0.1, 0.5, 0.9};
+
+    start = Now();
+    SampleOutcomes(options, options->allowDouble, &outcomes);
+    SampleOutcomes(options, false, &noDouble);
+    sampleSeconds = Now() - start;
+
+    // money moves in steps of unit, the state 0 is the lowest money not broke
+    for (int i = 0; i < outcomes.numOutcomes; i++){
+        unit = GreatestDivisor(unit, outcomes.money[i]);
+    }
+    for (int i = 0; i < noDouble.numOutcomes; i++){
+        unit = GreatestDivisor(unit, noDouble.money[i]);
+    }
+    for (int i = 0; i < outcomes.numOutcomes; i++){
+        outcomes.money[i] /= unit;
+        if (outcomes.money[i] > maxUp) maxUp = outcomes.money[i];
+    }
+    for (int i = 0; i < noDouble.numOutcomes; i++){
+        noDouble.money[i] /= unit;
+        if (noDouble.money[i] > maxUp) maxUp = noDouble.money[i];
+    }
+    lowest = options->startPlayerMoney - 
+        (options->startPlayerMoney - options->betMoney) / unit * unit;
+    first = (options->startPlayerMoney - lowest) / unit;
+    doubleFrom = (2 * options->betMoney - lowest + unit - 1) / unit;
+    if (doubleFrom < 0) doubleFrom = 0;
+
+    states = first + 1 + (long long) maxUp * options->ruinRounds;
+    numStates = states < RUIN_MAX_STATES ? (int) states : RUIN_MAX_STATES;
+    now = calloc(numStates, sizeof(double));
+    next = calloc(numStates, sizeof(double));
+    if (now == NULL || next == NULL){
+        printf("Couldn't allocate the risk of ruin states\n");
+        exit(EXIT_FAILURE);
+    }
+    now[first] = 1;
+    top = maxTop = first;
+
+    printf("Money %d, bet %d, policy %s: hand results measured on %d rounds in %.3f s\n", 
+        options->startPlayerMoney, options->betMoney, policyNames[options->policy], 
+        RUIN_SAMPLE_ROUNDS, sampleSeconds);
+    for (int i = 0; i < outcomes.numOutcomes; i++){
+        printf("  %+d: %.4f%%", outcomes.money[i] * unit, 100 * outcomes.prob[i]);
+    }
+    printf("\nRounds \t Broke\n");
+
+    start = Now();
+    // stops early once the money left in every state is negligible
+    for (round = 1; round <= options->ruinRounds && alive > RUIN_EPSILON; round++){
+        int last = top + maxUp < numStates - 1 ? top + maxUp : numStates - 1;
+
+        broke = 0;
+        memset(next, 0, (last + 1) * sizeof(double));
+        // players who can't pay a double down play without doubling
+        RuinStep(now, next, 0, doubleFrom < top + 1 ? doubleFrom : top + 1, &noDouble, 
+            last, &broke, &capped);
+        if (doubleFrom <= top){
+            RuinStep(now, next, doubleFrom, top + 1, &outcomes, last, &broke, &capped);
+        }
+
+        swap = now;
+        now = next;
+        next = swap;
+        top = last;
+        while (top > 0 && now[top] < RUIN_EPSILON) top--;
+        if (top > maxTop) maxTop = top;
+
+        alive = capped;
+        for (int k = 0; k <= top; k++) alive += now[k];
+
+        expectedRounds += 1 - ruined;
+        ruined += broke;
+        for (int i = 0; i < 3; i++){
+            if (quantiles[i] == 0 && ruined >= levels[i]) quantiles[i] = round;
+        }
+        if (round == report || round == options->ruinRounds){
+            printf("%6d \t %.4f%%\n", round, 100 * ruined);
+            report *= 10;
+        }
+    }
+    if (round <= options->ruinRounds){
+        printf("%6d \t %.4f%% (no money left in any state)\n", round - 1, 100 * ruined);
+    }
+
+    printf("Broke by round: ");
+    for (int i = 0; i < 3; i++){
+        if (quantiles[i] > 0) printf("%.0f%% %d  ", 100 * levels[i], quantiles[i]);
+        else printf("%.0f%% >%d  ", 100 * levels[i], options->ruinRounds);
+    }
+    printf("\nExpected rounds until broke: %.1f%s\n", expectedRounds, 
+        alive > RUIN_EPSILON ? " (at least, some players are still playing)" : "");
+    printf("Solved %d rounds in %.3f s, up to %d money states of %d\n", round - 1, 
+        Now() - start, maxTop + 1, unit);
+    if (capped > 0){
+        printf("Warning: %.4f%% of the players went above the %d money states kept and "
+            "were counted as never broke, the chances above are lower bounds\n", 
+            100 * capped, RUIN_MAX_STATES);
+    }
+
+    free(now);
+    free(next);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief      Measures the money results of a hand on the engine
+ *
+ * @param[in]  options      ptr to the game options
+ * @param[in]  allowDouble  false plays without doubling down
+ * @param[out] outcomes     ptr to the distribution of the results
+ *
+ * Plays RUIN_SAMPLE_ROUNDS rounds with the policy on a table whose players
+ * never run out of money, and counts the money every seat wins or loses in
+ * each hand.
+ */
+void SampleOutcomes(GameOptions * options, bool allowDouble, OutcomeDistribution * outcomes){
+    Arena arena;
+    Table * table;
+    long long totalHands = 0;
+
+    ArenaInit(&arena, sizeof(Table) + ARENA_ALIGN);
+    table = NewTable(&arena, options, 0);
+    table->rules.allowDouble = allowDouble;
+    memset(outcomes, 0, sizeof(OutcomeDistribution));
+
+    for (int round = 0; round < RUIN_SAMPLE_ROUNDS; round++){
+        bool gameHasEnded;
+
+        for (int i = 0; i < options->seats; i++){
+            table->playerMoney[i] = INT_MAX / 2;
+        }
+        gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            &table->currentPlayer, table->playerScore, &table->seats, 
+            table->houseCards, &table->posHouseHand);
+        while (!gameHasEnded){
+            gameHasEnded = PolicyMove(table, options->policy, options->betMoney);
+        }
+        HouseTurn(table->cardStack, &table->stackTopCard, table->numOfDecks, &table->shoe, 
+            table->houseCards, &table->posHouseHand, &table->houseScore, 
+            table->posPlayerHand, table->playerScore, table->playerMoney, 
+            table->playerBet, &table->seats, table->playerStats, 
+            options->betMoney, INT_MAX / 2, &table->rules);
+
+        for (int i = 0; i < options->seats; i++){
+            int money = table->playerMoney[i] - INT_MAX / 2;
+            int o = 0;
+
+            while (o < outcomes->numOutcomes && outcomes->money[o] != money) o++;
+            if (o == outcomes->numOutcomes){
+                if (o == RUIN_OUTCOMES){
+                    printf("More than %d results of a hand\n", RUIN_OUTCOMES);
+                    exit(EXIT_FAILURE);
+                }
+                outcomes->money[o] = money;
+                outcomes->numOutcomes++;
+            }
+            outcomes->hands[o]++;
+            totalHands++;
+        }
+    }
+
+    for (int o = 0; o < outcomes->numOutcomes; o++){
+        outcomes->prob[o] = (double) outcomes->hands[o] / totalHands;
+    }
+    ArenaFree(&arena);
+}
+
+/**
+ * @brief         Carries the money states of a range through one round
+ *
+ * @param[in]     now       ptr to the probability of each money state
+ * @param[in,out] next      ptr to the probabilities after the round
+ * @param[in]     from      first state of the range
+ * @param[in]     to        state after the last one of the range
+ * @param[in]     outcomes  ptr to the results of a hand, in money units
+ * @param[in]     last      highest state kept
+ * @param[in,out] broke     ptr to the probability of going broke, added to
+ * @param[in,out] above     ptr to the probability of ending above last, added
+ *                          to
+ *
+ * For each result the states move by the same amount, so each one is a
+ * scaled add of a contiguous block, which compilers vectorize when
+ * optimizing. States that end below 0 are broke; those above last are
+ * counted in above instead of next.
+ */
+void RuinStep(const double * restrict now, double * restrict next, int from, int to, 
+        const OutcomeDistribution * outcomes, int last, double * broke, double * above){
+    for (int o = 0; o < outcomes->numOutcomes; o++){
+        int move = outcomes->money[o];
+        double prob = outcomes->prob[o];
+        int lo = from > -move ? from : -move;
+        int hi = to < last + 1 - move ? to : last + 1 - move;
+
+        for (int k = from; k < lo && k < to; k++){
+            *broke += prob * now[k];
+        }
+        for (int k = lo; k < hi; k++){
+            next[k + move] += prob * now[k];
+        }
+        for (int k = hi > from ? hi : from; k < to; k++){
+            *above += prob * now[k];
+        }
+    }
+}
+
+/**
+ * @brief      Computes the greatest common divisor of two integers
+ *
+ * @param[in]  a     first integer, may be 0 or negative
+ * @param[in]  b     second integer, may be 0 or negative
+ *
+ * @return     the greatest common divisor, positive unless both are 0
+ */
+int GreatestDivisor(int a, int b){
+    if (a < 0) a = -a;
+    if (b < 0) b = -b;
+    while (b != 0){
+        int r = a % b;
+
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                           RESULTS FILE FUNCTIONS                         *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Creates a results file and writes its header
+ *
+ * @param[out] writer   ptr to the results writer
+ * @param[in]  options  ptr to the game options (path and game parameters)
+ */
+void OpenResults(ResultsWriter * writer, GameOptions * options){
+    ResultsHeader header;
+
+    writer->fd = open(options->resultsPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd == -1){
+        printf("Couldn't create the results file %s: %s\n", options->resultsPath, 
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    writer->blocks = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BJRESULT", sizeof(header.magic));
+    header.version = RESULTS_VERSION;
+    header.blockRows = RESULTS_BLOCK_ROWS;
+    header.numOfDecks = options->numOfDecks;
+    header.betMoney = options->betMoney;
+    header.seed = options->seed;
+    WriteAll(writer->fd, &header, sizeof(header));
+}
+
+/**
+ * @brief      Closes a results file
+ *
+ * @param[in]  writer  ptr to the results writer
+ *
+ * Every buffer writing to the file must be flushed before.
+ */
+void CloseResults(ResultsWriter * writer){
+    close(writer->fd);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+/**
+ * @brief         Adds the hands of a round to a results buffer
+ *
+ * @param[in,out] results     ptr to the results buffer
+ * @param[in]     table       ptr to the table, after HouseTurn
+ * @param[in]     played      set of the seats that played the round
+ * @param[in]     startMoney  ptr to array with each player's money before the
+ *                            round
+ *
+ * Adds a row for every seat that played the round and appends the block to
+ * the file when it is full.
+ */
+void AddResults(ResultsBuffer * results, Table * table, seatmask_t played, int startMoney[]){
+    ResultsBlock * block = &results->block;
+    uint64_t round = (uint64_t) table->id << 32 | (uint32_t) table->roundsPlayed;
+
+    for (seatmask_t left = played; left != 0; left &= left - 1){
+        int i = __builtin_ctzll(left);
+        int row = block->rows;
+
+        block->round[row] = round;
+        block->payout[row] = table->playerMoney[i] - startMoney[i];
+        block->seat[row] = i;
+        block->firstCard[row] = table->playerCards[i][0];
+        block->secondCard[row] = table->playerCards[i][1];
+        block->numCards[row] = table->posPlayerHand[i];
+        block->score[row] = table->playerScore[i];
+        block->houseScore[row] = table->houseScore;
+        block->state[row] = SeatState(&table->seats, i);
+
+        block->rows++;
+        if (block->rows == RESULTS_BLOCK_ROWS) FlushResults(results);
+    }
+}
+
+/**
+ * @brief         Appends the block of a results buffer to the file
+ *
+ * @param[in,out] results  ptr to the results buffer, emptied
+ *
+ * The whole block is written in one call, even if it isn't full, so every
+ * block of the file has the same size.
+ */
+void FlushResults(ResultsBuffer * results){
+    ResultsWriter * writer = results->writer;
+
+    if (results->block.rows == 0) return;
+
+    pthread_mutex_lock(&writer->lock);
+    WriteAll(writer->fd, &results->block, sizeof(ResultsBlock));
+    writer->blocks++;
+    pthread_mutex_unlock(&writer->lock);
+
+    results->block.rows = 0;
+}
+
+/**
+ * @brief      Writes a buffer to a file, retrying short writes
+ *
+ * @param[in]  fd    file descriptor
+ * @param[in]  data  ptr to the data
+ * @param[in]  size  number of bytes to write
+ */
+void WriteAll(int fd, const void * data, size_t size){
+    const char * bytes = data;
+
+    while (size > 0){
+        ssize_t written = write(fd, bytes, size);
+
+        if (written == -1 && errno == EINTR) continue;
+        if (written == -1){
+            printf("Couldn't write the results file: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+/**
+ * @brief      Prints a summary of a results file
+ *
+ * @param[in]  options  ptr to the game options (path of the file)
+ *
+ * @return     EXIT_SUCCESS
+ *
+ * Maps the file and reads the columns of every block in place: the hands,
+ * wins, draws, losses, blackjacks, busts and payout of each seat, and how
+ * often the house ends with each score. Exits the program if a block has
+ * more rows than it holds or a seat past MAX_PLAYERS.
+ */
+int ReadResults(GameOptions * options){
+    struct stat info;
+    const unsigned char * base;
+    const ResultsHeader * header;
+    long long hands[MAX_PLAYERS] = {0}, wins[MAX_PLAYERS] = {0};
+    long long draws[MAX_PLAYERS] = {0}, losses[MAX_PLAYERS] = {0};
+    long long blackjacks[MAX_PLAYERS] = {0}, busts[MAX_PLAYERS] = {0};
+    long long payout[MAX_PLAYERS] = {0}, houseScores[EV_OUTCOMES] = {0};
+    long long totalHands = 0, houseHands = 0, numBlocks;
+    int numSeats = 0;                 // highest seat with a hand, plus one
+    int fd;
+
+    fd = open(options->resultsPath, O_RDONLY);
+    if (fd == -1 || fstat(fd, &info) == -1){
+        printf("Couldn't open the results file %s: %s\n", options->resultsPath, 
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t) info.st_size < sizeof(ResultsHeader)){
+        printf("%s is not a results file\n", options->resultsPath);
+        exit(EXIT_FAILURE);
+    }
+
+    base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED){
+        printf("Couldn't map the results file: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    posix_madvise((void *) base, info.st_size, POSIX_MADV_SEQUENTIAL);
+
+    header = (const ResultsHeader *) base;
+    numBlocks = (info.st_size - sizeof(ResultsHeader)) / sizeof(ResultsBlock);
+    if (memcmp(header->magic, "BJRESULT", sizeof(header->magic)) != 0 || 
+            header->version != RESULTS_VERSION || 
+            header->blockRows != RESULTS_BLOCK_ROWS || 
+            sizeof(ResultsHeader) + numBlocks * sizeof(ResultsBlock) != (size_t) info.st_size){
+        printf("%s is not a results file of this version\n", options->resultsPath);
+        exit(EXIT_FAILURE);
+    }
+
+    for (long long b = 0; b < numBlocks; b++){
+        const ResultsBlock * block = (const ResultsBlock *) 
+            (base + sizeof(ResultsHeader) + b * sizeof(ResultsBlock));
+
+        if (block->rows > RESULTS_BLOCK_ROWS){
+            printf("%s is not a results file\n", options->resultsPath);
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t row = 0; row < block->rows; row++){
+            int seat = block->seat[row];
+
+            if (seat >= MAX_PLAYERS){
+                printf("%s is not a results file\n", options->resultsPath);
+                exit(EXIT_FAILURE);
+            }
+            if (seat >= numSeats) numSeats = seat + 1;
+            hands[seat]++;
+            payout[seat] += block->payout[row];
+            wins[seat] += block->payout[row] > 0;
+            draws[seat] += block->payout[row] == 0;
+            losses[seat] += block->payout[row] < 0;
+            busts[seat] += block->score[row] > 21;
+            blackjacks[seat] += block->score[row] == 21 && block->numCards[row] == 2;
+
+            if (block->houseScore[row] > 21) houseScores[EV_OUTCOMES - 1]++;
+            else if (block->houseScore[row] >= 17) houseScores[block->houseScore[row] - 17]++;
+        }
+        totalHands += block->rows;
+    }
+
+    printf("%s: %lld hands in %lld blocks, %u decks, bet %u, seed %llu\n", 
+        options->resultsPath, totalHands, numBlocks, header->numOfDecks, 
+        header->betMoney, (unsigned long long) header->seed);
+    printf("Seat \t Hands \t Wins \t Draws \t Losses \t Blackjacks \t Busts \t Payout \t Edge\n");
+    for (int i = 0; i < numSeats; i++){
+        printf("%d \t %lld \t %lld \t %lld \t %lld \t %lld \t %lld \t %lld \t %.4f%%\n", 
+            i + 1, hands[i], wins[i], draws[i], losses[i], blackjacks[i], busts[i], 
+            payout[i], hands[i] ? 100.0 * payout[i] / ((double) hands[i] * header->betMoney) : 0.0);
+    }
+    printf("House final score:");
+    for (int i = 0; i < EV_OUTCOMES; i++) houseHands += houseScores[i];
+    for (int i = 0; i < EV_OUTCOMES; i++){
+        if (i < EV_OUTCOMES - 1) printf(" %d", 17 + i);
+        else printf(" bust");
+        printf(" %.2f%%", houseHands ? 100.0 * houseScores[i] / houseHands : 0.0);
+    }
+    printf("\n");
+
+    munmap((void *) base, info.st_size);
+    return EXIT_SUCCESS;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                            SHOE POOL FUNCTIONS                           *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Starts shuffling the next shoes of a table on another thread
+ *
+ * @param[in,out] arena       ptr to the arena the pool is taken from
+ * @param[in,out] shoe        ptr to the source of shoes of the table
+ * @param[in]     numOfDecks  number of decks in a shoe
+ */
+void StartShoePool(Arena * arena, ShoeSource * shoe, int numOfDecks){
+    ShoePool * pool = ArenaAlloc(arena, sizeof(ShoePool));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->taken, NULL);
+    pool->numOfDecks = numOfDecks;
+    pool->key = shoe->key;
+    pool->nextShoe = shoe->shoesDealt;
+
+    if (pthread_create(&pool->thread, NULL, ShoePoolWorker, pool) != 0){
+        printf("Couldn't start the shoe pool\n");
+        exit(EXIT_FAILURE);
+    }
+    shoe->pool = pool;
+}
+
+/**
+ * @brief         Stops the thread of a shoe pool, if the table has one
+ *
+ * @param[in,out] shoe  ptr to the source of shoes of the table
+ *
+ * The pool memory belongs to the arena it was taken from.
+ */
+void StopShoePool(ShoeSource * shoe){
+    ShoePool * pool = shoe->pool;
+
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_signal(&pool->taken);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->taken);
+    pthread_mutex_destroy(&pool->lock);
+    shoe->pool = NULL;
+}
+
+/**
+ * @brief      Shoe pool thread
+ *
+ * @param[in]  arg   ptr to the shoe pool
+ *
+ * @return     NULL
+ *
+ * Keeps the ring buffer of the pool full of shoes, in order. The free slot is
+ * filled without holding the lock: the table only reads the slots that are
+ * counted as ready.
+ */
+void * ShoePoolWorker(void * arg){
+    ShoePool * pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit){
+        int slot;
+
+        if (pool->count == SHOE_POOL_SIZE){
+            pthread_cond_wait(&pool->taken, &pool->lock);
+            continue;
+        }
+        slot = (pool->head + pool->count) % SHOE_POOL_SIZE;
+        pthread_mutex_unlock(&pool->lock);
+
+        ShuffleShoe(pool->shoes[slot], pool->numOfDecks, pool->key, pool->nextShoe);
+        pool->nextShoe++;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->count++;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * @brief         Takes the next shoe out of a shoe pool
+ *
+ * @param[in,out] pool       ptr to the shoe pool
+ * @param[out]    cardStack  ptr to the card stack array to fill
+ *
+ * Waits if the shoe isn't shuffled yet. The shoe is copied into the table,
+ * so the state of a table stays in one block.
+ */
+void TakeShoe(ShoePool * pool, card_t cardStack[]){
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == 0){
+        pthread_cond_wait(&pool->ready, &pool->lock);
+    }
+    memcpy(cardStack, pool->shoes[pool->head], pool->numOfDecks * DECK_SIZE * sizeof(card_t));
+    pool->head = (pool->head + 1) % SHOE_POOL_SIZE;
+    pool->count--;
+    pthread_cond_signal(&pool->taken);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                      SIMULATION SCHEDULER FUNCTIONS                      *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Simulates many tables on a pool of threads
+ *
+ * @param[in]  options     ptr to the game options
+ * @param[in]  checkpoint  ptr to the mapped checkpoint to resume, or NULL
+ * @param[out] shard       ptr to the results of a shard process, or NULL
+ *
+ * @return     EXIT_SUCCESS
+ *
+ * Plays options->numTables tables, options->rounds rounds each (or until
+ * every player is broke if it is 0), on options->threads threads. The work is
+ * split in tasks of options->chunk rounds of one table. Tables start evenly
+ * spread over the workers; a worker that runs out of tasks steals the oldest
+ * task of another worker, so tables that go broke early don't leave threads
+ * idle while long tables are still playing.
+ *
+ * Every table has its own random stream, so the results don't depend on the
+ * number of threads or on which thread played each chunk. The stats of all
+ * tables are added up and logged, and the use of each worker is printed along
+ * with the size of the state of a table, so builds with and without
+ * -DWIDE_CARDS can be compared.
+ *
+ * With options->precision, the simulation stops as soon as the house edge of
+ * the rounds played by every worker is known to that precision, leaving the
+ * other rounds unplayed.
+ *
+ * With options->checkpointPath, every table publishes a snapshot after each
+ * chunk and a checkpoint thread saves them; a checkpoint given by
+ * options->resumePath sets the tables back to where it was written.
+ *
+ * In a shard process only the tables of the shard are played, and their
+ * results are written to it instead of being printed and logged.
+ */
+int RunSimulation(GameOptions * options, const CheckpointHeader * checkpoint, 
+    ShardResult * shard)
+{
+    Arena arena;
+    Scheduler scheduler;
+    Checkpointer checkpointer;
+    int playerStats[MAX_PLAYERS][STATS] = {{0}};
+    RunningStats seatProfit[MAX_PLAYERS] = {{0}}, roundProfit = {0};
+    CountReport * totalReport = NULL;
+    long long totalRounds = 0, playedRounds = 0;
+    double start, seconds;
+    int numTables = shard != NULL ? shard->numTables : options->numTables;
+    int firstTable = shard != NULL ? shard->firstTable : 0;
+    PerfCounters perfCounters = {{0}};
+
+    ArenaInit(&arena, numTables * (sizeof(Table) + sizeof(CountReport) + sizeof(TableSnapshot)) 
+        + options->threads * (sizeof(Worker) + numTables * sizeof(int) 
+            + sizeof(ResultsBuffer) + 2 * ARENA_ALIGN) 
+        + (options->policy == POLICY_PLUGIN ? 
+            options->threads * (sizeof(DecisionBatch) + ARENA_ALIGN) : 0)
+        + sizeof(CountReport) + sizeof(ResultsWriter) + 7 * ARENA_ALIGN);
+
+    memset(&scheduler, 0, sizeof(scheduler));
+    scheduler.options = options;
+    scheduler.numWorkers = options->threads;
+    scheduler.tables = ArenaAlloc(&arena, numTables * sizeof(Table));
+    scheduler.workers = ArenaAlloc(&arena, options->threads * sizeof(Worker));
+    pthread_mutex_init(&scheduler.idleLock, NULL);
+    pthread_cond_init(&scheduler.idle, NULL);
+
+    if (options->countSystem != COUNT_NONE){
+        scheduler.countReports = ArenaAlloc(&arena, numTables * sizeof(CountReport));
+        totalReport = ArenaAlloc(&arena, sizeof(CountReport));
+        ResetCount(&totalReport->counter, &countSystems[options->countSystem], 
+            options->numOfDecks);
+    }
+    if (options->resultsMode == RESULTS_WRITE){
+        scheduler.results = ArenaAlloc(&arena, sizeof(ResultsWriter));
+        OpenResults(scheduler.results, options);
+    }
+
+    for (int i = 0; i < scheduler.numWorkers; i++){
+        Worker * worker = &scheduler.workers[i];
+
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->tasks = ArenaAlloc(&arena, numTables * sizeof(int));
+        worker->id = i;
+        worker->rngState = MixBits((uint64_t) i + 1);
+        worker->scheduler = &scheduler;
+        if (scheduler.results != NULL){
+            worker->results = ArenaAlloc(&arena, sizeof(ResultsBuffer));
+            worker->results->writer = scheduler.results;
+        }
+        if (options->policy == POLICY_PLUGIN){
+            worker->batch = ArenaAlloc(&arena, sizeof(DecisionBatch));
+        }
+    }
+
+    // tables start evenly spread over the workers, resumed ones from their
+    // snapshot; those already finished are only added up
+    scheduler.unfinished = 0;
+    for (int i = 0; i < numTables; i++){
+        ResetTable(&scheduler.tables[i], options, firstTable + i);
+        if (scheduler.countReports != NULL){
+            ResetCount(&scheduler.countReports[i].counter, 
+                &countSystems[options->countSystem], options->numOfDecks);
+        }
+        if (checkpoint != NULL){
+            RestoreTable(&scheduler.tables[i], &CheckpointTables(checkpoint)[i], options);
+            if (scheduler.countReports != NULL){
+                RestoreCountReport(&scheduler.countReports[i], 
+                    &CheckpointTables(checkpoint)[i], options);
+            }
+        }
+        if (!TableFinished(&scheduler.tables[i], options)){
+            PushTask(&scheduler.workers[scheduler.unfinished % scheduler.numWorkers], i);
+            scheduler.unfinished++;
+        }
+    }
+    if (checkpoint != NULL) UnloadCheckpoint(checkpoint);
+
+    if (options->checkpointPath[0] != '\0'){
+        scheduler.snapshots = ArenaAlloc(&arena, numTables * sizeof(TableSnapshot));
+        for (int i = 0; i < numTables; i++){
+            PublishSnapshot(&scheduler.snapshots[i], &scheduler.tables[i], 
+                scheduler.countReports ? &scheduler.countReports[i] : NULL);
+        }
+        StartCheckpointer(&checkpointer, options, scheduler.snapshots, numTables);
+    }
+
+    // opened before the workers start, so their counts are added up too; the
+    // coordinator of the shards counts them all
+    if (options->perf && shard == NULL) PerfOpen(&perfCounters);
+    PerfStart(&perfCounters);
+    start = Now();
+    for (int i = 0; i < scheduler.numWorkers; i++){
+        if (pthread_create(&scheduler.workers[i].thread, NULL, SimulationWorker, 
+                &scheduler.workers[i]) != 0){
+            printf("Couldn't start simulation thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < scheduler.numWorkers; i++){
+        pthread_join(scheduler.workers[i].thread, NULL);
+    }
+    seconds = Now() - start;
+    PerfStop(&perfCounters);
+    if (scheduler.snapshots != NULL) StopCheckpointer(&checkpointer);
+
+    // add up the results of every table
+    for (int i = 0; i < numTables; i++){
+        totalRounds += scheduler.tables[i].roundsPlayed;
+        for (int j = 0; j < options->seats; j++){
+            for (int k = 0; k < STATS; k++){
+                playerStats[j][k] += scheduler.tables[i].playerStats[j][k];
+            }
+            MergeStats(&seatProfit[j], &scheduler.tables[i].seatProfit[j]);
+        }
+        MergeStats(&roundProfit, &scheduler.tables[i].roundProfit);
+        for (int j = 0; totalReport != NULL && j < COUNT_BUCKETS; j++){
+            totalReport->hands[j] += scheduler.countReports[i].hands[j];
+            totalReport->profit[j] += scheduler.countReports[i].profit[j];
+            totalReport->wins[j] += scheduler.countReports[i].wins[j];
+            totalReport->losses[j] += scheduler.countReports[i].losses[j];
+        }
+    }
+
+    // the rate only counts the rounds played now, not those of a checkpoint
+    for (int i = 0; i < scheduler.numWorkers; i++){
+        playedRounds += scheduler.workers[i].roundsPlayed;
+        pthread_mutex_destroy(&scheduler.workers[i].lock);
+    }
+    pthread_mutex_destroy(&scheduler.idleLock);
+    pthread_cond_destroy(&scheduler.idle);
+
+    if (shard != NULL){
+        memcpy(shard->playerStats, playerStats, sizeof(playerStats));
+        memcpy(shard->seatProfit, seatProfit, sizeof(seatProfit));
+        shard->roundProfit = roundProfit;
+        if (totalReport != NULL) shard->countReport = *totalReport;
+        shard->roundsPlayed = playedRounds;
+        shard->seconds = seconds;
+        __atomic_store_n(&shard->done, 1, __ATOMIC_RELEASE);
+        ArenaFree(&arena);
+        return EXIT_SUCCESS;
+    }
+
+    printf("%d tables, %lld rounds in %.3f s (%.0f rounds/s) on %d threads\n", 
+        numTables, totalRounds, seconds, playedRounds / seconds, scheduler.numWorkers);
+    PrintPerfCounters(&perfCounters, "round", playedRounds);
+    PerfClose(&perfCounters);
+    printf("Table state: %zu bytes (%zu cache lines, %zu-byte cards), %.0f tables/s\n", 
+        sizeof(Table), sizeof(Table) / CARD_ALIGN, sizeof(card_t), numTables / seconds);
+    for (int i = 0; i < scheduler.numWorkers; i++){
+        Worker * worker = &scheduler.workers[i];
+
+        printf("Worker %d: %lld tasks, %lld stolen, %lld rounds, %.1f%% busy, "
+            "%.1f%% idle\n", i, worker->tasksRun, worker->steals, worker->roundsPlayed, 
+            100.0 * worker->busySeconds / seconds, 100.0 * worker->idleSeconds / seconds);
+        if (worker->results != NULL) FlushResults(worker->results);
+    }
+    if (scheduler.results != NULL) CloseResults(scheduler.results);
+
+    PrintProfitStats(seatProfit, &roundProfit, options->seats);
+    LogStats(playerStats, playerNames, options->seats);
+    if (totalReport != NULL) LogCountReport(totalReport, options->betMoney);
+
+    ArenaFree(&arena);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief      Simulation worker thread
+ *
+ * @param[in]  arg   ptr to the worker
+ *
+ * @return     NULL
+ *
+ * Takes its newest task or steals the oldest task of a random worker, plays
+ * a chunk of rounds of that table and puts the table back in its own deque
+ * if it has rounds left. With a policy plugin the chunk is played by a batch
+ * of its tables at once (PlayBatchTask). A worker that finds nothing to
+ * steal parks in WaitForTasks until a task is pushed. Stops when every table
+ * is finished or the precision asked is reached.
+ */
+void * SimulationWorker(void * arg){
+    Worker * worker = arg;
+    Scheduler * scheduler = worker->scheduler;
+    GameOptions * options = scheduler->options;
+    int table, rounds, played;
+    Table * state;
+    RunningStats total, chunk;
+    double start;
+
+    while (__atomic_load_n(&scheduler->unfinished, __ATOMIC_ACQUIRE) > 0 && 
+            !__atomic_load_n(&scheduler->stop, __ATOMIC_ACQUIRE)){
+        if (!PopTask(worker, &table)){
+            // read before looking, so a task pushed meanwhile isn't waited for
+            int wakeUps = __atomic_load_n(&scheduler->wakeUps, __ATOMIC_SEQ_CST);
+            bool stolen = false;
+
+            for (int i = 0; i < scheduler->numWorkers && !stolen; i++){
+                Worker * victim = &scheduler->workers[
+                    NextRandom(&worker->rngState) % scheduler->numWorkers];
+                if (victim != worker) stolen = StealTask(victim, &table);
+            }
+
+            if (!stolen){
+                start = Now();
+                WaitForTasks(scheduler, wakeUps);
+                worker->idleSeconds += Now() - start;
+                continue;
+            }
+            worker->steals++;
+        }
+
+        // a policy plugin decides for many tables of the worker at once
+        if (worker->batch != NULL){
+            PlayBatchTask(worker, table);
+            continue;
+        }
+
+        start = Now();
+        state = &scheduler->tables[table];
+        rounds = options->chunk;
+        if (options->rounds != 0 && options->rounds - state->roundsPlayed < rounds){
+            rounds = options->rounds - state->roundsPlayed;
+        }
+
+        // with --precision the rounds of the chunk are also kept apart
+        if (options->precision > 0){
+            total = state->roundProfit;
+            memset(&state->roundProfit, 0, sizeof(RunningStats));
+        }
+
+        played = PlayGames(options, state, 
+            scheduler->countReports ? &scheduler->countReports[table] : NULL, 
+            worker->results, rounds);
+
+        if (options->precision > 0){
+            chunk = state->roundProfit;
+            MergeStats(&total, &chunk);
+            state->roundProfit = total;
+            if (SchedulerPrecision(worker, &chunk)){
+                __atomic_store_n(&scheduler->stop, 1, __ATOMIC_RELEASE);
+                WakeWorkers(scheduler, true);
+            }
+        }
+
+        EndTask(worker, table, rounds, played);
+        worker->busySeconds += Now() - start;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief         Plays a chunk of rounds of a batch of tables with the
+ *                policy plugin
+ *
+ * @param[in,out] worker  ptr to the worker
+ * @param[in]     table   number of the first table of the batch
+ *
+ * The batch is the given table and as many of the worker's own tasks as
+ * fit, played together by PlayBatch. Each table is then put back or
+ * finished like a task of its own.
+ */
+void PlayBatchTask(Worker * worker, int table){
+    Scheduler * scheduler = worker->scheduler;
+    GameOptions * options = scheduler->options;
+    DecisionBatch * batch = worker->batch;
+    RunningStats chunk = {0};
+    double start = Now();
+
+    batch->numTables = 0;
+    do {
+        BatchTable * slot = &batch->tables[batch->numTables++];
+        Table * state = &scheduler->tables[table];
+
+        slot->table = state;
+        slot->countReport = scheduler->countReports ? &scheduler->countReports[table] : NULL;
+        slot->number = table;
+        slot->rounds = options->chunk;
+        if (options->rounds != 0 && options->rounds - state->roundsPlayed < slot->rounds){
+            slot->rounds = options->rounds - state->roundsPlayed;
+        }
+
+        // with --precision the rounds of the chunk are also kept apart
+        if (options->precision > 0){
+            slot->total = state->roundProfit;
+            memset(&state->roundProfit, 0, sizeof(RunningStats));
+        }
+    } while (batch->numTables < PLUGIN_BATCH_TABLES && PopTask(worker, &table));
+
+    PlayBatch(options, batch, worker->results);
+
+    for (int i = 0; i < batch->numTables; i++){
+        BatchTable * slot = &batch->tables[i];
+
+        if (options->precision > 0){
+            MergeStats(&chunk, &slot->table->roundProfit);
+            MergeStats(&slot->total, &slot->table->roundProfit);
+            slot->table->roundProfit = slot->total;
+        }
+        EndTask(worker, slot->number, slot->rounds, slot->played);
+    }
+    if (options->precision > 0 && SchedulerPrecision(worker, &chunk)){
+        __atomic_store_n(&scheduler->stop, 1, __ATOMIC_RELEASE);
+        WakeWorkers(scheduler, true);
+    }
+    worker->busySeconds += Now() - start;
+}
+
+/**
+ * @brief         Ends the task of a table after a chunk of rounds
+ *
+ * @param[in,out] worker  ptr to the worker that played it
+ * @param[in]     table   number of the table
+ * @param[in]     rounds  rounds the chunk had to play
+ * @param[in]     played  rounds played
+ *
+ * Publishes the snapshot of the table and puts it back in the deque of the
+ * worker, unless it's finished.
+ */
+void EndTask(Worker * worker, int table, int rounds, int played){
+    Scheduler * scheduler = worker->scheduler;
+    Table * state = &scheduler->tables[table];
+
+    if (scheduler->snapshots != NULL){
+        PublishSnapshot(&scheduler->snapshots[table], state, 
+            scheduler->countReports ? &scheduler->countReports[table] : NULL);
+    }
+
+    worker->tasksRun++;
+    worker->roundsPlayed += played;
+
+    // a table is finished when its players are broke or it played enough;
+    // the workers parked leave once the last one is
+    if (played < rounds || state->roundsPlayed == scheduler->options->rounds){
+        if (__atomic_sub_fetch(&scheduler->unfinished, 1, __ATOMIC_RELEASE) == 0){
+            WakeWorkers(scheduler, true);
+        }
+    } else {
+        PushTask(worker, table);
+    }
+}
+
+/**
+ * @brief         Adds the rounds of a chunk to a worker and checks the
+ *                precision of the whole simulation
+ *
+ * @param[in,out] worker  ptr to the worker that played the chunk
+ * @param[in]     chunk   ptr to the statistics of the rounds of the chunk
+ *
+ * @return        true if the house edge of the rounds of every worker is
+ *                known to options->precision
+ *
+ * Only every PRECISION_CHECK_CHUNKS chunks of the worker: it then publishes
+ * its rounds and adds up those the other workers published at their last
+ * check, without taking any lock.
+ */
+bool SchedulerPrecision(Worker * worker, RunningStats * chunk){
+    Scheduler * scheduler = worker->scheduler;
+    RunningStats total = {0}, published;
+
+    MergeStats(&worker->roundProfit, chunk);
+    if (++worker->uncheckedChunks < PRECISION_CHECK_CHUNKS) return false;
+    worker->uncheckedChunks = 0;
+    PublishProfit(worker);
+
+    for (int i = 0; i < scheduler->numWorkers; i++){
+        ReadProfit(&scheduler->workers[i], &published);
+        MergeStats(&total, &published);
+    }
+    return PrecisionReached(&total, scheduler->options);
+}
+
+/**
+ * @brief         Publishes the rounds of a worker for the precision checks
+ *                of the others
+ *
+ * @param[in,out] worker  ptr to the worker, called by its own thread
+ *
+ * The sequence number is odd while the copy is written, like the snapshot of
+ * a table.
+ */
+void PublishProfit(Worker * worker){
+    uint32_t sequence = worker->sequence;
+
+    __atomic_store_n(&worker->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&worker->publishedProfit, &worker->roundProfit, sizeof(RunningStats));
+    __atomic_store_n(&worker->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief      Copies the rounds a worker published
+ *
+ * @param[in]  worker  ptr to the worker
+ * @param[out] copy    ptr to the copy
+ *
+ * Copies again while the worker publishes, so the copy is always whole.
+ */
+void ReadProfit(Worker * worker, RunningStats * copy){
+    uint32_t sequence;
+
+    for (;;){
+        sequence = __atomic_load_n(&worker->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1){
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, &worker->publishedProfit, sizeof(RunningStats));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&worker->sequence, __ATOMIC_RELAXED) == sequence) break;
+    }
+}
+
+/**
+ * @brief         Adds a task to the newest end of a worker deque
+ *
+ * @param[in,out] worker  ptr to the worker
+ * @param[in]     table   number of the table
+ *
+ * Wakes a worker parked, which can steal it.
+ */
+void PushTask(Worker * worker, int table){
+    int capacity = worker->scheduler->options->numTables;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->tasks[(worker->head + worker->count) % capacity] = table;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+    WakeWorkers(worker->scheduler, false);
+}
+
+/**
+ * @brief         Parks a worker that found nothing to steal
+ *
+ * @param[in,out] scheduler  ptr to the scheduler
+ * @param[in]     wakeUps    scheduler->wakeUps read before looking for a task
+ *
+ * Returns as soon as a task was pushed or a table finished since wakeUps was
+ * read, or the simulation is over.
+ */
+void WaitForTasks(Scheduler * scheduler, int wakeUps){
+    pthread_mutex_lock(&scheduler->idleLock);
+    __atomic_add_fetch(&scheduler->idleWorkers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&scheduler->wakeUps, __ATOMIC_SEQ_CST) == wakeUps && 
+            __atomic_load_n(&scheduler->unfinished, __ATOMIC_ACQUIRE) > 0 && 
+            !__atomic_load_n(&scheduler->stop, __ATOMIC_ACQUIRE)){
+        pthread_cond_wait(&scheduler->idle, &scheduler->idleLock);
+    }
+    __atomic_sub_fetch(&scheduler->idleWorkers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&scheduler->idleLock);
+}
+
+/**
+ * @brief         Wakes the workers parked in WaitForTasks
+ *
+ * @param[in,out] scheduler  ptr to the scheduler
+ * @param[in]     all        true wakes every worker parked, false only one
+ *                           for the task just pushed
+ *
+ * Either a parking worker sees the new wakeUps or this sees it parking, so
+ * no wake up is lost; the lock is only taken when some worker is idle.
+ */
+void WakeWorkers(Scheduler * scheduler, bool all){
+    __atomic_add_fetch(&scheduler->wakeUps, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&scheduler->idleWorkers, __ATOMIC_SEQ_CST) > 0){
+        pthread_mutex_lock(&scheduler->idleLock);
+        if (all) pthread_cond_broadcast(&scheduler->idle);
+        else pthread_cond_signal(&scheduler->idle);
+        pthread_mutex_unlock(&scheduler->idleLock);
+    }
+}
+
+/**
+ * @brief         Takes the newest task of a worker deque, by its owner
+ *
+ * @param[in,out] worker  ptr to the worker
+ * @param[out]    table   ptr to the number of the table
+ *
+ * @return        true if a task was taken, false if the deque is empty
+ */
+bool PopTask(Worker * worker, int * table){
+    int capacity = worker->scheduler->options->numTables;
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0){
+        worker->count--;
+        *table = worker->tasks[(worker->head + worker->count) % capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+/**
+ * @brief         Takes the oldest task of a worker deque, by another worker
+ *
+ * @param[in,out] victim  ptr to the worker the task is stolen from
+ * @param[out]    table   ptr to the number of the table
+ *
+ * @return        true if a task was stolen, false if the deque is empty
+ */
+bool StealTask(Worker * victim, int * table){
+    int capacity = victim->scheduler->options->numTables;
+    bool found = false;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->count > 0){
+        *table = victim->tasks[victim->head];
+        victim->head = (victim->head + 1) % capacity;
+        victim->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    return found;
+}
+
+/**
+ * @brief      Reads a monotonic clock
+ *
+ * @return     the current time in seconds
+ */
+double Now(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                             SHARD FUNCTIONS                              *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Simulates many tables on several processes
+ *
+ * @param[in]  options  ptr to the game options
+ *
+ * @return     EXIT_SUCCESS
+ *
+ * Forks options->shards shard processes. Each one simulates its share of
+ * the tables with RunSimulation, on options->threads threads of its own. A
+ * table draws from the random stream of its number, so the shards play
+ * disjoint streams and, together, exactly the games of a single process.
+ *
+ * Every shard is pinned to its part of the CPUs, grouped by NUMA node, and
+ * keeps its memory on the node it runs on. The shards write their results
+ * to a POSIX shared memory segment, one ShardResult each. Once they have
+ * exited, this process adds the results up in place, and prints and logs
+ * them like RunSimulation does.
+ */
+int RunShards(GameOptions * options){
+    char name[STRING_SIZE];
+    size_t size = options->shards * sizeof(ShardResult);
+    ShardResult * shards;
+    int playerStats[MAX_PLAYERS][STATS] = {{0}};
+    RunningStats seatProfit[MAX_PLAYERS] = {{0}}, roundProfit = {0};
+    CountReport totalReport;
+    PerfCounters perfCounters = {{0}};
+    pid_t pids[MAX_SHARDS];
+    long long playedRounds = 0;
+    double start, seconds;
+    int fd, status;
+    bool failed = false;
+
+    snprintf(name, sizeof(name), "/blackjack-shards-%ld", (long) getpid());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0){
+        printf("Couldn't create the shared memory %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, size) != 0 || (shards = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+            MAP_SHARED, fd, 0)) == MAP_FAILED){
+        printf("Couldn't map %lu bytes of shared memory: %s\n", (unsigned long) size, 
+            strerror(errno));
+        shm_unlink(name);
+        exit(EXIT_FAILURE);
+    }
+    // the shards inherit the mapping, so the name is removed at once and
+    // nothing is left behind if a process dies
+    shm_unlink(name);
+    close(fd);
+
+    for (int i = 0; i < options->shards; i++){
+        shards[i].firstTable = (long long) options->numTables * i / options->shards;
+        shards[i].numTables = (long long) options->numTables * (i + 1) / options->shards 
+            - shards[i].firstTable;
+    }
+
+    // the counters are inherited by the shards and their threads
+    if (options->perf) PerfOpen(&perfCounters);
+    PerfStart(&perfCounters);
+    start = Now();
+
+    fflush(stdout);
+    for (int i = 0; i < options->shards; i++){
+        pids[i] = fork();
+        if (pids[i] < 0){
+            printf("Couldn't start shard %d: %s\n", i, strerror(errno));
+            for (int j = 0; j < i; j++) kill(pids[j], SIGKILL);
+            exit(EXIT_FAILURE);
+        }
+        if (pids[i] == 0){
+            // pinned before the shard allocates its tables, which are then
+            // placed on its node
+            PinShard(&shards[i], i, options->shards);
+            RunSimulation(options, NULL, &shards[i]);
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    for (int i = 0; i < options->shards; i++){
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || 
+                WEXITSTATUS(status) != EXIT_SUCCESS || 
+                !__atomic_load_n(&shards[i].done, __ATOMIC_ACQUIRE)){
+            printf("Shard %d failed\n", i);
+            failed = true;
+        }
+    }
+    seconds = Now() - start;
+    PerfStop(&perfCounters);
+    if (failed) exit(EXIT_FAILURE);
+
+    // add up the results of every shard, straight from the shared memory
+    memset(&totalReport, 0, sizeof(totalReport));
+    if (options->countSystem != COUNT_NONE){
+        ResetCount(&totalReport.counter, &countSystems[options->countSystem], 
+            options->numOfDecks);
+    }
+    for (int i = 0; i < options->shards; i++){
+        ShardResult * shard = &shards[i];
+
+        playedRounds += shard->roundsPlayed;
+        for (int j = 0; j < options->seats; j++){
+            for (int k = 0; k < STATS; k++){
+                playerStats[j][k] += shard->playerStats[j][k];
+            }
+            MergeStats(&seatProfit[j], &shard->seatProfit[j]);
+        }
+        MergeStats(&roundProfit, &shard->roundProfit);
+        for (int j = 0; j < COUNT_BUCKETS; j++){
+            totalReport.hands[j] += shard->countReport.hands[j];
+            totalReport.profit[j] += shard->countReport.profit[j];
+            totalReport.wins[j] += shard->countReport.wins[j];
+            totalReport.losses[j] += shard->countReport.losses[j];
+        }
+    }
+
+    printf("%d tables, %lld rounds in %.3f s (%.0f rounds/s) on %d shards of %d threads\n", 
+        options->numTables, playedRounds, seconds, playedRounds / seconds, 
+        options->shards, options->threads);
+    PrintPerfCounters(&perfCounters, "round", playedRounds);
+    PerfClose(&perfCounters);
+    for (int i = 0; i < options->shards; i++){
+        ShardResult * shard = &shards[i];
+
+        printf("Shard %d: tables %d to %d, %lld rounds in %.3f s, ", i, 
+            shard->firstTable, shard->firstTable + shard->numTables - 1, 
+            shard->roundsPlayed, shard->seconds);
+        if (shard->firstCpu < 0) printf("not pinned\n");
+        else printf("%d CPUs from CPU %d (node %d)\n", shard->numCpus, shard->firstCpu, 
+            shard->node);
+    }
+
+    PrintProfitStats(seatProfit, &roundProfit, options->seats);
+    LogStats(playerStats, playerNames, options->seats);
+    if (options->countSystem != COUNT_NONE) LogCountReport(&totalReport, options->betMoney);
+
+    munmap(shards, size);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief         Pins the calling shard process to its CPUs and keeps its
+ *                memory on their NUMA node
+ *
+ * @param[in,out] shard      ptr to the results of the shard, its CPUs are set
+ * @param[in]     index      number of the shard
+ * @param[in]     numShards  number of shards
+ *
+ * The CPUs the process may run on are listed node after node and split in
+ * numShards contiguous parts, so shards only share a node when there are
+ * more shards than nodes, and only share CPUs when there are more shards
+ * than CPUs. The threads started afterwards keep the affinity, and the
+ * local memory policy places the pages each one touches first on its node.
+ * A process that can't be pinned (a restricted container, a kernel without
+ * NUMA) runs as it is.
+ */
+void PinShard(ShardResult * shard, int index, int numShards){
+    unsigned long allowed[CPU_MASK_WORDS] = {0}, mask[CPU_MASK_WORDS] = {0};
+    int cpus[MAX_CPUS], nodes[MAX_CPUS];
+    int numCpus = 0, first, count;
+
+    shard->firstCpu = -1;
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0) return;
+
+    for (int node = 0; node < MAX_NODES; node++){
+        int found = ReadNodeCpus(node, allowed, cpus + numCpus);
+
+        for (int i = 0; i < found; i++) nodes[numCpus + i] = node;
+        if (found > 0) numCpus += found;
+    }
+    // without NUMA information every CPU is on node 0
+    if (numCpus == 0){
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++){
+            if (allowed[cpu / CPU_WORD_BITS] & 1ul << (cpu % CPU_WORD_BITS)){
+                cpus[numCpus] = cpu;
+                nodes[numCpus++] = 0;
+            }
+        }
+    }
+    if (numCpus == 0) return;
+
+    if (numCpus >= numShards){
+        first = (long long) numCpus * index / numShards;
+        count = (long long) numCpus * (index + 1) / numShards - first;
+    } else {
+        first = index % numCpus;
+        count = 1;
+    }
+    for (int i = first; i < first + count; i++){
+        mask[cpus[i] / CPU_WORD_BITS] |= 1ul << (cpus[i] % CPU_WORD_BITS);
+    }
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) != 0) return;
+
+    shard->firstCpu = cpus[first];
+    shard->numCpus = count;
+    shard->node = nodes[first];
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+}
+
+/**
+ * @brief      Lists the CPUs of a NUMA node the process may run on
+ *
+ * @param[in]  node     number of the node
+ * @param[in]  allowed  ptr to the mask of the CPUs allowed
+ * @param[out] cpus     ptr to array with the CPUs found
+ *
+ * @return     number of CPUs found, -1 if the node doesn't exist
+ *
+ * The CPUs of a node are read from sysfs, as a list like "0-3,8-11".
+ */
+int ReadNodeCpus(int node, const unsigned long allowed[], int cpus[]){
+    char path[STRING_SIZE], list[4 * STRING_SIZE];
+    char * next = list;
+    FILE * file;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    file = fopen(path, "r");
+    if (file == NULL) return -1;
+    if (fgets(list, sizeof(list), file) == NULL) list[0] = '\0';
+    fclose(file);
+
+    while (isdigit((unsigned char) *next)){
+        long low = strtol(next, &next, 10), high = low;
+
+        if (*next == '-') high = strtol(next + 1, &next, 10);
+        for (long cpu = low; cpu <= high && cpu < MAX_CPUS; cpu++){
+            if (allowed[cpu / CPU_WORD_BITS] & 1ul << (cpu % CPU_WORD_BITS)){
+                cpus[found++] = cpu;
+            }
+        }
+        if (*next == ',') next++;
+    }
+    return found;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                        HARDWARE COUNTER FUNCTIONS                        *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Opens the hardware counters of the calling thread
+ *
+ * @param[out]    counters  ptr to the counters
+ *
+ * Each counter is opened on its own and disabled until PerfStart, counting
+ * user space only, as perf_event_paranoid allows it up to 2. Threads started
+ * afterwards inherit the counters and their counts are added up when they
+ * are read. When none can be opened (no permission, no processor counters
+ * in a virtual machine, not Linux) the reason is printed once and every
+ * other counter function does nothing.
+ */
+void PerfOpen(PerfCounters * counters){
+    const uint32_t types[NUM_PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, 
+        PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    const uint64_t configs[NUM_PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, 
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, 
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | 
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), 
+        PERF_COUNT_HW_CACHE_MISSES};
+    struct perf_event_attr attr;
+    int error = 0;
+
+    counters->enabled = false;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // the times tell how long a counter shared the processor with others
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        counters->values[i] = -1;
+        if (counters->fds[i] >= 0) counters->enabled = true;
+        else error = errno;
+    }
+
+    if (!counters->enabled){
+        printf("Hardware counters unavailable: %s%s, printing the timings only\n", 
+            strerror(error), error == EACCES || error == EPERM ? 
+            " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+    }
+}
+
+/**
+ * @brief         Resets the hardware counters and starts counting
+ *
+ * @param[in,out] counters  ptr to the counters
+ */
+void PerfStart(PerfCounters * counters){
+    if (!counters->enabled) return;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++){
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/**
+ * @brief         Stops the hardware counters and reads them
+ *
+ * @param[in,out] counters  ptr to the counters
+ *
+ * When the processor has fewer counters than were opened the kernel takes
+ * turns with them, so each count is scaled up by the time it was enabled
+ * over the time it was actually counting. A counter that never ran is left
+ * at -1.
+ */
+void PerfStop(PerfCounters * counters){
+    uint64_t data[3];         // count, time enabled and time running
+
+    if (!counters->enabled) return;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++){
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        counters->values[i] = -1;
+        if (read(counters->fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0){
+            counters->values[i] = (double) data[0] * data[1] / data[2];
+        }
+    }
+}
+
+/**
+ * @brief         Closes the hardware counters
+ *
+ * @param[in,out] counters  ptr to the counters
+ */
+void PerfClose(PerfCounters * counters){
+    if (!counters->enabled) return;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++){
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+    counters->enabled = false;
+}
+
+/**
+ * @brief         Prints the hardware counters per operation
+ *
+ * @param[in]     counters    ptr to the counters, read by PerfStop
+ * @param[in]     operation   name of an operation ("round", "frame")
+ * @param[in]     operations  operations done while counting
+ *
+ * Counters that couldn't be read are printed as "-". The instructions per
+ * cycle follow when both were counted.
+ */
+void PrintPerfCounters(PerfCounters * counters, const char * operation, double operations){
+    double * values = counters->values;
+
+    if (!counters->enabled || operations <= 0) return;
+    printf("Per %s:", operation);
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++){
+        if (values[i] < 0) printf(" %s -", perfNames[i]);
+        else printf(" %s %.1f", perfNames[i], values[i] / operations);
+    }
+    if (values[PERF_CYCLES] > 0 && values[PERF_INSTRUCTIONS] >= 0){
+        printf(", %.2f instructions/cycle", values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+    }
+    printf("\n");
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                       MEMORY ACCOUNTING FUNCTIONS                        *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief      Prints the bytes held by the images, textures, font and game
+ *
+ * @param[in]  moment  when the report is taken ("after the first frame")
+ * @param[in]  images  ptr to the images of the window
+ * @param[in]  arena   ptr to the arena of the game state
+ *
+ * Texture bytes are what the renderer needs for their pixels, wherever it
+ * keeps them. SDL_ttf doesn't tell the memory of a font, so the size of its
+ * file is printed instead: the whole file is read when it is opened.
+ */
+void PrintMemoryReport(const char * moment, Images * images, const Arena * arena){
+    size_t surfaceBytes = 0, textureBytes = 0;
+    int surfaces = 0, textures = 0;
+    struct stat font;
+    Uint32 format;
+    int w, h;
+
+    for (int i = 0; i < NUM_IMAGES; i++){
+        if (images->surfaces[i] != NULL){
+            surfaceBytes += (size_t) images->surfaces[i]->pitch * images->surfaces[i]->h;
+            surfaces++;
+        }
+        if (images->textures[i] != NULL && 
+            SDL_QueryTexture(images->textures[i], &format, NULL, &w, &h) == 0){
+            textureBytes += (size_t) w * h * SDL_BYTESPERPIXEL(format);
+            textures++;
+        }
+    }
+    printf("Memory %s:\n", moment);
+    printf("  surfaces %10lu bytes in %d images\n", (unsigned long) surfaceBytes, surfaces);
+    printf("  textures %10lu bytes in %d images\n", (unsigned long) textureBytes, textures);
+    if (stat(FONT_FILE, &font) == 0){
+        printf("  font     %10lu bytes of %s\n", (unsigned long) font.st_size, FONT_FILE);
+    }
+    printf("  engine   %10lu bytes used of %lu in the arena\n", 
+        (unsigned long) arena->used, (unsigned long) arena->size);
+    printf("  resident %10lu bytes in the process\n", (unsigned long) ResidentBytes());
+}
+
+/**
+ * @brief      Reads the memory of the process kept in RAM
+ *
+ * @return     resident bytes, 0 if /proc can't be read
+ */
+size_t ResidentBytes(void){
+    FILE * file = fopen("/proc/self/statm", "r");
+    unsigned long size, resident = 0;
+
+    if (file == NULL) return 0;
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(file);
+    return (size_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                           CHECKPOINT FUNCTIONS                           *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Starts the checkpoint thread
+ *
+ * @param[out]    checkpointer  ptr to the checkpoint thread
+ * @param[in]     options       ptr to the game options (checkpoint file and
+ *                              period)
+ * @param[in]     snapshots     ptr to the snapshots published by the game
+ * @param[in]     numTables     number of snapshots
+ *
+ * The blob written at every checkpoint is allocated once here. The snapshots
+ * must be published at least once before the thread starts.
+ */
+void StartCheckpointer(Checkpointer * checkpointer, GameOptions * options, 
+        TableSnapshot * snapshots, int numTables){
+    memset(checkpointer, 0, sizeof(Checkpointer));
+    checkpointer->options = options;
+    checkpointer->snapshots = snapshots;
+    checkpointer->numTables = numTables;
+    checkpointer->blobSize = sizeof(CheckpointHeader) + numTables * sizeof(TableSnapshot);
+
+    ArenaInit(&checkpointer->arena, checkpointer->blobSize + ARENA_ALIGN);
+    checkpointer->blob = ArenaAlloc(&checkpointer->arena, checkpointer->blobSize);
+
+    pthread_mutex_init(&checkpointer->lock, NULL);
+    pthread_cond_init(&checkpointer->wake, NULL);
+    if (pthread_create(&checkpointer->thread, NULL, CheckpointWorker, checkpointer) != 0){
+        printf("Couldn't start the checkpoint thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief         Stops the checkpoint thread and writes the last checkpoint
+ *
+ * @param[in,out] checkpointer  ptr to the checkpoint thread
+ *
+ * The game must have published its final snapshots. Prints how many
+ * checkpoints were written and how long they took.
+ */
+void StopCheckpointer(Checkpointer * checkpointer){
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpointer->quit = true;
+    pthread_cond_signal(&checkpointer->wake);
+    pthread_mutex_unlock(&checkpointer->lock);
+    pthread_join(checkpointer->thread, NULL);
+
+    WriteCheckpoint(checkpointer);
+    printf("%lld checkpoints of %lu bytes to %s, %.3f ms each\n", 
+        checkpointer->checkpoints, (unsigned long) checkpointer->blobSize, 
+        checkpointer->options->checkpointPath, checkpointer->checkpoints > 0 ? 
+            1000.0 * checkpointer->writeSeconds / checkpointer->checkpoints : 0.0);
+
+    pthread_cond_destroy(&checkpointer->wake);
+    pthread_mutex_destroy(&checkpointer->lock);
+    ArenaFree(&checkpointer->arena);
+}
+
+/**
+ * @brief      Checkpoint thread
+ *
+ * @param[in]  arg   ptr to the checkpoint thread
+ *
+ * @return     NULL
+ *
+ * Writes a checkpoint every options->checkpointSeconds seconds until it is
+ * stopped. It only reads the published snapshots, so the game never waits
+ * for it.
+ */
+void * CheckpointWorker(void * arg){
+    Checkpointer * checkpointer = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&checkpointer->lock);
+    while (!checkpointer->quit){
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpointer->options->checkpointSeconds;
+        while (!checkpointer->quit && pthread_cond_timedwait(&checkpointer->wake, 
+                &checkpointer->lock, &deadline) != ETIMEDOUT);
+        if (checkpointer->quit) break;
+
+        pthread_mutex_unlock(&checkpointer->lock);
+        WriteCheckpoint(checkpointer);
+        pthread_mutex_lock(&checkpointer->lock);
+    }
+    pthread_mutex_unlock(&checkpointer->lock);
+    return NULL;
+}
+
+/**
+ * @brief         Writes a checkpoint file
+ *
+ * @param[in,out] checkpointer  ptr to the checkpoint thread
+ *
+ * Copies the header and the last snapshot of every table into the blob and
+ * writes it with one write to a temporary file, which is then renamed over
+ * the checkpoint file. A checkpoint that can't be written is reported and
+ * skipped, keeping the previous one.
+ */
+void WriteCheckpoint(Checkpointer * checkpointer){
+    TRACE_SCOPE("WriteCheckpoint");
+    GameOptions * options = checkpointer->options;
+    CheckpointHeader * header = (CheckpointHeader *) checkpointer->blob;
+    TableSnapshot * copies = (TableSnapshot *) (header + 1);
+    char tmpPath[STRING_SIZE + 4];
+    double start = Now();
+    ssize_t written;
+    int fd;
+
+    memset(header, 0, sizeof(CheckpointHeader));
+    memcpy(header->magic, "BJCHKPNT", sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->snapshotSize = sizeof(TableSnapshot);
+    header->numTables = checkpointer->numTables;
+    header->numOfDecks = options->numOfDecks;
+    header->startPlayerMoney = options->startPlayerMoney;
+    header->betMoney = options->betMoney;
+    header->seed = options->seed;
+    header->policy = options->policy;
+    header->countSystem = options->countSystem;
+    header->dealerRule = options->dealerRule;
+    header->payoutNum = options->payoutNum;
+    header->payoutDen = options->payoutDen;
+    header->allowDouble = options->allowDouble;
+    header->seats = options->seats;
+
+    for (int i = 0; i < checkpointer->numTables; i++){
+        ReadSnapshot(&copies[i], &checkpointer->snapshots[i]);
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", options->checkpointPath);
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        printf("Couldn't open the checkpoint file %s: %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    written = write(fd, checkpointer->blob, checkpointer->blobSize);
+    if (written != (ssize_t) checkpointer->blobSize){
+        printf("Couldn't write the checkpoint file %s: %s\n", tmpPath, 
+            written == -1 ? strerror(errno) : "short write");
+        close(fd);
+        unlink(tmpPath);
+        return;
+    }
+    close(fd);
+    if (rename(tmpPath, options->checkpointPath) == -1){
+        printf("Couldn't replace the checkpoint file %s: %s\n", 
+            options->checkpointPath, strerror(errno));
+        return;
+    }
+
+    checkpointer->checkpoints++;
+    checkpointer->writeSeconds += Now() - start;
+}
+
+/**
+ * @brief         Publishes the state of a table for the checkpoint thread
+ *
+ * @param[out]    snapshot     ptr to the snapshot of the table
+ * @param[in]     table        ptr to the table
+ * @param[in]     countReport  ptr to the count report, NULL if not counting
+ *
+ * Called by the only thread playing the table, between two rounds. The
+ * sequence number is odd while the copy is written, so a reader knows it
+ * has to copy it again.
+ */
+void PublishSnapshot(TableSnapshot * snapshot, Table * table, CountReport * countReport){
+    uint32_t sequence = snapshot->sequence;
+
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&snapshot->table, table, sizeof(Table));
+    if (countReport != NULL){
+        memcpy(&snapshot->countReport, countReport, sizeof(CountReport));
+    }
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief      Copies a published snapshot
+ *
+ * @param[out] copy      ptr to the copy
+ * @param[in]  snapshot  ptr to the published snapshot
+ *
+ * Copies again while the table publishes a new snapshot, so the copy is
+ * always a whole snapshot. Its sequence number is cleared.
+ */
+void ReadSnapshot(TableSnapshot * copy, TableSnapshot * snapshot){
+    uint32_t sequence;
+
+    for (;;){
+        sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1){
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, snapshot, sizeof(TableSnapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED) == sequence) break;
+    }
+    copy->sequence = 0;
+}
+
+/**
+ * @brief         Maps a checkpoint file to resume its game
+ *
+ * @param[in,out] options  ptr to the game options (path of the checkpoint)
+ *
+ * @return        ptr to the header of the mapped checkpoint, followed by the
+ *                snapshot of every table
+ *
+ * The options that make the game (decks, money, bet, seed, policy, count,
+ * rules and seats) and the number of tables are taken from the checkpoint. The rounds,
+ * threads and chunks still come from the command line, so a game can be
+ * resumed with more rounds. Exits the program if the file is not a
+ * checkpoint of this version and build, or if its options are out of the
+ * range of the command line options.
+ */
+const CheckpointHeader * LoadCheckpoint(GameOptions * options){
+    struct stat info;
+    const CheckpointHeader * header;
+    int fd;
+
+    fd = open(options->resumePath, O_RDONLY);
+    if (fd == -1 || fstat(fd, &info) == -1){
+        printf("Couldn't open the checkpoint file %s: %s\n", options->resumePath, 
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t) info.st_size < sizeof(CheckpointHeader)){
+        printf("%s is not a checkpoint file\n", options->resumePath);
+        exit(EXIT_FAILURE);
+    }
+
+    header = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED){
+        printf("Couldn't map the checkpoint file: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (memcmp(header->magic, "BJCHKPNT", sizeof(header->magic)) != 0 || 
+            header->version != CHECKPOINT_VERSION || 
+            header->snapshotSize != sizeof(TableSnapshot) || 
+            sizeof(CheckpointHeader) + header->numTables * sizeof(TableSnapshot) 
+                != (size_t) info.st_size){
+        printf("%s is not a checkpoint file of this version and build\n", 
+            options->resumePath);
+        exit(EXIT_FAILURE);
+    }
+    // the same limits as the command line options
+    if (header->numTables < 1 || header->numTables > MAX_SERVER_TABLES || 
+            header->numOfDecks < 1 || header->numOfDecks > MAX_NUM_DECKS || 
+            header->startPlayerMoney < 1 || header->betMoney < 1 || 
+            header->policy < POLICY_HUMAN || header->policy > POLICY_PLUGIN || 
+            header->countSystem < COUNT_NONE || header->countSystem >= NUM_COUNT_SYSTEMS || 
+            (header->dealerRule != DEALER_S17 && header->dealerRule != DEALER_H17) || 
+            header->payoutNum < 1 || header->payoutDen < 1 || 
+            header->payoutNum > (long long) MAX_PAYOUT * header->payoutDen || 
+            header->allowDouble < 0 || header->allowDouble > 1 || 
+            header->seats < 1 || header->seats > MAX_PLAYERS){
+        printf("%s has game options out of range\n", options->resumePath);
+        exit(EXIT_FAILURE);
+    }
+    if (header->numTables > 1 && (options->renderMode != RENDER_NONE || options->threads == 0)){
+        printf("%s has %u tables, resume it with --render none and --threads\n", 
+            options->resumePath, header->numTables);
+        exit(EXIT_FAILURE);
+    }
+
+    options->numTables = header->numTables;
+    options->numOfDecks = header->numOfDecks;
+    options->startPlayerMoney = header->startPlayerMoney;
+    options->betMoney = header->betMoney;
+    options->seed = header->seed;
+    options->policy = header->policy;
+    options->countSystem = header->countSystem;
+    options->dealerRule = header->dealerRule;
+    options->payoutNum = header->payoutNum;
+    options->payoutDen = header->payoutDen;
+    options->allowDouble = header->allowDouble;
+    options->seats = header->seats;
+
+    if (options->renderMode != RENDER_GUI && options->policy == POLICY_HUMAN){
+        printf("%s was played by a human, resume it in the window\n", options->resumePath);
+        exit(EXIT_FAILURE);
+    }
+    if (options->seats != WINDOW_SEATS && options->renderMode != RENDER_NONE){
+        printf("%s has %d players at each table, resume it with --render none\n", 
+            options->resumePath, options->seats);
+        exit(EXIT_FAILURE);
+    }
+    return header;
+}
+
+/**
+ * @brief      Unmaps a checkpoint file
+ *
+ * @param[in]  header  ptr to the header of the mapped checkpoint
+ */
+void UnloadCheckpoint(const CheckpointHeader * header){
+    munmap((void *) header, sizeof(CheckpointHeader) 
+        + header->numTables * sizeof(TableSnapshot));
+}
+
+/**
+ * @brief      Finds the snapshots of a mapped checkpoint
+ *
+ * @param[in]  header  ptr to the header of the mapped checkpoint
+ *
+ * @return     ptr to the snapshot of the first table
+ */
+const TableSnapshot * CheckpointTables(const CheckpointHeader * header){
+    return (const TableSnapshot *) (header + 1);
+}
+
+/**
+ * @brief      Restores a table from its snapshot
+ *
+ * @param[out] table     ptr to the table
+ * @param[in]  snapshot  ptr to the snapshot of the table
+ * @param[in]  options   ptr to the game options
+ *
+ * The pointers of the table are set again: its house rules come from the
+ * options and it has no shoe pool yet. The next shoe is the one the table
+ * would have dealt, so the game goes on with the same cards.
+ */
+void RestoreTable(Table * table, const TableSnapshot * snapshot, GameOptions * options){
+    memcpy(table, &snapshot->table, sizeof(Table));
+    SetRules(&table->rules, options);
+    table->shoe.pool = NULL;
+}
+
+/**
+ * @brief      Restores a count report from the snapshot of its table
+ *
+ * @param[out] countReport  ptr to the count report
+ * @param[in]  snapshot     ptr to the snapshot of the table
+ * @param[in]  options      ptr to the game options (counting system)
+ */
+void RestoreCountReport(CountReport * countReport, const TableSnapshot * snapshot, 
+        GameOptions * options){
+    memcpy(countReport, &snapshot->countReport, sizeof(CountReport));
+    countReport->counter.system = &countSystems[options->countSystem];
+}
+
+/**
+ * @brief      Checks if a table has nothing left to play
+ *
+ * @param[in]  table    ptr to the table
+ * @param[in]  options  ptr to the game options (rounds to play)
+ *
+ * @return     true if its players are broke or it played options->rounds
+ *             rounds, false otherwise
+ */
+bool TableFinished(Table * table, GameOptions * options){
+    return AllPlayersBroke(&table->seats) || 
+        (options->rounds != 0 && table->roundsPlayed >= options->rounds);
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                             SERVER FUNCTIONS                             *
+ *                                                                          *
+ ****************************************************************************/
+
+// set by the signal handler to stop the server loop
+volatile sig_atomic_t serverQuit = 0;
+
+/**
+ * @brief      Hosts blackjack tables for clients of a UNIX domain socket
+ *
+ * @param[in]  options  ptr to the game options
+ *
+ * @return     EXIT_SUCCESS when stopped by SIGINT or SIGTERM
+ *
+ * Every connection gets its own table, reset to the starting money. Clients
+ * send ServerRequest structs and get a ServerReply for each one, in order.
+ *
+ * A single thread serves every connection with a non-blocking epoll loop:
+ * the engine functions take microseconds, so the loop is bound by the socket
+ * system calls, not by the game. All the sessions and tables are taken from
+ * one arena at startup, so serving a client never allocates memory.
+ */
+int RunServer(GameOptions * options){
+    Arena arena;
+    Server server;
+    struct epoll_event event, events[SERVER_EVENTS];
+    struct sigaction action;
+    int listenFd, numEvents;
+
+    ArenaInit(&arena, options->numTables * (sizeof(Session) + sizeof(Table) + 
+        sizeof(int) + ARENA_ALIGN) + 3 * ARENA_ALIGN);
+    memset(&server, 0, sizeof(server));
+    server.maxSessions = options->numTables;
+    server.sessions = ArenaAlloc(&arena, server.maxSessions * sizeof(Session));
+    server.freeSessions = ArenaAlloc(&arena, server.maxSessions * sizeof(int));
+    for (int i = 0; i < server.maxSessions; i++){
+        server.sessions[i].fd = -1;
+        server.sessions[i].table = NewTable(&arena, options, i);
+        server.freeSessions[i] = server.maxSessions - 1 - i;
+    }
+    server.numFree = server.maxSessions;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = StopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // clients that leave are seen as write errors
+
+    listenFd = OpenServerSocket(options->socketPath);
+    server.epollFd = epoll_create1(0);
+    if (server.epollFd == -1){
+        printf("Couldn't create the epoll instance: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the listening socket has no session
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+    printf("Serving up to %d tables on %s\n", server.maxSessions, options->socketPath);
+
+    while (!serverQuit){
+        numEvents = epoll_wait(server.epollFd, events, SERVER_EVENTS, -1);
+        if (numEvents == -1){
+            if (errno == EINTR) continue;
+            printf("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < numEvents; i++){
+            Session * session = events[i].data.ptr;
+
+            if (session == NULL){
+                AcceptClients(&server, listenFd, options);
+
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP) && 
+                    !(events[i].events & EPOLLIN)){
+                CloseSession(&server, session);
+
+            } else if (events[i].events & EPOLLOUT && (!FlushSession(&server, session) || 
+                    !AnswerRequests(&server, session, options))){
+                CloseSession(&server, session);
+
+            } else if (events[i].events & EPOLLIN && 
+                    !ServeSession(&server, session, options)){
+                CloseSession(&server, session);
+            }
+        }
+    }
+
+    printf("Server stopped: %lld tables hosted, %lld requests served\n", 
+        server.servedTables, server.servedRequests);
+    for (int i = 0; i < server.maxSessions; i++){
+        if (server.sessions[i].fd != -1) close(server.sessions[i].fd);
+    }
+    close(server.epollFd);
+    close(listenFd);
+    unlink(options->socketPath);
+    ArenaFree(&arena);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief      Signal handler that stops the server loop
+ *
+ * @param[in]  signum  signal number (unused)
+ */
+void StopServer(int signum){
+    (void) signum;
+    serverQuit = 1;
+}
+
+/**
+ * @brief      Creates the listening UNIX domain socket of the server
+ *
+ * @param[in]  path  path of the socket file, replaced if it exists
+ *
+ * @return     the non-blocking listening socket
+ */
+int OpenServerSocket(const char * path){
+    struct sockaddr_un address;
+    int listenFd;
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd == -1){
+        printf("Couldn't create the server socket: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    if (bind(listenFd, (struct sockaddr *) &address, sizeof(address)) == -1 || 
+            listen(listenFd, SOMAXCONN) == -1){
+        printf("Couldn't listen on %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    SetNonBlocking(listenFd);
+    return listenFd;
+}
+
+/**
+ * @brief      Puts a file descriptor in non-blocking mode
+ *
+ * @param[in]  fd    file descriptor
+ */
+void SetNonBlocking(int fd){
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/**
+ * @brief         Accepts every pending connection
+ *
+ * @param[in,out] server    ptr to the server state
+ * @param[in]     listenFd  listening socket
+ * @param[in]     options   ptr to the game options
+ *
+ * Each connection takes a free session and its table is reset to the
+ * starting state. Connections beyond the maximum number of tables are closed
+ * right away.
+ */
+void AcceptClients(Server * server, int listenFd, GameOptions * options){
+    struct epoll_event event;
+    Session * session;
+    int fd;
+
+    while ((fd = accept(listenFd, NULL, NULL)) != -1){
+        if (server->numFree == 0){
+            close(fd); // no table left
+            continue;
+        }
+
+        session = &server->sessions[server->freeSessions[--server->numFree]];
+        session->fd = fd;
+        session->gameHasEnded = true;
+        session->houseHasPlayed = true;
+        session->inUsed = session->outUsed = 0;
+        ResetTable(session->table, options, (int) server->servedTables);
+        SetNonBlocking(fd);
+
+        event.events = EPOLLIN;
+        event.data.ptr = session;
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event);
+        server->servedTables++;
+    }
+}
+
+/**
+ * @brief         Closes a connection and frees its session
+ *
+ * @param[in,out] server   ptr to the server state
+ * @param[in,out] session  ptr to the session
+ */
+void CloseSession(Server * server, Session * session){
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, session->fd, NULL);
+    close(session->fd);
+    session->fd = -1;
+    server->freeSessions[server->numFree++] = (int) (session - server->sessions);
+}
+
+/**
+ * @brief         Reads the requests of a connection and answers them
+ *
+ * @param[in,out] server   ptr to the server state
+ * @param[in,out] session  ptr to the session
+ * @param[in]     options  ptr to the game options
+ *
+ * @return        false if the connection must be closed, true otherwise
+ *
+ * The requests read are answered with AnswerRequests.
+ */
+bool ServeSession(Server * server, Session * session, GameOptions * options){
+    ssize_t bytes;
+
+    bytes = read(session->fd, session->in + session->inUsed, 
+        SERVER_BUFFER - session->inUsed);
+    if (bytes == 0) return false; // client closed the connection
+    if (bytes == -1) return errno == EAGAIN || errno == EINTR;
+    session->inUsed += bytes;
+
+    return AnswerRequests(server, session, options);
+}
+
+/**
+ * @brief         Answers the complete requests read from a connection
+ *
+ * @param[in,out] server   ptr to the server state
+ * @param[in,out] session  ptr to the session
+ * @param[in]     options  ptr to the game options
+ *
+ * @return        false if the connection must be closed, true otherwise
+ *
+ * Replies are queued in the session output buffer and sent once it is full
+ * or no complete request is left. While they can all be sent, the requests
+ * left are answered in turn, so pipelined requests don't wait for more bytes
+ * from the client. If the client doesn't read its replies, the session stops
+ * reading requests and waits for EPOLLOUT, after which it is called again.
+ */
+bool AnswerRequests(Server * server, Session * session, GameOptions * options){
+    ServerRequest request;
+    ServerReply reply;
+
+    do {
+        int pos = 0;
+
+        while (session->inUsed - pos >= (int) sizeof(ServerRequest) && 
+                session->outUsed + (int) sizeof(ServerReply) <= SERVER_BUFFER){
+            memcpy(&request, session->in + pos, sizeof(request));
+            pos += sizeof(request);
+
+            ServerPlay(session, &request, options, &reply);
+            memcpy(session->out + session->outUsed, &reply, sizeof(reply));
+            session->outUsed += sizeof(reply);
+            server->servedRequests++;
+        }
+
+        // keep the incomplete request for the next read
+        memmove(session->in, session->in + pos, session->inUsed - pos);
+        session->inUsed -= pos;
+
+        if (!FlushSession(server, session)) return false;
+    } while (session->outUsed == 0 && session->inUsed >= (int) sizeof(ServerRequest));
+
+    return true;
+}
+
+/**
+ * @brief         Sends the queued replies of a connection
+ *
+ * @param[in,out] server   ptr to the server state
+ * @param[in,out] session  ptr to the session
+ *
+ * @return        false if the connection must be closed, true otherwise
+ *
+ * Waits for EPOLLOUT instead of EPOLLIN while replies are left to send.
+ */
+bool FlushSession(Server * server, Session * session){
+    struct epoll_event event;
+    ssize_t bytes = 0;
+    bool wasBlocked = session->outUsed + (int) sizeof(ServerReply) > SERVER_BUFFER;
+
+    if (session->outUsed > 0){
+        bytes = write(session->fd, session->out, session->outUsed);
+        if (bytes == -1){
+            if (errno != EAGAIN && errno != EINTR) return false;
+            bytes = 0;
+        }
+        memmove(session->out, session->out + bytes, session->outUsed - bytes);
+        session->outUsed -= bytes;
+    }
+
+    event.data.ptr = session;
+    if (session->outUsed > 0){
+        event.events = EPOLLOUT;
+        epoll_ctl(server->epollFd, EPOLL_CTL_MOD, session->fd, &event);
+    } else if (wasBlocked || bytes > 0){
+        event.events = EPOLLIN;
+        epoll_ctl(server->epollFd, EPOLL_CTL_MOD, session->fd, &event);
+    }
+    return true;
+}
+
+/**
+ * @brief         Plays one request on the table of a session
+ *
+ * @param[in,out] session  ptr to the session
+ * @param[in]     request  ptr to the request
+ * @param[in]     options  ptr to the game options
+ * @param[out]    reply    ptr to the reply
+ *
+ * Follows the same rules as the keyboard: a new game only starts once the
+ * house played, and hits and stands only while a player is playing. The
+ * house plays as soon as the last player finishes.
+ */
+void ServerPlay(Session * session, ServerRequest * request, GameOptions * options, 
+    ServerReply * reply)
+{
+    Table * table = session->table;
+    uint8_t status = REPLY_OK;
+
+    if (request->op == OP_NEW_GAME && session->houseHasPlayed && 
+            !AllPlayersBroke(&table->seats)){
+        session->houseHasPlayed = false;
+        session->gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            &table->currentPlayer, table->playerScore, &table->seats, 
+            table->houseCards, &table->posHouseHand);
+
+    } else if (request->op == OP_HIT && !session->gameHasEnded){
+        session->gameHasEnded = Hit(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            table->playerScore, &table->currentPlayer, &table->seats, 
+            table->playerMoney, options->betMoney);
+
+    } else if (request->op == OP_STAND && !session->gameHasEnded){
+        session->gameHasEnded = Stand(&table->seats, &table->currentPlayer);
+
+    } else if (request->op == OP_DOUBLE && !session->gameHasEnded && 
+            CanDouble(&table->rules, table->posPlayerHand[table->currentPlayer], 
+                table->playerMoney[table->currentPlayer], options->betMoney)){
+        session->gameHasEnded = Double(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            table->playerScore, &table->currentPlayer, &table->seats, 
+            table->playerMoney, table->playerBet, options->betMoney);
+
+    } else if (request->op != OP_STATE){
+        status = REPLY_INVALID;
+    }
+
+    if (session->gameHasEnded && !session->houseHasPlayed){
+        table->currentPlayer = -1;
+        HouseTurn(table->cardStack, &table->stackTopCard, table->numOfDecks, &table->shoe, 
+            table->houseCards, &table->posHouseHand, &table->houseScore, 
+            table->posPlayerHand, table->playerScore, table->playerMoney, 
+            table->playerBet, &table->seats, table->playerStats, 
+            options->betMoney, options->startPlayerMoney, &table->rules);
+        session->houseHasPlayed = true;
+    }
+
+    FillReply(session, request->seq, status, reply);
+}
+
+/**
+ * @brief      Copies the visible state of a table to a reply
+ *
+ * @param[in]  session  ptr to the session
+ * @param[in]  seq      sequence number of the request
+ * @param[in]  status   REPLY_OK or REPLY_INVALID
+ * @param[out] reply    ptr to the reply
+ */
+void FillReply(Session * session, uint32_t seq, uint8_t status, ServerReply * reply){
+    Table * table = session->table;
+
+    memset(reply, 0, sizeof(ServerReply));
+    reply->seq = seq;
+    reply->status = status;
+    reply->currentPlayer = (int8_t) table->currentPlayer;
+    reply->gameHasEnded = session->gameHasEnded;
+    reply->houseScore = session->houseHasPlayed ? (uint8_t) table->houseScore : 0;
+    reply->posHouseHand = (uint8_t) table->posHouseHand;
+
+    for (int i = 0; i < table->posHouseHand; i++){
+        reply->houseCards[i] = (uint8_t) table->houseCards[i];
+    }
+    if (!session->houseHasPlayed) reply->houseCards[0] = DECK_SIZE; // face down
+
+    for (int i = 0; i < WINDOW_SEATS; i++){
+        reply->playerMoney[i] = table->playerMoney[i];
+        reply->playerState[i] = (uint8_t) SeatState(&table->seats, i);
+        reply->playerScore[i] = (uint8_t) table->playerScore[i];
+        reply->posPlayerHand[i] = (uint8_t) table->posPlayerHand[i];
+        for (int j = 0; j < table->posPlayerHand[i]; j++){
+            reply->playerCards[i][j] = (uint8_t) table->playerCards[i][j];
+        }
+    }
+}
+
+/**
+ * @brief      Load generator client: plays many tables of a running server
+ *             and measures it
+ *
+ * @param[in]  options  ptr to the game options
+ *
+ * @return     EXIT_SUCCESS, or EXIT_FAILURE if the server can't be reached
+ *
+ * Opens options->connections connections, each with one request in flight,
+ * and plays like the dealer policy until options->requests replies arrive.
+ * Prints the actions per second and the latency percentiles.
+ */
+int RunLoadGenerator(GameOptions * options){
+    struct sockaddr_un address;
+    struct epoll_event event, events[SERVER_EVENTS];
+    struct timespec start, end, now;
+    struct timespec * sentAt;
+    ServerReply * replies;
+    int * replyUsed;
+    int * fds;
+    uint32_t * latencies;
+    long long sent = 0, done = 0;
+    int epollFd, numEvents;
+    double seconds;
+
+    fds = malloc(options->connections * sizeof(int));
+    replyUsed = calloc(options->connections, sizeof(int));
+    replies = malloc(options->connections * sizeof(ServerReply));
+    sentAt = malloc(options->connections * sizeof(struct timespec));
+    latencies = malloc((size_t) options->requests * sizeof(uint32_t));
+    if (!fds || !replyUsed || !replies || !sentAt || !latencies){
+        printf("Couldn't allocate memory for the load generator\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, options->socketPath);
+
+    epollFd = epoll_create1(0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < options->connections; i++){
+        ServerRequest request = {OP_NEW_GAME, {0}, 0};
+
+        fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fds[i], (struct sockaddr *) &address, sizeof(address)) == -1){
+            printf("Couldn't connect to %s: %s\n", options->socketPath, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[i], &event);
+
+        clock_gettime(CLOCK_MONOTONIC, &sentAt[i]);
+        if (write(fds[i], &request, sizeof(request)) != sizeof(request)){
+            printf("Couldn't send a request: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        sent++;
+    }
+
+    while (done < options->requests){
+        numEvents = epoll_wait(epollFd, events, SERVER_EVENTS, -1);
+        if (numEvents == -1 && errno == EINTR) continue;
+        if (numEvents == -1) break;
+
+        for (int e = 0; e < numEvents; e++){
+            int i = events[e].data.u32;
+            ssize_t bytes;
+            ServerRequest request = {0, {0}, 0};
+
+            bytes = read(fds[i], (char *) &replies[i] + replyUsed[i], 
+                sizeof(ServerReply) - replyUsed[i]);
+            if (bytes <= 0){
+                printf("Server closed the connection\n");
+                return EXIT_FAILURE;
+            }
+            replyUsed[i] += bytes;
+            if (replyUsed[i] < (int) sizeof(ServerReply)) continue;
+            replyUsed[i] = 0;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            latencies[done++] = (uint32_t) (ElapsedSeconds(&sentAt[i], &now) * 1e9);
+            if (done >= options->requests) break;
+            if (sent >= options->requests) continue;
+
+            request.op = LoadGeneratorMove(&replies[i]);
+            request.seq = (uint32_t) sent;
+            sentAt[i] = now;
+            if (write(fds[i], &request, sizeof(request)) != sizeof(request)){
+                printf("Couldn't send a request: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+            sent++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = ElapsedSeconds(&start, &end);
+    qsort(latencies, done, sizeof(uint32_t), CompareLatency);
+
+    printf("%lld actions in %.3f s: %.0f actions/s over %d connections\n", 
+        done, seconds, done / seconds, options->connections);
+    if (done > 0){
+        printf("latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", 
+            latencies[done / 2] / 1e3, latencies[done * 99 / 100] / 1e3, 
+            latencies[done * 999 / 1000] / 1e3, latencies[done - 1] / 1e3);
+    }
+
+    for (int i = 0; i < options->connections; i++) close(fds[i]);
+    close(epollFd);
+    free(fds);
+    free(replyUsed);
+    free(replies);
+    free(sentAt);
+    free(latencies);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief      Picks the next request of a load generator connection
+ *
+ * @param[in]  reply  ptr to the last reply of the connection
+ *
+ * @return     the request operation: a new game once the round is over,
+ *             otherwise hits below 17 like the dealer policy
+ */
+uint8_t LoadGeneratorMove(ServerReply * reply){
+    if (reply->gameHasEnded || reply->currentPlayer < 0) return OP_NEW_GAME;
+    if (PlayerDecision(POLICY_DEALER, reply->playerScore[reply->currentPlayer])){
+        return OP_HIT;
+    }
+    return OP_STAND;
+}
+
+/**
+ * @brief      Compares two latencies, for qsort
+ *
+ * @param[in]  a     ptr to the first latency
+ * @param[in]  b     ptr to the second latency
+ *
+ * @return     negative, zero or positive as a is below, equal or above b
+ */
+int CompareLatency(const void * a, const void * b){
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief      Computes the time between two instants
+ *
+ * @param[in]  start  ptr to the first instant
+ * @param[in]  end    ptr to the second instant
+ *
+ * @return     the elapsed time in seconds
+ */
+double ElapsedSeconds(struct timespec * start, struct timespec * end){
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+/****************************************************************************
+ *                                                                          *
+ *                     EXPECTED VALUE CALCULATOR FUNCTIONS                  *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Creates the expected value cache and starts its worker thread
+ *
+ * @param[in,out] arena      ptr to the arena the cache is taken from
+ * @param[in]     hitSoft17  true if the house hits a soft 17
+ *
+ * @return        ptr to the expected value cache
+ */
+EvCache * StartEvWorker(Arena * arena, bool hitSoft17){
+    EvCache * evCache = ArenaAlloc(arena, sizeof(EvCache));
+
+    evCache->hitSoft17 = hitSoft17;
+
+    pthread_mutex_init(&evCache->lock, NULL);
+    pthread_cond_init(&evCache->wake, NULL);
+    evCache->player = -1;
+
+    if (pthread_create(&evCache->worker, NULL, EvWorker, evCache) != 0){
+        printf("Couldn't start the expected value calculator\n");
+        exit(EXIT_FAILURE);
+    }
+    return evCache;
+}
+
+/**
+ * @brief      Stops the worker thread of the expected value cache
+ *
+ * @param[in]  evCache  ptr to the expected value cache
+ *
+ * The cache memory belongs to the arena it was taken from.
+ */
+void StopEvWorker(EvCache * evCache){
+    pthread_mutex_lock(&evCache->lock);
+    evCache->quit = true;
+    pthread_cond_signal(&evCache->wake);
+    pthread_mutex_unlock(&evCache->lock);
+
+    pthread_join(evCache->worker, NULL);
+    pthread_cond_destroy(&evCache->wake);
+    pthread_mutex_destroy(&evCache->lock);
+}
+
+/**
+ * @brief      Worker thread of the expected value calculator
+ *
+ * @param[in]  arg   ptr to the expected value cache
+ *
+ * @return     NULL
+ *
+ * Waits for requests and computes them. The results are only published if no
+ * newer request arrived meanwhile.
+ */
+void * EvWorker(void * arg){
+    EvCache * evCache = arg;
+    EvRequest request;
+    double evHit, evStand;
+
+    pthread_mutex_lock(&evCache->lock);
+    while (!evCache->quit){
+        if (!evCache->hasRequest){
+            pthread_cond_wait(&evCache->wake, &evCache->lock);
+            continue;
+        }
+
+        request = evCache->request;
+        evCache->hasRequest = false;
+        pthread_mutex_unlock(&evCache->lock);
+
+        ComputeEv(evCache, &request, &evHit, &evStand);
+
+        pthread_mutex_lock(&evCache->lock);
+        if (!evCache->hasRequest){
+            evCache->evHit = evHit;
+            evCache->evStand = evStand;
+            evCache->isValid = true;
+        }
+    }
+    pthread_mutex_unlock(&evCache->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief         Asks for the exact expected values of hitting and standing
+ *                of the current player
+ *
+ * @param[in,out] evCache        ptr to the expected value cache
+ * @param[in]     cardStack      ptr to the card stack array
+ * @param[in]     stackTopCard   index of the top card in the stack
+ * @param[in]     numOfDecks     number of decks used
+ * @param[in]     playerCards    ptr to array with all players cards
+ * @param[in]     posPlayerHand  ptr to array with the number of cards on each
+ *                               player's hands
+ * @param[in]     currentPlayer  player currently playing
+ * @param[in]     houseCards     ptr to array with house cards
+ *
+ * The unseen cards are the ones past stackTopCard plus the house face down
+ * card, the house shows houseCards[1]. Nothing is asked if the cards on the
+ * table didn't change since the last call, otherwise the values are marked as
+ * invalid until the worker thread computes them.
+ */
+void UpdateEv(
+        EvCache * evCache, card_t cardStack[], int stackTopCard, int numOfDecks, 
+        card_t playerCards[][MAX_CARD_HAND], int posPlayerHand[], int currentPlayer, 
+        card_t houseCards[])
+{
+    EvRequest request;
+
+    if (currentPlayer < 0) return;
+
+    if (evCache->stackTopCard == stackTopCard && evCache->player == currentPlayer && 
+            evCache->numCardsInHand == posPlayerHand[currentPlayer] && 
+            evCache->upCard == houseCards[1]){
+        return;
+    }
+
+    memset(&request, 0, sizeof(request));
+    for (int i = 0; i < numOfDecks * DECK_SIZE; i++){
+        request.fullShoe[CardPoints(cardStack[i] % 13) - 2] += 1;
+    }
+
+    // unseen cards: the rest of the stack and the house face down card
+    for (int i = stackTopCard; i < numOfDecks * DECK_SIZE; i++){
+        request.counts[CardPoints(cardStack[i] % 13) - 2] += 1;
+    }
+    request.counts[CardPoints(houseCards[0] % 13) - 2] += 1;
+    request.cardsLeft = numOfDecks * DECK_SIZE - stackTopCard + 1;
+
+    for (int i = 0; i < posPlayerHand[currentPlayer]; i++){
+        AddCardValue(CardPoints(playerCards[currentPlayer][i] % 13), 
+            &request.total, &request.softAces);
+    }
+    request.upCard = CardPoints(houseCards[1] % 13);
+
+    pthread_mutex_lock(&evCache->lock);
+    evCache->stackTopCard = stackTopCard;
+    evCache->player = currentPlayer;
+    evCache->numCardsInHand = posPlayerHand[currentPlayer];
+    evCache->upCard = houseCards[1];
+    evCache->request = request;
+    evCache->hasRequest = true;
+    evCache->isValid = false;
+    pthread_cond_signal(&evCache->wake);
+    pthread_mutex_unlock(&evCache->lock);
+}
+
+/**
+ * @brief         Computes the exact expected values of hitting and standing
+ *
+ * @param[in,out] evCache   ptr to the expected value cache (holds the memos)
+ * @param[in,out] request   ptr to the hand to evaluate
+ * @param[out]    evHit     ptr to the expected value of hitting
+ * @param[out]    evStand   ptr to the expected value of standing
+ *
+ * Values are per unit bet, assuming the player keeps playing the best way
+ * after hitting, and follow the house rules of HouseTurn. The memos only hold
+ * for one shoe, so they are cleared first.
+ */
+void ComputeEv(EvCache * evCache, EvRequest * request, double * evHit, double * evStand){
+    const double * outcome;
+
+    memset(evCache->memo, 0, sizeof(evCache->memo));
+    memset(evCache->drawMemo, 0, sizeof(evCache->drawMemo));
+    memset(evCache->hitMemo, 0, sizeof(evCache->hitMemo));
+    evCache->generation = 0;
+    memcpy(evCache->fullShoe, request->fullShoe, sizeof(evCache->fullShoe));
+
+    outcome = HouseOutcomes(evCache, request->counts, request->cardsLeft, 
+        request->upCard);
+    *evStand = StandEv(outcome, request->total);
+    *evHit = HitEv(evCache, request->counts, request->cardsLeft, request->total, 
+        request->softAces, request->upCard);
+}
+
+/**
+ * @brief         Returns the probabilities of the house final scores for a
+ *                composition of unseen cards
+ *
+ * @param[in,out] evCache    ptr to the expected value cache (holds the memo)
+ * @param[in]     counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     upCard     value of the house face up card
+ *
+ * @return        ptr to the probabilities of a final score of 17, 18, 19, 20,
+ *                21 and of a bust
+ *
+ * The player reaches the same composition hitting cards in different orders,
+ * so results are memoized by composition.
+ */
+const double * HouseOutcomes(EvCache * evCache, int counts[], int cardsLeft, int upCard){
+    uint64_t key = PackComposition(counts);
+    EvMemoEntry * entry = FindMemoEntry(evCache->memo, key, 0);
+    int total = 0, softAces = 0;
+
+    if (entry == NULL){
+        entry = &evCache->scratch;
+    } else if (entry->key == key && entry->generation == 0){
+        return entry->outcome;
+    }
+
+    // a new generation frees every entry of the draw memo
+    evCache->generation++;
+    AddCardValue(upCard, &total, &softAces);
+    HouseFinalScores(evCache, counts, cardsLeft, total, softAces, 0, entry->outcome);
+    entry->key = key;
+    entry->generation = 0;
+    return entry->outcome;
+}
+
+/**
+ * @brief         Computes the probabilities of the house final scores from a
+ *                hand of the house
+ *
+ * @param[in,out] evCache    ptr to the expected value cache (holds the memo)
+ * @param[in,out] counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     total      house score counting soft aces as 11
+ * @param[in]     softAces   number of aces still counted as 11
+ * @param[in]     drawn      cards drawn by the house so far, 5 bits per value
+ * @param[out]    outcome    ptr to the probabilities of each final score
+ *
+ * The house takes cards until it stands, like in HouseTurn.
+ * The hand and the unseen cards only depend on which cards the house drew,
+ * not on their order, so results are memoized by the drawn cards. counts is
+ * restored before returning.
+ */
+void HouseFinalScores(EvCache * evCache, int counts[], int cardsLeft, int total, 
+    int softAces, uint64_t drawn, double outcome[])
+{
+    uint64_t key = drawn | 1ull << 63;
+    EvMemoEntry * entry;
+    double next[EV_OUTCOMES];
+
+    memset(outcome, 0, sizeof(double) * EV_OUTCOMES);
+
+    if (total > 21){
+        outcome[EV_OUTCOMES - 1] = 1;
+        return;
+    } else if (HouseStands(total, softAces, evCache->hitSoft17)){
+        outcome[total - 17] = 1;
+        return;
+    }
+
+    // the stack is reshuffled: the draw continues from a full shoe
+    if (cardsLeft == 0){
+        int shoe[EV_VALUES];
+        memcpy(shoe, evCache->fullShoe, sizeof(shoe));
+        for (int i = 0; i < EV_VALUES; i++) cardsLeft += shoe[i];
+        HouseDraws(shoe, cardsLeft, evCache->fullShoe, total, softAces, 
+            evCache->hitSoft17, 1.0, outcome);
+        return;
+    }
+
+    entry = FindMemoEntry(evCache->drawMemo, key, evCache->generation);
+    if (entry != NULL && entry->key == key && entry->generation == evCache->generation){
+        memcpy(outcome, entry->outcome, sizeof(double) * EV_OUTCOMES);
+        return;
+    }
+
+    for (int i = 0; i < EV_VALUES; i++){
+        int newTotal = total, newSoftAces = softAces;
+        double prob = (double) counts[i] / cardsLeft;
+
+        if (counts[i] == 0) continue;
+
+        AddCardValue(i + 2, &newTotal, &newSoftAces);
+        counts[i] -= 1;
+        HouseFinalScores(evCache, counts, cardsLeft - 1, newTotal, newSoftAces, 
+            drawn + (1ull << (5 * i)), next);
+        counts[i] += 1;
+
+        for (int j = 0; j < EV_OUTCOMES; j++) outcome[j] += prob * next[j];
+    }
+
+    if (entry != NULL){
+        entry->key = key;
+        entry->generation = evCache->generation;
+        memcpy(entry->outcome, outcome, sizeof(double) * EV_OUTCOMES);
+    }
+}
+
+/**
+ * @brief      Finds the entry of a memo where a key is or should be stored
+ *
+ * @param[in]  memo        ptr to the memo array (EV_MEMO_SIZE entries)
+ * @param[in]  key         key to look for (never 0)
+ * @param[in]  generation  current generation of the memo
+ *
+ * @return     ptr to the entry holding key, ptr to a free entry if key isn't
+ *             in the memo or NULL if the memo is full
+ *
+ * Uses linear probing. Entries of an older generation count as free, so a
+ * memo is emptied just by changing its generation.
+ */
+EvMemoEntry * FindMemoEntry(EvMemoEntry memo[], uint64_t key, int generation){
+    int slot = (int) ((key * 0x9E3779B97F4A7C15ull) >> 40) & (EV_MEMO_SIZE - 1);
+
+    for (int i = 0; i < EV_MEMO_SIZE; i++){
+        EvMemoEntry * entry = &memo[(slot + i) & (EV_MEMO_SIZE - 1)];
+
+        if (entry->key == 0 || entry->generation != generation || entry->key == key){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief         Adds up the probabilities of every way the house can finish
+ *                its hand
+ *
+ * @param[in,out] counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     fullShoe   ptr to the composition after a reshuffle
+ * @param[in]     total      house score counting soft aces as 11
+ * @param[in]     softAces   number of aces still counted as 11
+ * @param[in]     hitSoft17  true if the house hits a soft 17
+ * @param[in]     prob       probability of reaching this hand
+ * @param[in,out] outcome    ptr to the probabilities of each final score
+ *
+ * The house takes cards until it stands, like in HouseTurn.
+ * counts is restored before returning. If the unseen cards run out the
+ * stack is reshuffled, so the draw continues from a full shoe.
+ */
+void HouseDraws(int counts[], int cardsLeft, int fullShoe[], int total, 
+    int softAces, bool hitSoft17, double prob, double outcome[])
+{
+    int shoe[EV_VALUES];
+
+    if (total > 21){
+        outcome[EV_OUTCOMES - 1] += prob;
+        return;
+    } else if (HouseStands(total, softAces, hitSoft17)){
+        outcome[total - 17] += prob;
+        return;
+    }
+
+    if (cardsLeft == 0){
+        memcpy(shoe, fullShoe, sizeof(shoe));
+        for (int i = 0; i < EV_VALUES; i++) cardsLeft += shoe[i];
+        counts = shoe;
+    }
+
+    for (int i = 0; i < EV_VALUES; i++){
+        int newTotal = total, newSoftAces = softAces;
+
+        if (counts[i] == 0) continue;
+
+        AddCardValue(i + 2, &newTotal, &newSoftAces);
+        counts[i] -= 1;
+        HouseDraws(counts, cardsLeft - 1, fullShoe, newTotal, newSoftAces, 
+            hitSoft17, prob * (counts[i] + 1) / cardsLeft, outcome);
+        counts[i] += 1;
+    }
+}
+
+/**
+ * @brief      Checks if the house stands on a hand
+ *
+ * @param[in]  total      house score counting soft aces as 11 (21 at most)
+ * @param[in]  softAces   number of aces still counted as 11
+ * @param[in]  hitSoft17  true if the house hits a soft 17
+ *
+ * @return     true if the house stands, false if it takes another card
+ */
+bool HouseStands(int total, int softAces, bool hitSoft17){
+    return total > 17 || (total == 17 && !(hitSoft17 && softAces > 0));
+}
+
+/**
+ * @brief      Computes the expected value of standing
+ *
+ * @param[in]  outcome  ptr to the probabilities of each house final score
+ * @param[in]  score    player score
+ *
+ * @return     expected value per unit bet
+ */
+double StandEv(const double outcome[], int score){
+    double ev = outcome[EV_OUTCOMES - 1]; // house busts
+
+    for (int i = 0; i < EV_OUTCOMES - 1; i++){
+        if (score > 17 + i) ev += outcome[i];
+        else if (score < 17 + i) ev -= outcome[i];
+    }
+    return ev;
+}
+
+/**
+ * @brief         Computes the expected value of hitting, playing the best way
+ *                afterwards
+ *
+ * @param[in,out] evCache    ptr to the expected value cache
+ * @param[in,out] counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     total      player score counting soft aces as 11
+ * @param[in]     softAces   number of aces still counted as 11
+ * @param[in]     upCard     value of the house face up card
+ *
+ * @return        expected value per unit bet
+ *
+ * A bust loses the bet and 21 ends the player's turn, like in Hit. The
+ * player's hand follows from the composition, so results are memoized by
+ * composition. counts is restored before returning.
+ */
+double HitEv(EvCache * evCache, int counts[], int cardsLeft, int total, 
+    int softAces, int upCard)
+{
+    double ev = 0;
+    int shoe[EV_VALUES];
+    int drawn = cardsLeft;
+    uint64_t key = PackComposition(counts);
+    EvMemoEntry * entry = FindMemoEntry(evCache->hitMemo, key, 0);
+
+    // the player's cards are the ones missing from the composition
+    if (entry != NULL && entry->key == key){
+        return entry->outcome[0];
+    }
+
+    if (cardsLeft == 0){
+        memcpy(shoe, evCache->fullShoe, sizeof(shoe));
+        for (int i = 0; i < EV_VALUES; i++) drawn += shoe[i];
+        counts = shoe;
+    }
+
+    for (int i = 0; i < EV_VALUES; i++){
+        int newTotal = total, newSoftAces = softAces, count = counts[i];
+        double evStand, evHit;
+
+        if (count == 0) continue;
+
+        AddCardValue(i + 2, &newTotal, &newSoftAces);
+        if (newTotal > 21){
+            ev -= (double) count / drawn;
+            continue;
+        }
+
+        counts[i] -= 1;
+        evStand = StandEv(HouseOutcomes(evCache, counts, drawn - 1, upCard), newTotal);
+        if (newTotal < 21){
+            evHit = HitEv(evCache, counts, drawn - 1, newTotal, newSoftAces, upCard);
+            if (evHit > evStand) evStand = evHit;
+        }
+        counts[i] += 1;
+
+        ev += evStand * count / drawn;
+    }
+
+    if (entry != NULL){
+        entry->key = key;
+        entry->outcome[0] = ev;
+    }
+    return ev;
+}
+
+/**
+ * @brief         Adds a card value to a hand score
+ *
+ * @param[in]     value     value of the card (11 for an ace)
+ * @param[in,out] total     ptr to score counting soft aces as 11
+ * @param[in,out] softAces  ptr to number of aces still counted as 11
+ *
+ * Like CountScore, aces are changed to 1 point while the score is over 21.
+ */
+void AddCardValue(int value, int * total, int * softAces){
+    *total += value;
+    if (value == 11) *softAces += 1;
+
+    while (*total > 21 && *softAces > 0){
+        *total -= 10;
+        *softAces -= 1;
+    }
+}
+
+/**
+ * @brief      Packs a composition of unseen cards in a single key
+ *
+ * @param[in]  counts  ptr to array with the unseen cards of each value
+ *
+ * @return     the key, never 0
+ *
+ * Each value takes 6 bits (at most 24 cards) except tens that take 7 bits (at
+ * most 96 cards).
+ */
+uint64_t PackComposition(int counts[]){
+    uint64_t key = 0;
+
+    for (int i = 0; i < EV_VALUES; i++){
+        key = (key << (i == 8 ? 7 : 6)) | (uint64_t) counts[i];
+    }
+    return key | 1ull << 63;
+}
+
+/**
+ * @brief      Computes the exact expected value of a hand off the top of a
+ *             full shoe, by enumeration
+ *
+ * @param[in]  options  ptr to the game options
+ *
+ * @return     EXIT_SUCCESS
+ *
+ * Every deal is walked from the number of cards of each value in the shoe
+ * (suits don't matter), with the first two player cards taken as an unordered
+ * pair. The other seats don't change the expected value of a seat, since
+ * their cards are as unknown to it as the rest of the shoe, so one player is
+ * played against the house. The house is played by HouseOutcomes and the
+ * best play by HitEv, with their memos kept for all the deals of an up card.
+ * The up cards are split over options->threads threads (every core if 0).
+ *
+ * Prints the expected value per unit bet of the player policy (unless it is
+ * human) and of the best play (hit, stand or double), knowing only the
+ * player's own cards and the up card. Players always cover their bets and
+ * blackjacks are paid rounded down like in HouseTurn.
+ */
+int RunExact(GameOptions * options){
+    ExactJob job;
+    pthread_t threads[EV_VALUES];
+    int numThreads = options->threads;
+    double policyEv = 0, bestEv = 0, start, seconds;
+    char upName[4];
+
+    memset(&job, 0, sizeof(job));
+    job.options = options;
+    for (int i = 0; i < EV_VALUES; i++){
+        job.fullShoe[i] = (i == 8 ? 16 : 4) * options->numOfDecks;
+        job.cardsInShoe += job.fullShoe[i];
+    }
+    job.blackjackPays = (double) ((long long) options->betMoney * options->payoutNum / 
+        options->payoutDen) / options->betMoney;
+
+    if (numThreads == 0) numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > EV_VALUES) numThreads = EV_VALUES;
+
+    start = Now();
+    for (int i = 0; i < numThreads; i++){
+        if (pthread_create(&threads[i], NULL, ExactWorker, &job) != 0){
+            printf("Couldn't start exact calculator thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < numThreads; i++){
+        pthread_join(threads[i], NULL);
+    }
+    seconds = Now() - start;
+
+    printf("Exact expected value per unit bet, %d deck(s), house %s, blackjack pays "
+        "%d:%d, double %s\n", options->numOfDecks, 
+        options->dealerRule == DEALER_H17 ? "hits soft 17" : "stands on soft 17", 
+        options->payoutNum, options->payoutDen, options->allowDouble ? "on" : "off");
+    printf("Up card \t Probability \t Policy EV \t Best play EV\n");
+    for (int i = 0; i < EV_VALUES; i++){
+        double prob = (double) job.fullShoe[i] / job.cardsInShoe;
+
+        if (i == EV_VALUES - 1) strcpy(upName, "A");
+        else sprintf(upName, "%d", i + 2);
+
+        policyEv += prob * job.policyEv[i];
+        bestEv += prob * job.bestEv[i];
+        if (options->policy == POLICY_HUMAN){
+            printf("%7s \t %.6f \t %9s \t %+.6f\n", upName, prob, "-", job.bestEv[i]);
+        } else {
+            printf("%7s \t %.6f \t %+.6f \t %+.6f\n", upName, prob, job.policyEv[i], 
+                job.bestEv[i]);
+        }
+    }
+    if (options->policy == POLICY_HUMAN){
+        printf("  Total \t %.6f \t %9s \t %+.6f\n", 1.0, "-", bestEv);
+    } else {
+        printf("  Total \t %.6f \t %+.6f \t %+.6f\n", 1.0, policyEv, bestEv);
+        printf("House edge against the policy: %.4f%%\n", -100 * policyEv);
+    }
+    printf("House edge against the best play: %.4f%%\n", -100 * bestEv);
+    printf("Computed in %.3f s on %d threads\n", seconds, numThreads);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief      Exact calculator thread
+ *
+ * @param[in]  arg   ptr to the exact calculator job
+ *
+ * @return     NULL
+ *
+ * Takes the next up card until every up card is done. Each thread has its own
+ * memos, which only hold for one up card, so they are cleared between them.
+ */
+void * ExactWorker(void * arg){
+    ExactJob * job = arg;
+    EvCache * evCache = calloc(1, sizeof(EvCache));
+    int upIndex;
+
+    if (evCache == NULL){
+        printf("Couldn't allocate the exact calculator memos\n");
+        exit(EXIT_FAILURE);
+    }
+    evCache->hitSoft17 = job->options->dealerRule == DEALER_H17;
+    memcpy(evCache->fullShoe, job->fullShoe, sizeof(evCache->fullShoe));
+
+    while ((upIndex = __atomic_fetch_add(&job->nextUpCard, 1, __ATOMIC_RELAXED)) < 
+            EV_VALUES){
+        memset(evCache->memo, 0, sizeof(evCache->memo));
+        memset(evCache->drawMemo, 0, sizeof(evCache->drawMemo));
+        memset(evCache->hitMemo, 0, sizeof(evCache->hitMemo));
+        evCache->generation = 0;
+        ExactUpCard(evCache, job, upIndex);
+    }
+
+    free(evCache);
+    return NULL;
+}
+
+/**
+ * @brief         Computes the exact expected values of every deal with one
+ *                house up card
+ *
+ * @param[in,out] evCache  ptr to the memos of the thread
+ * @param[in,out] job      ptr to the exact calculator job, gets the results
+ * @param[in]     upIndex  value of the up card minus 2
+ *
+ * The expected values are given for a deal with that up card, so the caller
+ * weighs them with the probability of the up card.
+ */
+void ExactUpCard(EvCache * evCache, ExactJob * job, int upIndex){
+    int counts[EV_VALUES];
+    int cardsLeft = job->cardsInShoe - 1;
+    double policyEv = 0, bestEv = 0;
+
+    memcpy(counts, job->fullShoe, sizeof(counts));
+    counts[upIndex] -= 1;
+
+    // the first two cards as an unordered pair, a <= b
+    for (int a = 0; a < EV_VALUES; a++){
+        for (int b = a; b < EV_VALUES; b++){
+            int total = 0, softAces = 0;
+            double prob = (double) counts[a] / cardsLeft;
+
+            counts[a] -= 1;
+            prob *= (double) counts[b] / (cardsLeft - 1);
+            if (a != b) prob *= 2;
+
+            if (prob > 0){
+                counts[b] -= 1;
+                AddCardValue(a + 2, &total, &softAces);
+                AddCardValue(b + 2, &total, &softAces);
+                if (job->options->policy != POLICY_HUMAN){
+                    policyEv += prob * PolicyEv(evCache, job, counts, cardsLeft - 2, 
+                        total, softAces, 2, upIndex + 2);
+                }
+                bestEv += prob * BestEv(evCache, job, counts, cardsLeft - 2, total, 
+                    softAces, upIndex + 2);
+                counts[b] += 1;
+            }
+            counts[a] += 1;
+        }
+    }
+
+    job->policyEv[upIndex] = policyEv;
+    job->bestEv[upIndex] = bestEv;
+}
+
+/**
+ * @brief         Computes the expected value of a hand played by the policy
+ *
+ * @param[in,out] evCache    ptr to the memos of the thread
+ * @param[in]     job        ptr to the exact calculator job
+ * @param[in,out] counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     total      player score counting soft aces as 11
+ * @param[in]     softAces   number of aces still counted as 11
+ * @param[in]     numCards   number of cards in the player's hand
+ * @param[in]     upCard     value of the house face up card
+ *
+ * @return        expected value per unit bet
+ *
+ * Follows NewGame, Hit, Double and HouseTurn: a two card 21 is a blackjack,
+ * the policy doubles with PlayerDoubles and hits with PlayerDecision, a bust
+ * loses the bet and 21 ends the turn. counts is restored before returning.
+ */
+double PolicyEv(EvCache * evCache, ExactJob * job, int counts[], int cardsLeft, 
+    int total, int softAces, int numCards, int upCard)
+{
+    GameOptions * options = job->options;
+    double ev = 0;
+
+    // a blackjack is paid unless the house makes 21 too
+    if (numCards == 2 && total == 21){
+        return job->blackjackPays * 
+            (1 - HouseOutcomes(evCache, counts, cardsLeft, upCard)[21 - 17]);
+    }
+    if (options->allowDouble && numCards == 2 && PlayerDoubles(options->policy, total)){
+        return DoubleEv(evCache, counts, cardsLeft, total, softAces, upCard);
+    }
+    if (!PlayerDecision(options->policy, total)){
+        return StandEv(HouseOutcomes(evCache, counts, cardsLeft, upCard), total);
+    }
+
+    for (int i = 0; i < EV_VALUES; i++){
+        int newTotal = total, newSoftAces = softAces, count = counts[i];
+        double value;
+
+        if (count == 0) continue;
+
+        AddCardValue(i + 2, &newTotal, &newSoftAces);
+        if (newTotal > 21){
+            ev -= (double) count / cardsLeft;
+            continue;
+        }
+
+        counts[i] -= 1;
+        if (newTotal == 21){
+            value = StandEv(HouseOutcomes(evCache, counts, cardsLeft - 1, upCard), 21);
+        } else {
+            value = PolicyEv(evCache, job, counts, cardsLeft - 1, newTotal, newSoftAces, 
+                numCards + 1, upCard);
+        }
+        counts[i] += 1;
+
+        ev += value * count / cardsLeft;
+    }
+    return ev;
+}
+
+/**
+ * @brief         Computes the expected value of the best play of the first two
+ *                cards
+ *
+ * @param[in,out] evCache    ptr to the memos of the thread
+ * @param[in]     job        ptr to the exact calculator job
+ * @param[in,out] counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     total      player score counting soft aces as 11
+ * @param[in]     softAces   number of aces still counted as 11
+ * @param[in]     upCard     value of the house face up card
+ *
+ * @return        expected value per unit bet of the best of standing, hitting
+ *                (then playing the best way) and doubling if the rules allow it
+ */
+double BestEv(EvCache * evCache, ExactJob * job, int counts[], int cardsLeft, 
+    int total, int softAces, int upCard)
+{
+    const double * outcome = HouseOutcomes(evCache, counts, cardsLeft, upCard);
+    double ev, evHit, evDouble;
+
+    if (total == 21) return job->blackjackPays * (1 - outcome[21 - 17]);
+
+    // outcome may be the scratch entry, so it is used before the next call
+    ev = StandEv(outcome, total);
+    evHit = HitEv(evCache, counts, cardsLeft, total, softAces, upCard);
+    if (evHit > ev) ev = evHit;
+
+    if (job->options->allowDouble){
+        evDouble = DoubleEv(evCache, counts, cardsLeft, total, softAces, upCard);
+        if (evDouble > ev) ev = evDouble;
+    }
+    return ev;
+}
+
+/**
+ * @brief         Computes the expected value of doubling down
+ *
+ * @param[in,out] evCache    ptr to the memos of the thread
+ * @param[in,out] counts     ptr to array with the unseen cards of each value
+ * @param[in]     cardsLeft  number of unseen cards
+ * @param[in]     total      player score counting soft aces as 11
+ * @param[in]     softAces   number of aces still counted as 11
+ * @param[in]     upCard     value of the house face up card
+ *
+ * @return        expected value per unit of the first bet: the bet is doubled
+ *                and the player stands after one card. counts is restored
+ *                before returning.
+ */
+double DoubleEv(EvCache * evCache, int counts[], int cardsLeft, int total, 
+    int softAces, int upCard)
+{
+    double ev = 0;
+
+    for (int i = 0; i < EV_VALUES; i++){
+        int newTotal = total, newSoftAces = softAces, count = counts[i];
+
+        if (count == 0) continue;
+
+        AddCardValue(i + 2, &newTotal, &newSoftAces);
+        if (newTotal > 21){
+            ev -= 2.0 * count / cardsLeft;
+            continue;
+        }
+
+        counts[i] -= 1;
+        ev += 2 * StandEv(HouseOutcomes(evCache, counts, cardsLeft - 1, upCard), 
+            newTotal) * count / cardsLeft;
+        counts[i] += 1;
+    }
+    return ev;
+}
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                             TRACING FUNCTIONS                            *
+ *                                                                          *
+ ****************************************************************************/
+
+#ifdef TRACE
+/**
+ * @brief      Starts recording trace events
+ *
+ * @param[in]  path  file the trace is written to when the program exits
+ *
+ * Every thread records the scopes it ends and its counters in its own ring
+ * buffer. The buffers are written out as Chrome trace JSON at exit.
+ */
+void StartTrace(const char * path){
+    strcpy(tracePath, path);
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    traceEnabled = true;
+    atexit(WriteTrace);
+}
+
+/**
+ * @brief      Writes the trace events of every thread to the trace file
+ *
+ * Scopes are complete ("X") events and counters are counter ("C") events,
+ * one counter track per thread, with the counts since the previous counters
+ * event of the thread (per frame in the GUI). Only the last
+ * TRACE_BUFFER_EVENTS events of each thread are kept.
+ */
+void WriteTrace(void){
+    FILE * traceFile;
+    TraceBuffer * buffer, * next;
+    bool first = true;
+
+    traceEnabled = false;
+    traceFile = fopen(tracePath, "w");
+    if (traceFile == NULL){
+        printf("Couldn't open the trace file %s: %s\n", tracePath, strerror(errno));
+        return;
+    }
+
+    fprintf(traceFile, "{\"traceEvents\":[\n");
+    for (buffer = __atomic_load_n(&traceBuffers, __ATOMIC_ACQUIRE); buffer != NULL; 
+            buffer = buffer->next){
+        uint64_t written = __atomic_load_n(&buffer->written, __ATOMIC_ACQUIRE);
+        uint64_t oldest = written > TRACE_BUFFER_EVENTS ? written - TRACE_BUFFER_EVENTS : 0;
+
+        fprintf(traceFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n", 
+            buffer->tid, buffer->tid);
+        first = false;
+
+        for (uint64_t i = oldest; i < written; i++){
+            TraceEvent * event = &buffer->events[i & (TRACE_BUFFER_EVENTS - 1)];
+
+            if (event->name != NULL){
+                fprintf(traceFile, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event->name, buffer->tid, 
+                    event->start / 1e3, event->duration / 1e3);
+                continue;
+            }
+            fprintf(traceFile, ",\n{\"name\":\"counters %d\",\"ph\":\"C\",\"pid\":1,"
+                "\"tid\":%d,\"ts\":%.3f,\"args\":{", buffer->tid, buffer->tid, 
+                event->start / 1e3);
+            for (int c = 0; c < NUM_TRACE_COUNTERS; c++){
+                fprintf(traceFile, "%s\"%s\":%u", c == 0 ? "" : ",", 
+                    traceCounterNames[c], event->counters[c]);
+            }
+            fprintf(traceFile, "}}");
+        }
+    }
+    fprintf(traceFile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(traceFile);
+
+    for (buffer = traceBuffers; buffer != NULL; buffer = next){
+        next = buffer->next;
+        free(buffer);
+    }
+    traceBuffers = NULL;
+}
+
+/**
+ * @brief      Gets the trace buffer of the calling thread
+ *
+ * @return     ptr to the buffer, created and added to the list of buffers
+ *             the first time the thread traces something
+ */
+TraceBuffer * TraceThread(void){
+    if (traceBuffer != NULL) return traceBuffer;
+
+    traceBuffer = calloc(1, sizeof(TraceBuffer));
+    if (traceBuffer == NULL){
+        printf("Couldn't allocate the trace buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    traceBuffer->tid = __atomic_add_fetch(&traceThreads, 1, __ATOMIC_RELAXED);
+    traceBuffer->next = __atomic_load_n(&traceBuffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&traceBuffers, &traceBuffer->next, traceBuffer, 
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return traceBuffer;
+}
+
+/**
+ * @brief      Reads the trace clock
+ *
+ * @return     nanoseconds since the trace started
+ */
+uint64_t TraceNow(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - traceStart.tv_sec) * 1000000000ull + 
+        now.tv_nsec - traceStart.tv_nsec;
+}
+
+/**
+ * @brief      Starts a trace scope, used by TRACE_SCOPE
+ *
+ * @param[in]  name  name of the scope, a string literal
+ *
+ * @return     the scope, without a name if not tracing
+ */
+TraceScope TraceBegin(const char * name){
+    TraceScope scope = {NULL, 0};
+
+    if (traceEnabled){
+        scope.name = name;
+        scope.start = TraceNow();
+    }
+    return scope;
+}
+
+/**
+ * @brief      Ends a trace scope, called when its variable goes out of scope
+ *
+ * @param[in]  scope  ptr to the scope started by TraceBegin
+ */
+void TraceEnd(TraceScope * scope){
+    if (scope->name == NULL || !traceEnabled) return;
+    AddTraceEvent(TraceThread(), scope->name, scope->start, TraceNow() - scope->start);
+}
+
+/**
+ * @brief      Adds to a counter of the calling thread, used by TRACE_COUNT
+ *
+ * @param[in]  counter  TRACE_CARDS_DRAWN, TRACE_RESHUFFLES, TRACE_TEXTURES or
+ *                      TRACE_TEXT_SURFACES
+ * @param[in]  n        amount to add
+ */
+void TraceCount(int counter, uint32_t n){
+    if (traceEnabled) TraceThread()->counters[counter] += n;
+}
+
+/**
+ * @brief      Records the counters of the calling thread and clears them,
+ *             used by TRACE_COUNTERS at the end of a frame or a task
+ */
+void TraceCounters(void){
+    TraceBuffer * buffer;
+
+    if (!traceEnabled) return;
+    buffer = TraceThread();
+    AddTraceEvent(buffer, NULL, TraceNow(), 0);
+    memset(buffer->counters, 0, sizeof(buffer->counters));
+}
+
+/**
+ * @brief      Writes an event to the ring of a thread
+ *
+ * @param[in,out] buffer    ptr to the trace buffer of the calling thread
+ * @param[in]     name      name of the scope, NULL for the counters
+ * @param[in]     start     start of the event, in trace nanoseconds
+ * @param[in]     duration  duration of the event in nanoseconds
+ *
+ * The event is published by the release store of written, so the events
+ * before it are complete when WriteTrace sees the new count.
+ */
+void AddTraceEvent(TraceBuffer * buffer, const char * name, uint64_t start, 
+    uint64_t duration)
+{
+    TraceEvent * event = &buffer->events[buffer->written & (TRACE_BUFFER_EVENTS - 1)];
+
+    event->name = name;
+    event->start = start;
+    event->duration = duration;
+    memcpy(event->counters, buffer->counters, sizeof(event->counters));
+    __atomic_store_n(&buffer->written, buffer->written + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                       GAME ENGINE THREAD FUNCTIONS                       *
+ *                                                                          *
+ ****************************************************************************/
+
+/**
+ * @brief         Deals the first round and starts the engine thread
+ *
+ * @param[out]    engine    ptr to the engine
+ * @param[in]     options   ptr to the game options
+ * @param[in,out] table     ptr to the table, only used by the engine from now
+ *                          on
+ * @param[in]     snapshot  ptr to the checkpoint snapshot of the table, or
+ *                          NULL
+ *
+ * The three frames start as the first round, so the renderer has a whole
+ * frame to draw before the engine publishes any. Like PlayGames, the rounds
+ * to play count the rounds of a resumed table, so a table that already
+ * played options->rounds rounds is finished at once.
+ */
+void StartEngine(Engine * engine, GameOptions * options, Table * table, 
+        TableSnapshot * snapshot){
+    engine->options = options;
+    engine->table = table;
+    engine->snapshot = snapshot;
+    engine->finished = options->rounds != 0 && table->roundsPlayed >= options->rounds;
+    engine->gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+        table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+        &table->currentPlayer, table->playerScore, &table->seats, 
+        table->houseCards, &table->posHouseHand);
+
+    for (int i = 0; i < 3; i++){
+        memcpy(&engine->frames[i].table, table, sizeof(Table));
+        engine->frames[i].gameHasEnded = engine->gameHasEnded;
+        engine->frames[i].finished = engine->finished;
+    }
+    engine->front = 0;
+    engine->middle = 1;
+    engine->back = 2;
+
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->ready, NULL);
+    pthread_cond_init(&engine->taken, NULL);
+    if (pthread_create(&engine->thread, NULL, EngineWorker, engine) != 0){
+        printf("Couldn't start the game engine thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief         Stops the engine thread
+ *
+ * @param[in,out] engine  ptr to the engine
+ *
+ * The commands already queued are run first, so the table ends in the same
+ * state however far behind the engine was.
+ */
+void StopEngine(Engine * engine){
+    PushCommand(engine, ENGINE_QUIT);
+    pthread_join(engine->thread, NULL);
+    pthread_cond_destroy(&engine->taken);
+    pthread_cond_destroy(&engine->ready);
+    pthread_mutex_destroy(&engine->lock);
+}
+
+/**
+ * @brief         Queues a command for the engine thread
+ *
+ * @param[in,out] engine   ptr to the engine
+ * @param[in]     command  SDL key code, ENGINE_STEP or ENGINE_QUIT
+ *
+ * Only waits if ENGINE_QUEUE_SIZE commands are already queued, which means
+ * the engine is far behind.
+ */
+void PushCommand(Engine * engine, int command){
+    pthread_mutex_lock(&engine->lock);
+    while (engine->count == ENGINE_QUEUE_SIZE){
+        pthread_cond_wait(&engine->taken, &engine->lock);
+    }
+    engine->commands[(engine->head + engine->count) % ENGINE_QUEUE_SIZE] = command;
+    engine->count++;
+    pthread_cond_signal(&engine->ready);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * @brief         Takes the next command, by the engine thread
+ *
+ * @param[in,out] engine  ptr to the engine
+ *
+ * @return        the command, waiting for one if the queue is empty
+ */
+int TakeCommand(Engine * engine){
+    int command;
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->count == 0){
+        pthread_cond_wait(&engine->ready, &engine->lock);
+    }
+    command = engine->commands[engine->head];
+    engine->head = (engine->head + 1) % ENGINE_QUEUE_SIZE;
+    engine->count--;
+    pthread_cond_signal(&engine->taken);
+    pthread_mutex_unlock(&engine->lock);
+    return command;
+}
+
+/**
+ * @brief      Game engine thread
+ *
+ * @param[in]  arg   ptr to the engine
+ *
+ * @return     NULL
+ *
+ * Runs the commands in the order they were queued and publishes a frame after
+ * each one, until ENGINE_QUIT. Once the rounds are over the commands are
+ * ignored.
+ */
+void * EngineWorker(void * arg){
+    Engine * engine = arg;
+    int command;
+
+    while ((command = TakeCommand(engine)) != ENGINE_QUIT){
+        if (engine->finished) continue;
+        RunCommand(engine, command);
+        PublishFrame(engine);
+        TRACE_COUNTERS();
+    }
+    return NULL;
+}
+
+/**
+ * @brief         Runs a command of the main thread on the table
+ *
+ * @param[in,out] engine   ptr to the engine
+ * @param[in]     command  key pressed ('s', 'h', 'd' or 'n') or ENGINE_STEP
+ *
+ * A step is what the game did once per frame: the automatic policy plays a
+ * move, the house plays when every player is done and an automatic policy
+ * deals the next round. After options->rounds rounds the engine is finished.
+ */
+void RunCommand(Engine * engine, int command){
+    TRACE_SCOPE("RunCommand");
+    GameOptions * options = engine->options;
+    Table * table = engine->table;
+
+    switch (command){
+        // 's' to "stand"
+        case SDLK_s:
+            if (!engine->gameHasEnded) 
+                engine->gameHasEnded = Stand(&table->seats, &table->currentPlayer);
+            return;
+
+        // 'h' to "hit"
+        case SDLK_h:
+            if (!engine->gameHasEnded){
+                engine->gameHasEnded = Hit(table->cardStack, &table->stackTopCard, 
+                    table->numOfDecks, &table->shoe, table->playerCards, 
+                    table->posPlayerHand, table->playerScore, 
+                    &table->currentPlayer, &table->seats, 
+                    table->playerMoney, options->betMoney);
+            }
+            return;
+
+        // 'd' to "double down", if the rules allow it
+        case SDLK_d:
+            if (!engine->gameHasEnded && CanDouble(&table->rules, 
+                    table->posPlayerHand[table->currentPlayer], 
+                    table->playerMoney[table->currentPlayer], options->betMoney)){
+                engine->gameHasEnded = Double(table->cardStack, &table->stackTopCard, 
+                    table->numOfDecks, &table->shoe, table->playerCards, 
+                    table->posPlayerHand, table->playerScore, 
+                    &table->currentPlayer, &table->seats, 
+                    table->playerMoney, table->playerBet, options->betMoney);
+            }
+            return;
+
+        // 'n' to start a new game, only when all cards have been distributed
+        case SDLK_n:
+            if (engine->gameHasEnded){
+                engine->houseHasPlayed = false;
+                engine->gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+                    table->numOfDecks, &table->shoe, table->playerCards, 
+                    table->posPlayerHand, &table->currentPlayer, 
+                    table->playerScore, &table->seats, 
+                    table->houseCards, &table->posHouseHand);
+            }
+            return;
+
+        case ENGINE_STEP:
+            break;
 
-    // check for bust or BlackJack
-    playerScore[*currentPlayer] = CountScore(playerCards[*currentPlayer], posPlayerHand[*currentPlayer]);
+        default:
+            return;
+    }
 
-    if (playerScore[*currentPlayer] >= 21){
-        if (playerScore[*currentPlayer] > 21){
-            Bust(&playerState[*currentPlayer], &playerMoney[*currentPlayer], betMoney);
-        } else BlackJack(&playerState[*currentPlayer]);
+    // an automatic policy plays one move per step
+    if (options->policy != POLICY_HUMAN && !engine->gameHasEnded){
+        engine->gameHasEnded = PolicyMove(table, options->policy, options->betMoney);
+    }
 
-        nextPlayer = WhosNext(playerState, *currentPlayer);
+    if (engine->gameHasEnded && !engine->houseHasPlayed){
+        table->currentPlayer = -1; // no red rectangle around any player
 
-        // end the game if there is no other player to play
-        if (nextPlayer == -1){
-            return true;
-        } else {
-            *currentPlayer = nextPlayer;
-            return false;
+        HouseTurn(table->cardStack, &table->stackTopCard, table->numOfDecks, &table->shoe, 
+            table->houseCards, &table->posHouseHand, &table->houseScore, 
+            table->posPlayerHand, table->playerScore, table->playerMoney, 
+            table->playerBet, &table->seats, table->playerStats, 
+            options->betMoney, options->startPlayerMoney, &table->rules);
+
+        engine->houseHasPlayed = true;
+        table->roundsPlayed++;
+        if (engine->snapshot != NULL) PublishSnapshot(engine->snapshot, table, NULL);
+        if (options->rounds != 0 && table->roundsPlayed >= options->rounds){
+            engine->finished = true;
         }
 
-    } else {
-        return false;
+    } else if (engine->gameHasEnded && options->policy != POLICY_HUMAN && 
+            !AllPlayersBroke(&table->seats)){
+        // an automatic policy doesn't wait for 'n' to deal the next round
+        engine->houseHasPlayed = false;
+        engine->gameHasEnded = NewGame(table->cardStack, &table->stackTopCard, 
+            table->numOfDecks, &table->shoe, table->playerCards, table->posPlayerHand, 
+            &table->currentPlayer, table->playerScore, &table->seats, 
+            table->houseCards, &table->posHouseHand);
     }
 }
 
 /**
- * @brief      "Stand" function. Passes the turn to next valid player
+ * @brief         Publishes the state of the table as the latest frame
  *
- * @param      playerState    ptr to array with players current state
- * @param      currentPlayer  ptr to player currently playing
+ * @param[in,out] engine  ptr to the engine
  *
- * @return     true if the game is over, false otherwise
+ * Copies the table to the back frame and swaps it with the middle one. The
+ * renderer only draws the front frame, so it never sees a frame being
+ * written, and neither thread waits for the other.
  */
-bool Stand(int playerState[], int * currentPlayer){
-    int nextPlayer;
-
-    nextPlayer = WhosNext(playerState, *currentPlayer);
-
-    // end the game if there is no other player to play
-    if (nextPlayer == -1){
-            return true;
-        } else {
-            *currentPlayer = nextPlayer;
-            return false;
-        }
+void PublishFrame(Engine * engine){
+    EngineFrame * frame = &engine->frames[engine->back];
+
+    memcpy(&frame->table, engine->table, sizeof(Table));
+    frame->gameHasEnded = engine->gameHasEnded;
+    frame->finished = engine->finished;
+    engine->back = __atomic_exchange_n(&engine->middle, 
+        engine->back | ENGINE_FRAME_FRESH, __ATOMIC_ACQ_REL) & ~ENGINE_FRAME_FRESH;
 }
 
-
 /**
- * @brief      Marks a player as busted and deducts the bet money from his money
+ * @brief         Takes the latest frame published by the engine, by the
+ *                renderer
  *
- * @param[out] playerState  ptr to player's current state
- * @param[out] playerMoney  ptr to player's money
- * @param[in]  betMoney     bet money game parameter
+ * @param[in,out] engine  ptr to the engine
+ *
+ * @return        ptr to the frame to draw, the previous one if the engine
+ *                published nothing new
  */
-void Bust(int * playerState, int * playerMoney, int betMoney){
-    *playerState = BUSTED;
-    *playerMoney -= betMoney;
+EngineFrame * LatestFrame(Engine * engine){
+    if (__atomic_load_n(&engine->middle, __ATOMIC_RELAXED) & ENGINE_FRAME_FRESH){
+        engine->front = __atomic_exchange_n(&engine->middle, engine->front, 
+            __ATOMIC_ACQ_REL) & ~ENGINE_FRAME_FRESH;
+    }
+    return &engine->frames[engine->front];
 }
 
+
+
+
+/****************************************************************************
+ *                                                                          *
+ *                         INPUT RECORDER FUNCTIONS                         *
+ *                                                                          *
+ ****************************************************************************/
+
 /**
- * @brief      Marks a player has having a blackjack
+ * @brief      Finds how many keys a replay can read at most
+ *
+ * @param[in]  options  ptr to the game options (mode and path)
+ *
+ * @return     keys that fit in the size of the file, 0 if it isn't replayed
  *
- * @param[out]      playerState  ptr to player's current state
+ * Sizes the room of the replay in the game arena before the file is read.
  */
-void BlackJack(int * playerState){
-    *playerState = BLACKJACK;
-}
+int MaxInputEvents(GameOptions * options){
+    struct stat info;
 
+    if (options->inputMode != INPUT_REPLAY || stat(options->inputPath, &info) == -1){
+        return 0;
+    }
+    return (int) (info.st_size / MIN_INPUT_LINE) + 1;
+}
 
 /**
- * @brief      Picks the next valid player and flags if there
- *             is no player left to play
+ * @brief      Opens a recording of keys to write it or to replay it
  *
- * @param[in]  playerState    ptr to array with players still in play
- * @param[in]  currentPlayer  ptr to array with players current state
+ * @param[out] inputLog  ptr to the input recording
+ * @param[in]  options   ptr to the game options (mode, path and replays)
+ * @param[in]  arena     ptr to the game arena, where the keys of a replay go
  *
- * @return     number of the next player if there is a valid player, -1 if there
- *             is no valid player left
+ * The recording is a text file with a line per key: "step ticks key", where
+ * key is the SDL key code. A replay reads the whole file at the start, into
+ * room for MaxInputEvents keys.
  */
-int WhosNext(int playerState[], int currentPlayer){
+void OpenInputLog(InputLog * inputLog, GameOptions * options, Arena * arena){
+    InputEvent event;
+    int capacity = MaxInputEvents(options);
+
+    memset(inputLog, 0, sizeof(InputLog));
+    inputLog->mode = options->inputMode;
+    inputLog->replays = options->replays;
+    inputLog->startTicks = SDL_GetTicks();
+
+    inputLog->file = fopen(options->inputPath, 
+        options->inputMode == INPUT_RECORD ? "w" : "r");
+    if (inputLog->file == NULL){
+        printf("Couldn't open the input file %s: %s\n", options->inputPath, 
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (options->inputMode == INPUT_RECORD) return;
 
-    for (int i = currentPlayer; i < MAX_PLAYERS; i++){
-        if (i == MAX_PLAYERS - 1){
-            return (-1); // no player left to play
-        } else if (playerState[i + 1] == NORMAL){
-            return (i + 1); // next player
+    inputLog->events = ArenaAlloc(arena, capacity * sizeof(InputEvent));
+    while (fscanf(inputLog->file, "%d %u %d", &event.frame, &event.ticks, 
+            &event.key) == 3){
+        if (inputLog->numEvents == capacity){
+            printf("The input file %s grew while it was read\n", options->inputPath);
+            exit(EXIT_FAILURE);
         }
+        inputLog->events[inputLog->numEvents++] = event;
+    }
+    if (!feof(inputLog->file)){
+        printf("Invalid line in the input file %s\n", options->inputPath);
+        exit(EXIT_FAILURE);
     }
-    return 0; // (just suppressing a compiler warning)
+    fclose(inputLog->file);
+    inputLog->file = NULL;
 }
 
 /**
- * @brief         Handles house mechanics, bet collecting and stats updating
+ * @brief         Writes a key pressed in the window to the recording
  *
- * @param[in]     cardStack         ptr to the card stack array
- * @param[in,out] stackTopCard      ptr to the index of the top card in the
- *                                  stack
- * @param[in]     numOfDecks        number of decks used
- * @param[in,out] houseCards        ptr to array with house cards
- * @param[in,out] posHouseHand      ptr to the number of cards in house hand
- * @param[in,out] houseScore        ptr to house score
- * @param[in]     posPlayerHand     ptr to array with players numbers of cards
- *                                  in hand
- * @param[in]     playerScore       ptr to array with each player's score
- * @param[in,out] playerMoney       ptr to array with each player's money
- * @param[in,out] playerState       ptr to array with each player's state
- * @param[out]    playerStats       ptr to array with each player's stats
- * @param[in]     betMoney          bet money game parameter
- * @param[in]     startPlayerMoney  starting player money game parameter
+ * @param[in,out] inputLog  ptr to the input recording
+ * @param[in]     frame     number of the next step of the game
+ * @param[in]     event     ptr to the SDL_KEYDOWN event
+ */
+void RecordInput(InputLog * inputLog, int frame, SDL_Event * event){
+    fprintf(inputLog->file, "%d %u %d\n", frame, SDL_GetTicks() - inputLog->startTicks, 
+        (int) event->key.keysym.sym);
+}
+
+/**
+ * @brief         Pushes the recorded keys of a step to the SDL event queue
+ *
+ * @param[in,out] inputLog  ptr to the input recording
+ * @param[in]     frame     number of the step about to be queued
  *
- * Hands cards to the house until it has 17 points (no soft hand). Determines if
- * a player won, won with a two card blackjack, drawn, loss or busted, manages
- * players money and updates stats accordingly. Determines if a player is broken
- * and updates his state if he is.
+ * @return        false when every replay is over, true otherwise
+ *
+ * Keys are queued before the step they were followed by when recorded, so
+ * the engine plays the same moves between the same keys. A replay queues a
+ * step every frame. Each replay starts in the step after the last key of the
+ * previous one. 'q' is only replayed the last time.
  */
-void HouseTurn(
-        int cardStack[], int * stackTopCard, int numOfDecks, 
-        int houseCards[], int * posHouseHand, int * houseScore, 
-        int posPlayerHand[], int playerScore[], int playerMoney[], 
-        int playerState[], int playerStats[MAX_PLAYERS][STATS], 
-        int betMoney, int startPlayerMoney)
-{
-    bool houseFinished = false;
-    bool houseBusted = false;
-
-
-    // take cards till more than 17 points and no soft hand
-    while(!houseFinished){
-        *houseScore = CountScore(houseCards, *posHouseHand);
-        if (*houseScore > 21){
-            houseFinished = true;
-            houseBusted = true;
-
-        } else if (*houseScore > 17 && *houseScore <= 21){
-            houseFinished = true;
-
-        } else if (*houseScore == 17) {
-            // check for soft hand (at least one ace)
-            for (int i = 0; i < *posHouseHand; i ++){
-                if (houseCards[i] % 13 == 12){
-                    // nothing happens
-                } else {
-                    houseFinished = true;
-                }
+bool ReplayInput(InputLog * inputLog, int frame){
+    inputLog->frameStart = Now();
+
+    while (inputLog->replay < inputLog->replays){
+        InputEvent * recorded;
+        SDL_Event event;
+
+        if (inputLog->next == inputLog->numEvents){
+            // the next replay starts after the last key of this one
+            if (inputLog->numEvents > 0){
+                inputLog->frameOffset += inputLog->events[inputLog->numEvents - 1].frame + 1;
             }
+            inputLog->next = 0;
+            inputLog->replay++;
+            continue;
         }
 
-        if (!houseFinished) 
-            DrawCard(cardStack, stackTopCard, numOfDecks, houseCards, 
-                posHouseHand);
+        recorded = &inputLog->events[inputLog->next];
+        if (recorded->frame + inputLog->frameOffset > frame) return true;
+        inputLog->next++;
+
+        if (recorded->key == SDLK_q && inputLog->replay < inputLog->replays - 1) continue;
+
+        memset(&event, 0, sizeof(event));
+        event.type = SDL_KEYDOWN;
+        event.key.state = SDL_PRESSED;
+        event.key.keysym.sym = recorded->key;
+        SDL_PushEvent(&event);
     }
+    return false;
+}
 
-    // check win, loss or draw (only for players not broke) and manage money
-    for (int i = 0; i < MAX_PLAYERS; i++){
-        if (playerState[i] != BROKE){
-
-                
-            if (playerScore[i] > 21) { // busted
-                playerStats[i][LOSSES] += 1;
-                // bet money took already when busted
-                
-            } else if (playerScore[i] == 21 && posPlayerHand[i] == 2 && *houseScore != 21) { //blackjack
-                playerMoney[i] += 1.5f * betMoney;
-                playerStats[i][WINS] += 1;
-
-            } else if (playerScore[i] > *houseScore || houseBusted) { // won
-                playerMoney[i] += betMoney;
-                playerStats[i][WINS] += 1;
-               
-            } else if (playerScore[i] < *houseScore) { // lost
-                playerMoney[i] -= betMoney;
-                playerStats[i][LOSSES] += 1;
-
-            } else { // draw
-                playerStats[i][DRAWS] += 1;
-                
-            }
+/**
+ * @brief         Adds the time of the frame that just ended to the replay
+ *                statistics
+ *
+ * @param[in,out] inputLog  ptr to the input recording
+ */
+void FinishReplayFrame(InputLog * inputLog){
+    double seconds = Now() - inputLog->frameStart;
 
-            // check if the player is broke
-            if (playerMoney[i] < betMoney){
-                playerState[i] = BROKE;
-            } else {
-                // retain last state
-            }
+    inputLog->frames++;
+    inputLog->frameSeconds += seconds;
+    if (seconds > inputLog->maxFrameSeconds) inputLog->maxFrameSeconds = seconds;
+}
 
-            // calculate money house won or lost with each player
-            playerStats[i][BALANCE] = startPlayerMoney - playerMoney[i];
-        }
-        
+/**
+ * @brief         Closes a recording, printing the statistics of a replay
+ *
+ * @param[in,out] inputLog  ptr to the input recording
+ *
+ * A replay prints its frames, the mean and worst frame time and the peak
+ * memory used by the process, to check the game doesn't slow down or leak
+ * over long sessions.
+ */
+void CloseInputLog(InputLog * inputLog){
+    struct rusage usage;
+
+    if (inputLog->mode == INPUT_RECORD){
+        fclose(inputLog->file);
+        return;
     }
 
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Replayed %d keys %d times: %lld frames in %.3f s, "
+        "frame time mean %.1f us, max %.1f us, max RSS %ld kB\n", 
+        inputLog->numEvents, inputLog->replays, inputLog->frames, 
+        inputLog->frameSeconds, 
+        inputLog->frames ? 1e6 * inputLog->frameSeconds / inputLog->frames : 0.0, 
+        1e6 * inputLog->maxFrameSeconds, usage.ru_maxrss);
 }
 
 
 
 
-
 /****************************************************************************
  *                                                                          *
  *                      GRAPHICAL INTERFACE FUNCTIONS                       *
@@ -862,48 +7923,86 @@ void HouseTurn(
   * @brief      Renders a rectangle with the words "BUST" or "BLACKJACK" if a
   *             player is busted or has a blackjack
   *
-  * @param[in]  playerState  ptr to array with each player state
+  * @param[in]  seats        ptr to the player states
+  * @param[in]  layout       ptr to the layout table of the window
   *
   * Renders a red rectangle saying "!BUST!" if a player as busted and a green
   * rectangle saying "BLACKJACK" if a player has a blackjack
   */
-void RenderBustBlackjack(TTF_Font *_font, SDL_Renderer* _renderer, int playerState[]){
+void RenderBustBlackjack(TTF_Font *_font, SDL_Renderer* _renderer, const SeatStates * seats, 
+    const Layout * layout){
+    TRACE_SCOPE("RenderBustBlackjack");
     SDL_Color white = {255, 255, 255};
 
-    int separatorPos = (int)(0.95f*WIDTH_WINDOW);
-    SDL_Rect rect;
-
-    for ( int i = 0; i < MAX_PLAYERS; i++)
+    for ( int i = 0; i < WINDOW_SEATS; i++)
     {
 
-        if (playerState[i] == BUSTED){
-            
-            rect.x = (i*(separatorPos/4-5)+10) + (separatorPos/4-5)*0.2;
-            rect.y = (int) (0.55f*HEIGHT_WINDOW) + (int) (0.42f*HEIGHT_WINDOW)*0.4;
-            rect.w = (separatorPos/4-5)*0.6;
-            rect.h = (int) (0.42f*HEIGHT_WINDOW) * 0.2;
+        if (SeatState(seats, i) == BUSTED){
 
             SDL_SetRenderDrawColor(_renderer, 255, 0, 0, 255 );
-            SDL_RenderFillRect(_renderer, &rect);
-
-            RenderText(rect.x + rect.w/3.5, rect.y + rect.h/5, "!BUST!", _font, &white, _renderer);
+            SDL_RenderFillRect(_renderer, &layout->banners[i]);
 
-        } else if (playerState[i] == BLACKJACK){
+            RenderText(layout->bustText[i].x, layout->bustText[i].y, "!BUST!", _font, 
+                &white, _renderer);
 
-            rect.x = (i*(separatorPos/4-5)+10) + (separatorPos/4-5)*0.2;
-            rect.y = (int) (0.55f*HEIGHT_WINDOW) + (int) (0.42f*HEIGHT_WINDOW)*0.4;
-            rect.w = (separatorPos/4-5)*0.6;
-            rect.h = (int) (0.42f*HEIGHT_WINDOW) * 0.2;
+        } else if (SeatState(seats, i) == BLACKJACK){
 
             SDL_SetRenderDrawColor(_renderer, 0, 255, 0, 255 );
-            SDL_RenderFillRect(_renderer, &rect);
+            SDL_RenderFillRect(_renderer, &layout->banners[i]);
 
-            RenderText(rect.x + rect.w/8, rect.y + rect.h/5, "BLACKJACK", _font, &white, _renderer);
+            RenderText(layout->blackjackText[i].x, layout->blackjackText[i].y, "BLACKJACK", 
+                _font, &white, _renderer);
         }
         
     }
 }
 
+/**
+ * @brief      Renders the expected values of hitting and standing for the
+ *             current player
+ *
+ * @param[in]  evCache    ptr to the expected value cache
+ * @param[in]  _font      TTF font used to render the text
+ * @param[in]  _renderer  renderer to handle all rendering in a window
+ * @param[in]  layout     ptr to the layout table of the window
+ *
+ * The panel is drawn in the right part of the window, at the height of the
+ * player areas.
+ */
+void RenderEvPanel(EvCache * evCache, TTF_Font *_font, SDL_Renderer* _renderer, 
+    const Layout * layout){
+    TRACE_SCOPE("RenderEvPanel");
+    SDL_Color black = { 0, 0, 0 };
+    char ev_str[STRING_SIZE];
+    int x = layout->textX;
+    int y = layout->evPanelY;
+    bool isValid;
+    double evHit, evStand;
+    int player;
+
+    pthread_mutex_lock(&evCache->lock);
+    isValid = evCache->isValid;
+    evHit = evCache->evHit;
+    evStand = evCache->evStand;
+    player = evCache->player;
+    pthread_mutex_unlock(&evCache->lock);
+
+    if (player < 0) return;
+
+    y += RenderText(x, y, playerNames[player], _font, &black, _renderer);
+
+    if (!isValid){
+        RenderText(x, y, "Computing EV...", _font, &black, _renderer);
+        return;
+    }
+
+    sprintf(ev_str, "Hit EV: %+.3f", evHit);
+    y += RenderText(x, y, ev_str, _font, &black, _renderer);
+
+    sprintf(ev_str, "Stand EV: %+.3f", evStand);
+    RenderText(x, y, ev_str, _font, &black, _renderer);
+}
+
 /**
  * RenderTable: Draws the table where the game will be played, namely:
  * -  some texture for the background
@@ -911,20 +8010,20 @@ void RenderBustBlackjack(TTF_Font *_font, SDL_Renderer* _renderer, int playerSta
  * -  squares to define the playing positions of each player
  * -  names and the available money for each player
  * \param _money amount of money of each player
- * \param _img surfaces where the table background and IST logo were loaded
+ * \param _img textures of the images, with the table background and IST logo
  * \param _renderer renderer to handle all rendering in a window
+ * \param layout layout table of the window
  */
-void RenderTable(int _money[], TTF_Font *_font, SDL_Surface *_img[], 
-    SDL_Renderer* _renderer, int currentPlayer)
+void RenderTable(int _money[], TTF_Font *_font, SDL_Texture *_img[], 
+    SDL_Renderer* _renderer, int currentPlayer, const Layout * layout)
 {
+    TRACE_SCOPE("RenderTable");
     SDL_Color black = { 0, 0, 0 }; // black
     SDL_Color white = { 255, 255, 255 }; // white
     
     char name_money_str[STRING_SIZE];
-    SDL_Texture *table_texture;
-    SDL_Rect tableSrc, tableDest, playerRect;
-    int separatorPos = (int)(0.95f*WIDTH_WINDOW); // seperates the left from the right part of the window
     int height;
+    double profileStart = ProfileStart();
    
     // set color of renderer to some color
     SDL_SetRenderDrawColor( _renderer, 255, 255, 255, 255 );
@@ -932,49 +8031,35 @@ void RenderTable(int _money[], TTF_Font *_font, SDL_Surface *_img[],
     // clear the window
     SDL_RenderClear( _renderer );
 
-    tableDest.x = tableSrc.x = 0;
-    tableDest.y = tableSrc.y = 0;
-    tableSrc.w = _img[0]->w;
-    tableSrc.h = _img[0]->h;
-
-    tableDest.w = separatorPos;
-    tableDest.h = HEIGHT_WINDOW;
-
-    table_texture = SDL_CreateTextureFromSurface(_renderer, _img[0]);
-    SDL_RenderCopy(_renderer, table_texture, &tableSrc, &tableDest);
+    // the whole background image is stretched over the table
+    SDL_RenderCopy(_renderer, _img[IMAGE_TABLE], NULL, &layout->table);
    
     // render the IST Logo
-    height = RenderLogo(separatorPos, 0, _img[1], _renderer);
+    height = RenderLogo(&layout->logo, _img[IMAGE_LOGO], _renderer);
     
     // render the student name
-    height += RenderText(separatorPos+3*MARGIN, height, myName, _font, &black, _renderer);
+    height += RenderText(layout->textX, height, myName, _font, &black, _renderer);
     
     // this renders the student number
-    RenderText(separatorPos+3*MARGIN, height, myNumber, _font, &black, _renderer);
+    RenderText(layout->textX, height, myNumber, _font, &black, _renderer);
     
     
 
     // renders the areas for each player: names and money too !
-    for ( int i = 0; i < MAX_PLAYERS; i++)
+    for ( int i = 0; i < WINDOW_SEATS; i++)
     {
-        
-        playerRect.x = i*(separatorPos/4-5)+10;
-        playerRect.y = (int) (0.55f*HEIGHT_WINDOW);
-        playerRect.w = separatorPos/4-5;
-        playerRect.h = (int) (0.42f*HEIGHT_WINDOW);
-
         // draw a rectangle in the current player area
 	    if(i == currentPlayer){
             SDL_SetRenderDrawColor(_renderer, 255, 255, 255, 255 );
-            SDL_RenderDrawRect(_renderer, &playerRect);
+            SDL_RenderDrawRect(_renderer, &layout->seats[i]);
         } 
 
         sprintf(name_money_str,"%s -- %d euros", playerNames[i], _money[i]);
-        RenderText(playerRect.x+20, playerRect.y-30, name_money_str, _font, &white, _renderer);
+        RenderText(layout->seatLabels[i].x, layout->seatLabels[i].y, name_money_str, 
+            _font, &white, _renderer);
     }
     
-    // destroy everything
-    SDL_DestroyTexture(table_texture);
+    ProfileStop(PROFILE_RENDER_TABLE, profileStart);
 }
 
 
@@ -985,31 +8070,29 @@ void RenderTable(int _money[], TTF_Font *_font, SDL_Surface *_img[],
  * @param      _house           vector with the house cards
  * @param      _pos_house_hand  position of the vector _house with valid card
  *                              IDs
- * @param      _cards           vector with all loaded card images
+ * @param      _cards           vector with all card textures
  * @param      _renderer        renderer to handle all rendering in a window
  * @param[in]  gameHasEnded     flag to know if it is time for the house to play
+ * @param[in]  layout           layout table of the window
  */
-void RenderHouseCards(int _house[], int _pos_house_hand, SDL_Surface **_cards, 
-    SDL_Renderer* _renderer, bool gameHasEnded)
+void RenderHouseCards(card_t _house[], int _pos_house_hand, SDL_Texture **_cards, 
+    SDL_Renderer* _renderer, bool gameHasEnded, const Layout * layout)
 {
-    int card, x, y;
-    int div = WIDTH_WINDOW/CARD_WIDTH;
+    TRACE_SCOPE("RenderHouseCards");
+    int card;
 
-    // drawing all house cards
+    // drawing all house cards, centered for the number of cards in the hand
     for ( card = 0; card < _pos_house_hand; card++)
     {
         // players still playing ? draw a card face down
         if (card == 0 && !gameHasEnded)
         {
-            x = (div/2-_pos_house_hand/2+card)*CARD_WIDTH + 15;
-            y = (int) (0.26f*HEIGHT_WINDOW);
-            RenderCard(x, y, DECK_SIZE, _cards, _renderer);
+            RenderCard(&layout->houseCards[_pos_house_hand][card], DECK_SIZE, _cards, 
+                _renderer);
         } else {
-            // calculate its position
-            x = (div/2-_pos_house_hand/2+card)*CARD_WIDTH + 15;
-            y = (int) (0.26f*HEIGHT_WINDOW);
             // render it !
-            RenderCard(x, y, _house[card], _cards, _renderer);
+            RenderCard(&layout->houseCards[_pos_house_hand][card], _house[card], _cards, 
+                _renderer);
         }
         
     }
@@ -1021,55 +8104,44 @@ void RenderHouseCards(int _house[], int _pos_house_hand, SDL_Surface **_cards,
  * RenderPlayerCards: Renders the hand, i.e. the cards, for each player
  * \param _player_cards 2D array with the player cards, 1st dimension is the player ID
  * \param _pos_player_hand array with the positions of the valid card IDs for each player
- * \param _cards vector with all loaded card images
+ * \param _cards vector with all card textures
  * \param _renderer renderer to handle all rendering in a window
+ * \param layout layout table of the window
  */
-void RenderPlayerCards(int _player_cards[][MAX_CARD_HAND], int _pos_player_hand[], SDL_Surface **_cards, SDL_Renderer* _renderer)
+void RenderPlayerCards(card_t _player_cards[][MAX_CARD_HAND], int _pos_player_hand[], 
+    SDL_Texture **_cards, SDL_Renderer* _renderer, const Layout * layout)
 {
-    int pos, x, y, num_player, card;
+    TRACE_SCOPE("RenderPlayerCards");
+    int num_player, card;
 
     // for every card of every player
-    for ( num_player = 0; num_player < MAX_PLAYERS; num_player++)
+    for ( num_player = 0; num_player < WINDOW_SEATS; num_player++)
     {
         for ( card = 0; card < _pos_player_hand[num_player]; card++)
         {
-            // draw all cards of the player: calculate its position: only 4 positions are available !
-            pos = card % 4;
-            x = (int) num_player*((0.95f*WIDTH_WINDOW)/4-5)+(card/4)*12+15;
-            y = (int) (0.55f*HEIGHT_WINDOW)+10;
-            if ( pos == 1 || pos == 3) x += CARD_WIDTH + 30;
-            if ( pos == 2 || pos == 3) y += CARD_HEIGHT+ 10;
             // render it !
-            RenderCard(x, y, _player_cards[num_player][card], _cards, _renderer);
+            RenderCard(&layout->playerCards[num_player][card], 
+                _player_cards[num_player][card], _cards, _renderer);
         }        
     }
 }
 
 /**
  * RenderCard: Draws one card at a certain position of the window, based on the card code
- * \param _x X coordinate of the card position in the window
- * \param _y Y coordinate of the card position in the window
+ * \param _boardPos area of the window occupied by the card
  * \param _num_card card code that identifies each card
- * \param _cards vector with all loaded card images
+ * \param _cards vector with all card textures
  * \param _renderer renderer to handle all rendering in a window
  */
-void RenderCard(int _x, int _y, int _num_card, SDL_Surface **_cards, SDL_Renderer* _renderer)
+void RenderCard(const SDL_Rect *_boardPos, int _num_card, SDL_Texture **_cards, 
+    SDL_Renderer* _renderer)
 {
-    SDL_Texture *card_text;
-    SDL_Rect boardPos;
-
-    // area that will be occupied by each card
-    boardPos.x = _x;
-    boardPos.y = _y;
-    boardPos.w = CARD_WIDTH;
-    boardPos.h = CARD_HEIGHT;
+    TRACE_SCOPE("RenderCard");
+    double profileStart = ProfileStart();
 
     // render it !
-    card_text = SDL_CreateTextureFromSurface(_renderer, _cards[_num_card]);
-    SDL_RenderCopy(_renderer, card_text, NULL, &boardPos);
-    
-    // destroy everything
-    SDL_DestroyTexture(card_text);
+    SDL_RenderCopy(_renderer, _cards[_num_card], NULL, _boardPos);
+    ProfileStop(PROFILE_RENDER_CARD, profileStart);
 }
 
 /**
@@ -1118,31 +8190,113 @@ void UnLoadCards(SDL_Surface **_array_of_cards)
     }
 }
 
+/**
+ * LoadImages: Loads the table background and the IST logo
+ * \param _img images, filled at IMAGE_TABLE and IMAGE_LOGO
+ */
+void LoadImages(SDL_Surface **_img)
+{
+    // load the table texture
+    _img[IMAGE_TABLE] = IMG_Load("table_texture.png");
+    if (_img[IMAGE_TABLE] == NULL)
+    {
+        printf("Unable to load image: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    
+    // load IST logo
+    _img[IMAGE_LOGO] = SDL_LoadBMP("ist_logo.bmp");
+    if (_img[IMAGE_LOGO] == NULL)
+    {
+        printf("Unable to load bitmap: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * UploadImages: Creates the texture of every image, drawn in every frame
+ * instead of uploading the image again. In low memory mode the surfaces are
+ * freed afterwards and the memory they used is given back to the system.
+ * \param images images of the window, all loaded
+ * \param _renderer renderer to handle all rendering in a window
+ * \param lowMemory true frees the surfaces once they are textures
+ */
+void UploadImages(Images *images, SDL_Renderer *_renderer, bool lowMemory)
+{
+    for (int i = 0; i < NUM_IMAGES; i++)
+    {
+        images->textures[i] = SDL_CreateTextureFromSurface(_renderer, images->surfaces[i]);
+        if (images->textures[i] == NULL)
+        {
+            printf("Unable to create texture: %s\n", SDL_GetError());
+            exit(EXIT_FAILURE);
+        }
+        TRACE_COUNT(TRACE_TEXTURES, 1);
+    }
+
+    if (lowMemory)
+    {
+        for (int i = 0; i < NUM_IMAGES; i++)
+        {
+            SDL_FreeSurface(images->surfaces[i]);
+            images->surfaces[i] = NULL;
+        }
+        // the freed pixels would otherwise stay in the heap of the process
+        malloc_trim(0);
+    }
+}
+
+/**
+ * ReloadImages: Creates the textures again once the renderer lost them,
+ * loading the images from their files again if their surfaces were freed
+ * \param images images of the window
+ * \param _renderer renderer to handle all rendering in a window
+ * \param lowMemory true frees the surfaces once they are textures
+ */
+void ReloadImages(Images *images, SDL_Renderer *_renderer, bool lowMemory)
+{
+    for (int i = 0; i < NUM_IMAGES; i++)
+    {
+        SDL_DestroyTexture(images->textures[i]);
+        images->textures[i] = NULL;
+    }
+    if (images->surfaces[IMAGE_TABLE] == NULL)
+    {
+        LoadCards(images->surfaces);
+        LoadImages(images->surfaces);
+    }
+    UploadImages(images, _renderer, lowMemory);
+}
+
+/**
+ * UnLoadImages: Frees the surfaces still loaded and the textures of the images
+ * \param images images of the window
+ */
+void UnLoadImages(Images *images)
+{
+    UnLoadCards(images->surfaces);
+    SDL_FreeSurface(images->surfaces[IMAGE_TABLE]);
+    SDL_FreeSurface(images->surfaces[IMAGE_LOGO]);
+    for (int i = 0; i < NUM_IMAGES; i++)
+    {
+        SDL_DestroyTexture(images->textures[i]);
+    }
+}
+
 /**
  * RenderLogo function: Renders the IST Logo on the window screen
- * \param x X coordinate of the Logo
- * \param y Y coordinate of the Logo
- * \param _logoIST surface with the IST logo image to render
+ * \param _boardPos area of the window occupied by the Logo
+ * \param _logoIST texture with the IST logo image to render
  * \param _renderer renderer to handle all rendering in a window
+ * \return height of the Logo in the window
  */
-int RenderLogo(int x, int y, SDL_Surface *_logoIST, SDL_Renderer* _renderer)
+int RenderLogo(const SDL_Rect *_boardPos, SDL_Texture *_logoIST, SDL_Renderer* _renderer)
 {
-    SDL_Texture *text_IST;
-    SDL_Rect boardPos;
-    
-    // space occupied by the logo
-    boardPos.x = x;
-    boardPos.y = y;
-    boardPos.w = _logoIST->w;
-    boardPos.h = _logoIST->h;
+    TRACE_SCOPE("RenderLogo");
 
     // render it 
-    text_IST = SDL_CreateTextureFromSurface(_renderer, _logoIST);
-    SDL_RenderCopy(_renderer, text_IST, NULL, &boardPos);
-
-    // destroy associated texture !
-    SDL_DestroyTexture(text_IST);
-    return _logoIST->h;
+    SDL_RenderCopy(_renderer, _logoIST, NULL, _boardPos);
+    return _boardPos->h;
 }
 
 /**
@@ -1155,9 +8309,11 @@ int RenderLogo(int x, int y, SDL_Surface *_logoIST, SDL_Renderer* _renderer)
  */
 int RenderText(int x, int y, const char *text, TTF_Font *_font, SDL_Color *_color, SDL_Renderer* _renderer)
 {
+    TRACE_SCOPE("RenderText");
     SDL_Surface *text_surface;
     SDL_Texture *text_texture;
     SDL_Rect solidRect;
+    double profileStart = ProfileStart();
 
     solidRect.x = x;
     solidRect.y = y;
@@ -1168,8 +8324,10 @@ int RenderText(int x, int y, const char *text, TTF_Font *_font, SDL_Color *_colo
         printf("TTF_RenderText_Blended: %s\n", TTF_GetError());
         exit(EXIT_FAILURE);
     }
+    TRACE_COUNT(TRACE_TEXT_SURFACES, 1);
     // create texture
     text_texture = SDL_CreateTextureFromSurface(_renderer, text_surface);
+    TRACE_COUNT(TRACE_TEXTURES, 1);
     // obtain size
     SDL_QueryTexture( text_texture, NULL, NULL, &solidRect.w, &solidRect.h );
     // render it !
@@ -1177,16 +8335,58 @@ int RenderText(int x, int y, const char *text, TTF_Font *_font, SDL_Color *_colo
 
     SDL_DestroyTexture(text_texture);
     SDL_FreeSurface(text_surface);
+    ProfileStop(PROFILE_RENDER_TEXT, profileStart);
     return solidRect.h;
 }
 
+/**
+ * ProfileStart: Starts timing a render function
+ * \return the current time, or 0 if the render benchmark isn't running
+ */
+double ProfileStart(void)
+{
+    return renderProfile.enabled ? Now() : 0;
+}
+
+/**
+ * ProfileStop: Adds the time since ProfileStart to a render function
+ * \param entry PROFILE_FRAME or the PROFILE_RENDER_ entry of the function
+ * \param start time returned by ProfileStart
+ */
+void ProfileStop(int entry, double start)
+{
+    if (!renderProfile.enabled) return;
+    renderProfile.calls[entry]++;
+    renderProfile.seconds[entry] += Now() - start;
+}
+
+/**
+ * PrintRenderProfile: Prints the results of the render benchmark
+ * \param frames number of frames rendered
+ * \param seconds time taken by all the frames
+ */
+void PrintRenderProfile(int frames, double seconds)
+{
+    printf("%d frames in %.3f s: %.1f frames/s\n", frames, seconds, frames / seconds);
+    printf("Function \t Calls \t Calls/frame \t us/call \t us/frame \t %% of frame\n");
+    for (int i = 0; i < NUM_PROFILED; i++)
+    {
+        long long calls = renderProfile.calls[i];
+        double time = renderProfile.seconds[i];
+
+        printf("%-12s \t %lld \t %.1f \t %.2f \t %.2f \t %.1f%%\n", profileNames[i], 
+            calls, (double) calls / frames, calls ? 1e6 * time / calls : 0.0, 
+            1e6 * time / frames, 100.0 * time / renderProfile.seconds[PROFILE_FRAME]);
+    }
+}
+
 
 
 /**
  * InitEverything: Initializes the SDL2 library and all graphical components: font, window, renderer
  * \param width width in px of the window
  * \param height height in px of the window
- * \param _img surface to be created with the table background and IST logo
+ * \param _img images, where the table background and IST logo are loaded
  * \param _window represents the window of the application
  * \param _renderer renderer to handle all rendering in a window
  */
@@ -1197,28 +8397,10 @@ void InitEverything(int width, int height, TTF_Font **_font, SDL_Surface *_img[]
     *_window = CreateWindow(width, height);
     *_renderer = CreateRenderer(width, height, *_window);
     
-    // load the table texture
-    _img[0] = IMG_Load("table_texture.png");
-    if (_img[0] == NULL)
-    {
-        printf("Unable to load image: %s\n", SDL_GetError());
-        exit(EXIT_FAILURE);
-    }
-    
-    // load IST logo
-    _img[1] = SDL_LoadBMP("ist_logo.bmp");
-    if (_img[1] == NULL)
-    {
-        printf("Unable to load bitmap: %s\n", SDL_GetError());
-        exit(EXIT_FAILURE);
-    }
+    // load the table texture and IST logo
+    LoadImages(_img);
     // this opens (loads) a font file and sets a size
-    *_font = TTF_OpenFont("FreeSerif.ttf", 16);
-    if(!*_font)
-    {
-        printf("TTF_OpenFont: %s\n", TTF_GetError());
-        exit(EXIT_FAILURE);
-    }
+    *_font = LoadFont(FONT_SIZE);
 }
 
 /**
@@ -1248,7 +8430,26 @@ void InitFont()
 }
 
 /**
- * CreateWindow: Creates a window for the application
+ * LoadFont: Opens the font used in the window
+ * \param size size of the font in pixels
+ * \return pointer to the font opened
+ */
+TTF_Font * LoadFont(int size)
+{
+    TTF_Font *font;
+
+    font = TTF_OpenFont(FONT_FILE, size);
+    if(!font)
+    {
+        printf("TTF_OpenFont: %s\n", TTF_GetError());
+        exit(EXIT_FAILURE);
+    }
+    return font;
+}
+
+/**
+ * CreateWindow: Creates a window for the application. It can be resized and,
+ * on HiDPI displays, has a drawable area with more pixels than its size.
  * \param width width in px of the window
  * \param height height in px of the window
  * \return pointer to the window created
@@ -1257,7 +8458,8 @@ SDL_Window* CreateWindow(int width, int height)
 {
     SDL_Window *window;
     // init window
-    window = SDL_CreateWindow( "BlackJack", WINDOW_POSX, WINDOW_POSY, width+EXTRASPACE, height, 0 );
+    window = SDL_CreateWindow( "BlackJack", WINDOW_POSX, WINDOW_POSY, width+EXTRASPACE, height, 
+        SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI );
     // check for error !
     if ( window == NULL )
     {
@@ -1268,7 +8470,9 @@ SDL_Window* CreateWindow(int width, int height)
 }
 
 /**
- * CreateRenderer: Creates a renderer for the application
+ * CreateRenderer: Creates a renderer for the application. It draws in real
+ * pixels, with the positions of the layout table, instead of scaling a fixed
+ * logical size.
  * \param width width in px of the window
  * \param height height in px of the window
  * \param _window represents the window for which the renderer is associated
@@ -1277,6 +8481,8 @@ SDL_Window* CreateWindow(int width, int height)
 SDL_Renderer* CreateRenderer(int width, int height, SDL_Window *_window)
 {
     SDL_Renderer *renderer;
+    // cards and images are scaled to the window: filter them when scaling
+    SDL_SetHint( SDL_HINT_RENDER_SCALE_QUALITY, "linear" );
     // init renderer
     renderer = SDL_CreateRenderer( _window, -1, 0 );
 
@@ -1286,8 +8492,144 @@ SDL_Renderer* CreateRenderer(int width, int height, SDL_Window *_window)
         exit(EXIT_FAILURE);
     }
 
-    // set size of renderer to the same as window
-    SDL_RenderSetLogicalSize( renderer, width+EXTRASPACE, height );
-
     return renderer;
 }
+
+/**
+ * UpdateLayout: Recomputes the layout table if the size of the drawing area
+ * changed, and opens the font again at the new size
+ * \param layout layout table of the window
+ * \param _renderer renderer to handle all rendering in a window
+ * \param _target texture rendered to instead of the window, or NULL
+ * \param _logoIST texture with the IST logo image
+ * \param _font font used in the window, replaced if its size changes
+ */
+void UpdateLayout(Layout *layout, SDL_Renderer *_renderer, SDL_Texture *_target, 
+    SDL_Texture *_logoIST, TTF_Font **_font)
+{
+    int width, height;
+    int fontSize = layout->fontSize;
+
+    // output size in pixels, larger than the window size on HiDPI displays
+    if (_target != NULL)
+        SDL_QueryTexture(_target, NULL, NULL, &width, &height);
+    else
+        SDL_GetRendererOutputSize(_renderer, &width, &height);
+
+    if (width == layout->width && height == layout->height) return;
+    ComputeLayout(layout, width, height, _logoIST);
+
+    if (layout->fontSize != fontSize){
+        TTF_CloseFont(*_font);
+        *_font = LoadFont(layout->fontSize);
+    }
+}
+
+/**
+ * ComputeLayout: Computes the layout table for a drawing area. The positions
+ * of the WIDTH_WINDOW x HEIGHT_WINDOW design (plus EXTRASPACE for the right
+ * panel) are stretched to the area, while cards, logo and font keep their
+ * proportions and are scaled by the smaller of the two factors. At the design
+ * size the layout is the same as the one of the fixed window.
+ * \param layout layout table to fill
+ * \param width width in pixels of the drawing area
+ * \param height height in pixels of the drawing area
+ * \param _logoIST texture with the IST logo image
+ */
+void ComputeLayout(Layout *layout, int width, int height, SDL_Texture *_logoIST)
+{
+    double sx = (double) width / (WIDTH_WINDOW + EXTRASPACE);
+    double sy = (double) height / HEIGHT_WINDOW;
+    double scale = sx < sy ? sx : sy;
+    int separatorPos = (int)(0.95f*WIDTH_WINDOW); // seperates the left from the right part of the window
+    int seatWidth = separatorPos/WINDOW_SEATS-5;
+    int seatY = (int) (0.55f*HEIGHT_WINDOW);
+    int seatHeight = (int) (0.42f*HEIGHT_WINDOW);
+    int div = WIDTH_WINDOW/CARD_WIDTH;
+    int cardWidth = ScaleLength(CARD_WIDTH, scale);
+    int cardHeight = ScaleLength(CARD_HEIGHT, scale);
+    int logoWidth, logoHeight;
+    SDL_Rect banner;
+
+    layout->width = width;
+    layout->height = height;
+    layout->fontSize = ScaleLength(FONT_SIZE, scale);
+    if (layout->fontSize < 1) layout->fontSize = 1;
+    layout->textX = ScaleLength(separatorPos+3*MARGIN, sx);
+    layout->evPanelY = ScaleLength(seatY, sy);
+
+    ScaleRect(&layout->table, 0, 0, separatorPos, HEIGHT_WINDOW, sx, sy);
+    layout->logo.x = layout->table.w;
+    layout->logo.y = 0;
+    SDL_QueryTexture(_logoIST, NULL, NULL, &logoWidth, &logoHeight);
+    layout->logo.w = ScaleLength(logoWidth, scale);
+    layout->logo.h = ScaleLength(logoHeight, scale);
+
+    for (int i = 0; i < WINDOW_SEATS; i++){
+        ScaleRect(&layout->seats[i], i*seatWidth+10, seatY, seatWidth, seatHeight, sx, sy);
+        layout->seatLabels[i].x = ScaleLength(i*seatWidth+30, sx);
+        layout->seatLabels[i].y = ScaleLength(seatY-30, sy);
+
+        // bust and blackjack banner, in the middle of the player area
+        banner.x = (i*seatWidth+10) + seatWidth*0.2;
+        banner.y = seatY + seatHeight*0.4;
+        banner.w = seatWidth*0.6;
+        banner.h = seatHeight*0.2;
+        ScaleRect(&layout->banners[i], banner.x, banner.y, banner.w, banner.h, sx, sy);
+        layout->bustText[i].x = ScaleLength((int) (banner.x + banner.w/3.5), sx);
+        layout->bustText[i].y = ScaleLength(banner.y + banner.h/5, sy);
+        layout->blackjackText[i].x = ScaleLength(banner.x + banner.w/8, sx);
+        layout->blackjackText[i].y = layout->bustText[i].y;
+
+        // only 4 positions are available: later cards are shifted to the right
+        for (int card = 0; card < MAX_CARD_HAND; card++){
+            int pos = card % 4;
+            int x = (int) (i*((0.95f*WIDTH_WINDOW)/4-5)+(card/4)*12+15);
+            int y = seatY+10;
+
+            if ( pos == 1 || pos == 3) x += CARD_WIDTH + 30;
+            if ( pos == 2 || pos == 3) y += CARD_HEIGHT+ 10;
+            ScaleRect(&layout->playerCards[i][card], x, y, 0, 0, sx, sy);
+            layout->playerCards[i][card].w = cardWidth;
+            layout->playerCards[i][card].h = cardHeight;
+        }
+    }
+
+    // house cards are centered, so their position depends on the hand size
+    for (int numCards = 0; numCards <= MAX_CARD_HAND; numCards++){
+        for (int card = 0; card < numCards; card++){
+            int x = (div/2-numCards/2+card)*CARD_WIDTH + 15;
+            int y = (int) (0.26f*HEIGHT_WINDOW);
+
+            ScaleRect(&layout->houseCards[numCards][card], x, y, 0, 0, sx, sy);
+            layout->houseCards[numCards][card].w = cardWidth;
+            layout->houseCards[numCards][card].h = cardHeight;
+        }
+    }
+}
+
+/**
+ * ScaleRect: Scales a rectangle of the design size to the drawing area
+ * \param rect rectangle to fill
+ * \param x, y, w, h rectangle in the design size
+ * \param sx horizontal scale factor
+ * \param sy vertical scale factor
+ */
+void ScaleRect(SDL_Rect *rect, double x, double y, double w, double h, double sx, double sy)
+{
+    rect->x = ScaleLength(x, sx);
+    rect->y = ScaleLength(y, sy);
+    rect->w = ScaleLength(w, sx);
+    rect->h = ScaleLength(h, sy);
+}
+
+/**
+ * ScaleLength: Scales a length of the design size to the drawing area
+ * \param length length in the design size
+ * \param scale scale factor
+ * \return the length in pixels, rounded
+ */
+int ScaleLength(double length, double scale)
+{
+    return (int) (length * scale + 0.5);
+}
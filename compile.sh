@@ -1,6 +1,9 @@
 echo "Compiling blackjack"
 
-gcc BlackJackGUI.c -g -I/usr/local/include -Wall -pedantic -std=c99 -I/usr/include -lm -lSDL2 -lSDL2_ttf -lSDL2_image -o blackjack
+gcc BlackJackGUI.c -g -I/usr/local/include -Wall -pedantic -std=c99 -I/usr/include -pthread -ldl -lrt -lm -lSDL2 -lSDL2_ttf -lSDL2_image -o blackjack &&
+
+# example policy plugin, for --policy plugin --plugin ./dealer_policy.so
+gcc -shared -fPIC -g -Wall -pedantic -std=c99 dealer_policy.c -o dealer_policy.so
 
 #Check for compiling failure
 if [ "$?" = "0" ]; then
@@ -0,0 +1,39 @@
+/**
+ * @file
+ *
+ * Example policy plugin that plays like --policy dealer: doubles a 10
+ * or 11 where it is allowed and hits below 17. Build it with
+ *
+ *     gcc -shared -fPIC -Wall -pedantic -std=c99 dealer_policy.c -o dealer_policy.so
+ *
+ * and play it with --policy plugin --plugin ./dealer_policy.so
+ */
+
+#include "policy_plugin.h"
+
+/**
+ * @brief      Tells the ABI the plugin was built for
+ *
+ * @return     PLUGIN_ABI_VERSION of the header it was built with
+ */
+int PolicyAbiVersion(void){
+    return PLUGIN_ABI_VERSION;
+}
+
+/**
+ * @brief      Decides the move of every hand of a batch
+ *
+ * @param[in]  batch    ptr to the hands to decide
+ * @param[out] actions  ptr to array with the action of each hand
+ */
+void DecideBatch(const PolicyBatch * batch, uint8_t actions[]){
+    for (int i = 0; i < batch->count; i++){
+        int total = batch->total[i];
+
+        if (batch->canDouble[i] && (total == 10 || total == 11)){
+            actions[i] = ACTION_DOUBLE;
+        } else {
+            actions[i] = total < 17 ? ACTION_HIT : ACTION_STAND;
+        }
+    }
+}
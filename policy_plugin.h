@@ -0,0 +1,45 @@
+/**
+ * @file
+ *
+ * Policy plugin ABI, included by BlackJackGUI.c and by every plugin loaded
+ * with --policy plugin --plugin FILE. A plugin is a shared object that
+ * exports PolicyAbiVersion and DecideBatch; dealer_policy.c is an example.
+ * Any change to PolicyBatch or to the actions must bump PLUGIN_ABI_VERSION,
+ * so plugins built against an older header are refused when loaded.
+ */
+
+#ifndef POLICY_PLUGIN_H
+#define POLICY_PLUGIN_H
+
+#include <stdint.h>
+
+// policy plugin ABI macros
+#define PLUGIN_ABI_VERSION 1  // returned by PolicyAbiVersion of a compatible plugin
+#define PLUGIN_CARD_VALUES 10 // distinct card values: 2 to 10 and the ace
+#define ACTION_STAND 0        // actions a plugin decides
+#define ACTION_HIT 1
+#define ACTION_DOUBLE 2       // taken as ACTION_HIT where doubling isn't allowed
+
+/**
+ * Decisions asked to a policy plugin at once, one per hand, each field in an
+ * array of its own. DecideBatch writes ACTION_STAND, ACTION_HIT or
+ * ACTION_DOUBLE for each of the batch->count hands. It is called from every
+ * simulation thread at once, so it must not keep state between calls without
+ * locking it.
+ */
+typedef struct {
+    int32_t count;                    // hands in the batch
+    const int32_t * total;            // score of each hand
+    const uint8_t * soft;             // 1 if an ace of the hand counts 11
+    const uint8_t * numCards;         // cards in the hand
+    const uint8_t * canDouble;        // 1 if ACTION_DOUBLE is allowed
+    const int32_t * upCard;           // house up card, 2 to 11 (ace)
+    const int32_t * shoe[PLUGIN_CARD_VALUES];  // unseen cards of each value, 2
+                                      // to 10 and the ace, with the house hole card
+} PolicyBatch;
+
+//function declaration for the exports of a plugin
+int PolicyAbiVersion(void);
+void DecideBatch(const PolicyBatch *, uint8_t []);
+
+#endif